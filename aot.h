@@ -0,0 +1,139 @@
+#pragma once
+#include "vm.h"
+#include "include/gsc.h"
+
+// Script files compiled ahead of time by gsc_aot (examples/aot.c) into C, shipping builds load them without parsing
+// String indices in the instructions, constants and switch tables of a file are into its strings, they're interned on load
+
+typedef struct
+{
+	const char *name;
+	size_t parameter_count;
+	size_t local_count;
+	int line;
+	const Instruction *instructions;
+	int instruction_count;
+	const Constant *constants;
+	int constant_count;
+	const SwitchTable *switch_tables;
+	int switch_table_count;
+	int field_cache_count;
+	const uint8_t *line_table;
+	int line_table_size;
+	const int *boxed_locals;
+	int boxed_local_count;
+	const char *const *variable_names; // local_count of them
+	int (*native)(VM *vm);			   // See CompiledFunction.native
+} AotFunction;
+
+// Variable declared at file level, its instructions leave the value on the stack
+typedef struct
+{
+	const char *name;
+	const Instruction *instructions;
+	int instruction_count;
+	const Constant *constants;
+	int constant_count;
+} AotGlobal;
+
+typedef struct
+{
+	const char *name;
+	const char *const *strings;
+	int string_count;
+	const char *const *includes;
+	int include_count;
+	const char *const *file_references;
+	int file_reference_count;
+	const AotFunction *functions;
+	int function_count;
+	const AotGlobal *globals;
+	int global_count;
+} AotFile;
+
+// Adds a file like gsc_compile would, gsc_link still has to be called once every file is there
+GSC_API int gsc_load_precompiled(gsc_Context *ctx, const AotFile *file);
+
+// gsc_load_precompiled with the temporary memory to use, the data has to outlive the context (see cache.c)
+int load_precompiled(gsc_Context *ctx, const AotFile *file, Arena temp);
+
+// What the generated functions are made of
+// Each instruction is a case of a switch on sf->ip, so the function can be entered again at any instruction,
+// after a call returns or a wait is over. Anything without a fast path is run by the interpreter with vm_native_step
+
+#define AOT_TOP(I) (&thr->stack[thr->sp + (I)])
+#define AOT_PUSH(...) (thr->stack[thr->sp++] = (__VA_ARGS__))
+#define AOT_BOTH(TYPE) (AOT_TOP(-2)->type == (TYPE) && AOT_TOP(-1)->type == (TYPE))
+
+// Interprets instruction IP, carries on with the next one unless it jumped
+#define AOT_STEP(IP)                                           \
+	do                                                         \
+	{                                                          \
+		sf->ip = (IP) + 1;                                     \
+		int exit_ = vm_native_step(vm, &sf->instructions[IP]); \
+		if(exit_)                                              \
+			return exit_;                                      \
+		sf = &thr->frames[thr->bp];                            \
+		if(sf->ip != (IP) + 1)                                 \
+			goto dispatch;                                     \
+	} while(0)
+
+// The interpreter suspends the thread, once it resumes it comes back here at IP + 1
+#define AOT_YIELD(IP)               \
+	do                              \
+	{                               \
+		sf->ip = (IP);              \
+		return VM_NATIVE_INTERPRET; \
+	} while(0)
+
+#define AOT_PUSH_REF(SLOT)                         \
+	do                                             \
+	{                                              \
+		Variable ref_ = { .type = VAR_REFERENCE }; \
+		ref_.u.refval = &sf->locals[SLOT];         \
+		AOT_PUSH(ref_);                            \
+	} while(0)
+
+// The two operands on top are replaced by the result
+#define AOT_ARITH(FIELD, OP)                      \
+	do                                            \
+	{                                             \
+		Variable *b_ = AOT_TOP(-1), *a_ = b_ - 1; \
+		a_->u.FIELD = a_->u.FIELD OP b_->u.FIELD; \
+		thr->sp--;                                \
+	} while(0)
+
+#define AOT_COMPARE(FIELD, OP)                    \
+	do                                            \
+	{                                             \
+		Variable *b_ = AOT_TOP(-1), *a_ = b_ - 1; \
+		int64_t r_ = a_->u.FIELD OP b_->u.FIELD;  \
+		a_->u.ival = r_;                          \
+		a_->type = VAR_BOOLEAN;                   \
+		thr->sp--;                                \
+	} while(0)
+
+// Comparison, TEST and JZ in one, like OP_CMP_JZ
+#define AOT_COMPARE_JZ(FIELD, OP, TARGET, NEXT)                     \
+	do                                                              \
+	{                                                               \
+		thr->result = AOT_TOP(-2)->u.FIELD OP AOT_TOP(-1)->u.FIELD; \
+		thr->sp -= 2;                                               \
+		if(!thr->result)                                            \
+			goto TARGET;                                            \
+		goto NEXT;                                                  \
+	} while(0)
+
+// Values that don't need a reference count or write barrier, stored through a reference
+#define AOT_CAN_STORE() \
+	(AOT_TOP(-1)->type == VAR_REFERENCE && AOT_TOP(-2)->type <= VAR_VECTOR && AOT_TOP(-2)->type != VAR_STRING)
+
+#define AOT_STORE()                            \
+	do                                         \
+	{                                          \
+		*AOT_TOP(-1)->u.refval = *AOT_TOP(-2); \
+		thr->sp--;                             \
+	} while(0)
+
+#define AOT_CAN_TEST() (AOT_TOP(-1)->type == VAR_INTEGER || AOT_TOP(-1)->type == VAR_BOOLEAN)
+#define AOT_TEST() (thr->result = AOT_TOP(-1)->u.ival, thr->sp--)
@@ -127,7 +127,8 @@ typedef enum
 	AST_LITERAL_TYPE_FLOAT,
 	AST_LITERAL_TYPE_FUNCTION,
 	AST_LITERAL_TYPE_LOCALIZED_STRING,
-	AST_LITERAL_TYPE_UNDEFINED
+	AST_LITERAL_TYPE_UNDEFINED,
+	AST_LITERAL_TYPE_VECTOR
 } ASTLiteralType;
 
 typedef struct
@@ -0,0 +1,431 @@
+#include "cache.h"
+#include "ast.h"
+
+// Everything is at an offset from the start of the data, so it can be used where it's mapped
+// Offset 0 is the header, for anything else it means there's none
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t size;
+	uint32_t strings; // Offsets of the strings, string indices in the file are into these
+	uint32_t string_count;
+	uint32_t includes;
+	uint32_t include_count;
+	uint32_t file_references;
+	uint32_t file_reference_count;
+	uint32_t functions;
+	uint32_t function_count;
+	uint32_t globals;
+	uint32_t global_count;
+} CacheHeader;
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t parameter_count;
+	uint32_t local_count;
+	int32_t line;
+	uint32_t instructions;
+	uint32_t instruction_count;
+	uint32_t constants;
+	uint32_t constant_count;
+	uint32_t switch_tables;
+	uint32_t switch_table_count;
+	uint32_t field_cache_count;
+	uint32_t line_table;
+	uint32_t line_table_size;
+	uint32_t boxed_locals;
+	uint32_t boxed_local_count;
+	uint32_t variable_names; // Offsets of local_count names
+} CacheFunction;
+
+typedef struct
+{
+	int64_t min;
+	int32_t count;
+	int32_t default_target;
+	uint32_t entries;
+	uint32_t padding;
+} CacheSwitchTable;
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t instructions;
+	uint32_t instruction_count;
+	uint32_t constants;
+	uint32_t constant_count;
+} CacheGlobal;
+
+static const char cache_magic[4] = { 'G', 'S', 'C', 'C' };
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	for(size_t i = 0; i < size; i++)
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	return h;
+}
+
+uint64_t cache_key(const char *source, int flags, HashTrie *globals)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int version = CACHE_VERSION;
+	h = fnv1a(h, &version, sizeof(version));
+	// Renumbered opcodes make old files invalid too
+	for(int i = 0; i < OP_MAX; i++)
+		h = fnv1a(h, opcode_names[i], strlen(opcode_names[i]) + 1);
+	h = fnv1a(h, &flags, sizeof(flags));
+	for(HashTrieNode *it = globals->head; it; it = it->next)
+		h = fnv1a(h, it->key, strlen(it->key) + 1);
+	return fnv1a(h, source, strlen(source));
+}
+
+typedef struct
+{
+	char *data; // NULL while the size is measured
+	uint32_t size;
+	StringTable *strtab;
+	int *local; // String table index to index in the file, -1 if unused
+	int *used;
+	int count;
+} Writer;
+
+static uint32_t put(Writer *w, const void *p, size_t size, size_t align)
+{
+	w->size = (w->size + align - 1) & ~(uint32_t)(align - 1);
+	uint32_t offset = w->size;
+	if(w->data && p)
+		memcpy(w->data + offset, p, size);
+	w->size += size;
+	return offset;
+}
+
+static uint32_t put_string(Writer *w, const char *s)
+{
+	return put(w, s, strlen(s) + 1, 1);
+}
+
+static int local_string(Writer *w, int index)
+{
+	if(w->local[index] == -1)
+	{
+		w->local[index] = w->count;
+		w->used[w->count++] = index;
+	}
+	return w->local[index];
+}
+
+static uint32_t put_instructions(Writer *w, const Instruction *instructions, int count)
+{
+	uint32_t offset = put(w, NULL, 0, _Alignof(Instruction));
+	for(int i = 0; i < count; i++)
+	{
+		Instruction ins = instructions[i];
+		if((ins.opcode == OP_LOAD_FIELD || ins.opcode == OP_FIELD_REF) && ins.a)
+			ins.c = local_string(w, ins.c);
+		put(w, &ins, sizeof(ins), 1);
+	}
+	return offset;
+}
+
+static uint32_t put_constants(Writer *w, const Constant *constants, int count)
+{
+	uint32_t offset = put(w, NULL, 0, _Alignof(Constant));
+	for(int i = 0; i < count; i++)
+	{
+		Constant k = constants[i];
+		switch(k.type)
+		{
+			case AST_LITERAL_TYPE_STRING:
+			case AST_LITERAL_TYPE_LOCALIZED_STRING: k.value.string_index = local_string(w, k.value.string_index); break;
+			case AST_LITERAL_TYPE_FUNCTION:
+				k.value.function.function = local_string(w, k.value.function.function);
+				if(k.value.function.file != -1)
+					k.value.function.file = local_string(w, k.value.function.file);
+				break;
+		}
+		put(w, &k, sizeof(k), 1);
+	}
+	return offset;
+}
+
+static CacheFunction put_function(Writer *w, CompiledFunction *cf, Arena temp)
+{
+	CacheFunction f = { 0 };
+	f.name = put_string(w, cf->name);
+	f.parameter_count = cf->parameter_count;
+	f.local_count = cf->local_count;
+	f.line = cf->line;
+	f.instructions = put_instructions(w, cf->instructions, cf->instruction_count);
+	f.instruction_count = cf->instruction_count;
+	f.constants = put_constants(w, cf->constants, cf->constant_count);
+	f.constant_count = cf->constant_count;
+	f.field_cache_count = cf->field_cache_count;
+
+	CacheSwitchTable *tables = new(&temp, CacheSwitchTable, cf->switch_table_count);
+	for(int i = 0; i < cf->switch_table_count; i++)
+	{
+		SwitchTable *t = &cf->switch_tables[i];
+		bool strings = false;
+		for(int j = 0; j < cf->instruction_count; j++)
+		{
+			Instruction *ins = &cf->instructions[j];
+			strings |= ins->opcode == OP_SWITCH_HASH && ins->a && ins->c == i;
+		}
+		tables[i] = (CacheSwitchTable){ .min = t->min, .count = t->count, .default_target = t->default_target };
+		tables[i].entries = put(w, NULL, 0, _Alignof(SwitchEntry));
+		for(int j = 0; j < t->count; j++)
+		{
+			SwitchEntry e = t->entries[j];
+			if(strings && e.target != -1)
+				e.key = local_string(w, e.key);
+			put(w, &e, sizeof(e), 1);
+		}
+	}
+	f.switch_tables = put(w, tables, sizeof(CacheSwitchTable) * cf->switch_table_count, _Alignof(CacheSwitchTable));
+	f.switch_table_count = cf->switch_table_count;
+
+	f.line_table = put(w, cf->line_table, cf->line_table_size, 1);
+	f.line_table_size = cf->line_table_size;
+	f.boxed_locals = put(w, cf->boxed_locals, sizeof(int) * cf->boxed_local_count, _Alignof(int));
+	f.boxed_local_count = cf->boxed_local_count;
+	if(cf->variable_names && cf->local_count > 0)
+	{
+		uint32_t *names = new(&temp, uint32_t, cf->local_count);
+		for(size_t i = 0; i < cf->local_count; i++)
+			names[i] = cf->variable_names[i] ? put_string(w, cf->variable_names[i]) : 0;
+		f.variable_names = put(w, names, sizeof(uint32_t) * cf->local_count, _Alignof(uint32_t));
+	}
+	return f;
+}
+
+static uint32_t put_names(Writer *w, HashTrie *names, uint32_t *count, Arena temp)
+{
+	*count = 0;
+	for(HashTrieNode *it = names->head; it; it = it->next)
+		++*count;
+	uint32_t *offsets = new(&temp, uint32_t, *count);
+	int i = 0;
+	for(HashTrieNode *it = names->head; it; it = it->next)
+		offsets[i++] = put_string(w, it->key);
+	return put(w, offsets, sizeof(uint32_t) * *count, _Alignof(uint32_t));
+}
+
+static void serialize(Writer *w, CompiledFile *file, uint64_t key, const AotGlobal *globals, int global_count, Arena temp)
+{
+	w->local = new(&temp, int, w->strtab->index);
+	w->used = new(&temp, int, w->strtab->index);
+	w->count = 0;
+	for(int i = 0; i < w->strtab->index; i++)
+		w->local[i] = -1;
+
+	CacheHeader h = { .version = CACHE_VERSION, .key = key };
+	memcpy(h.magic, cache_magic, sizeof(h.magic));
+	put(w, NULL, sizeof(h), _Alignof(CacheHeader));
+	h.includes = put_names(w, &file->includes, &h.include_count, temp);
+	h.file_references = put_names(w, &file->file_references, &h.file_reference_count, temp);
+
+	// Functions of included files are only linked in, they're cached with their own file
+	for(HashTrieNode *it = file->functions.head; it; it = it->next)
+		h.function_count += ((CompiledFunction *)it->value)->file == file;
+	CacheFunction *functions = new(&temp, CacheFunction, h.function_count);
+	int n = 0;
+	for(HashTrieNode *it = file->functions.head; it; it = it->next)
+	{
+		CompiledFunction *cf = it->value;
+		if(cf->file == file)
+			functions[n++] = put_function(w, cf, temp);
+	}
+	h.functions = put(w, functions, sizeof(CacheFunction) * h.function_count, _Alignof(CacheFunction));
+
+	CacheGlobal *cache_globals = new(&temp, CacheGlobal, global_count);
+	for(int i = 0; i < global_count; i++)
+	{
+		const AotGlobal *g = &globals[i];
+		cache_globals[i].name = put_string(w, g->name);
+		cache_globals[i].instructions = put_instructions(w, g->instructions, g->instruction_count);
+		cache_globals[i].instruction_count = g->instruction_count;
+		cache_globals[i].constants = put_constants(w, g->constants, g->constant_count);
+		cache_globals[i].constant_count = g->constant_count;
+	}
+	h.globals = put(w, cache_globals, sizeof(CacheGlobal) * global_count, _Alignof(CacheGlobal));
+	h.global_count = global_count;
+
+	// Last, the functions and globals add to them
+	uint32_t *strings = new(&temp, uint32_t, w->count);
+	for(int i = 0; i < w->count; i++)
+		strings[i] = put_string(w, string_table_get(w->strtab, w->used[i]));
+	h.strings = put(w, strings, sizeof(uint32_t) * w->count, _Alignof(uint32_t));
+	h.string_count = w->count;
+
+	h.size = w->size;
+	if(w->data)
+		memcpy(w->data, &h, sizeof(h));
+}
+
+uint32_t cache_serialize(StringTable *strtab,
+						 CompiledFile *file,
+						 uint64_t key,
+						 const AotGlobal *globals,
+						 int global_count,
+						 Arena *arena,
+						 char **data)
+{
+	// Measured first, then written, the rest of the arena is scratch memory for both
+	Writer w = { .strtab = strtab };
+	serialize(&w, file, key, globals, global_count, *arena);
+	uint32_t size = w.size;
+	w.data = new(arena, char, size);
+	w.size = 0;
+	serialize(&w, file, key, globals, global_count, *arena);
+	*data = w.data;
+	return size;
+}
+
+void cache_write(gsc_Context *ctx,
+				 const char *name,
+				 const char *filename,
+				 uint64_t key,
+				 const AotGlobal *globals,
+				 int global_count,
+				 Arena temp)
+{
+	HashTrieNode *entry = hash_trie_upsert(&ctx->files, name, NULL, false);
+	if(!entry || !entry->value)
+		return;
+	CompiledFile *file = entry->value;
+	if(file->state != COMPILE_STATE_DONE)
+		return;
+	char *data;
+	uint32_t size = cache_serialize(&ctx->strtab, file, key, globals, global_count, &temp, &data);
+	ctx->options.write_cache(ctx->options.userdata, filename, data, size);
+}
+
+typedef struct
+{
+	const char *data;
+	uint32_t size;
+	bool error;
+} Reader;
+
+// Pointer to count items at offset, anything out of bounds means the data is broken
+static const void *get(Reader *r, uint32_t offset, uint32_t count, size_t size)
+{
+	if(offset > r->size || (uint64_t)count * size > r->size - offset)
+	{
+		r->error = true;
+		return NULL;
+	}
+	return count ? r->data + offset : NULL;
+}
+
+static const char *get_string(Reader *r, uint32_t offset)
+{
+	if(offset >= r->size || !memchr(r->data + offset, 0, r->size - offset))
+	{
+		r->error = true;
+		return "";
+	}
+	return r->data + offset;
+}
+
+static const char **get_names(Reader *r, uint32_t offset, uint32_t count, Arena *arena)
+{
+	const uint32_t *offsets = get(r, offset, count, sizeof(uint32_t));
+	const char **names = new(arena, const char *, count);
+	for(uint32_t i = 0; offsets && i < count; i++)
+		names[i] = offsets[i] ? get_string(r, offsets[i]) : NULL;
+	return names;
+}
+
+int cache_load(gsc_Context *ctx, const char *name, const char *source, const void *data, int size, uint64_t key, Arena temp)
+{
+	const CacheHeader *h = data;
+	if(size < (int)sizeof(CacheHeader) || memcmp(h->magic, cache_magic, sizeof(h->magic)) || h->version != CACHE_VERSION ||
+	   h->key != key || h->size != (uint32_t)size)
+		return GSC_NOT_FOUND;
+	Reader r = { .data = data, .size = size };
+
+	AotFile file = { .name = name };
+	file.strings = get_names(&r, h->strings, h->string_count, &temp);
+	file.string_count = h->string_count;
+	file.includes = get_names(&r, h->includes, h->include_count, &temp);
+	file.include_count = h->include_count;
+	file.file_references = get_names(&r, h->file_references, h->file_reference_count, &temp);
+	file.file_reference_count = h->file_reference_count;
+
+	const CacheFunction *functions = get(&r, h->functions, h->function_count, sizeof(CacheFunction));
+	AotFunction *aot_functions = new(&temp, AotFunction, h->function_count);
+	for(uint32_t i = 0; functions && i < h->function_count; i++)
+	{
+		const CacheFunction *src = &functions[i];
+		AotFunction *f = &aot_functions[i];
+		f->name = get_string(&r, src->name);
+		f->parameter_count = src->parameter_count;
+		f->local_count = src->local_count;
+		f->line = src->line;
+		f->instructions = get(&r, src->instructions, src->instruction_count, sizeof(Instruction));
+		f->instruction_count = src->instruction_count;
+		f->constants = get(&r, src->constants, src->constant_count, sizeof(Constant));
+		f->constant_count = src->constant_count;
+		f->field_cache_count = src->field_cache_count;
+		f->line_table = get(&r, src->line_table, src->line_table_size, 1);
+		f->line_table_size = src->line_table_size;
+		f->boxed_locals = get(&r, src->boxed_locals, src->boxed_local_count, sizeof(int));
+		f->boxed_local_count = src->boxed_local_count;
+		// Kept by the function, like the line table
+		if(src->variable_names)
+			f->variable_names = get_names(&r, src->variable_names, src->local_count, &ctx->perm);
+
+		const CacheSwitchTable *tables = get(&r, src->switch_tables, src->switch_table_count, sizeof(CacheSwitchTable));
+		SwitchTable *switch_tables = new(&temp, SwitchTable, src->switch_table_count);
+		for(uint32_t j = 0; tables && j < src->switch_table_count; j++)
+		{
+			switch_tables[j].min = tables[j].min;
+			switch_tables[j].count = tables[j].count;
+			switch_tables[j].default_target = tables[j].default_target;
+			switch_tables[j].entries = (SwitchEntry *)get(&r, tables[j].entries, tables[j].count, sizeof(SwitchEntry));
+		}
+		f->switch_tables = switch_tables;
+		f->switch_table_count = src->switch_table_count;
+	}
+	file.functions = aot_functions;
+	file.function_count = h->function_count;
+
+	const CacheGlobal *globals = get(&r, h->globals, h->global_count, sizeof(CacheGlobal));
+	AotGlobal *aot_globals = new(&temp, AotGlobal, h->global_count);
+	for(uint32_t i = 0; globals && i < h->global_count; i++)
+	{
+		aot_globals[i].name = get_string(&r, globals[i].name);
+		aot_globals[i].instructions = get(&r, globals[i].instructions, globals[i].instruction_count, sizeof(Instruction));
+		aot_globals[i].instruction_count = globals[i].instruction_count;
+		aot_globals[i].constants = get(&r, globals[i].constants, globals[i].constant_count, sizeof(Constant));
+		aot_globals[i].constant_count = globals[i].constant_count;
+	}
+	file.globals = aot_globals;
+	file.global_count = h->global_count;
+	if(r.error)
+		return GSC_NOT_FOUND;
+
+	// Compiled again if it doesn't verify
+	int result = load_precompiled(ctx, &file, temp);
+	CompiledFile *cf = hash_trie_upsert(&ctx->files, name, NULL, false)->value;
+	if(result != GSC_OK)
+	{
+		cf->state = COMPILE_STATE_NOT_STARTED;
+		hash_trie_init(&cf->functions);
+		return GSC_NOT_FOUND;
+	}
+	// Errors show the source like they would if it had been compiled
+	if(!cf->source)
+	{
+		size_t n = strlen(source);
+		char *copy = new(&ctx->perm, char, n + 1);
+		memcpy(copy, source, n + 1);
+		cf->source = copy;
+	}
+	return GSC_OK;
+}
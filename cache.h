@@ -0,0 +1,30 @@
+#pragma once
+#include "library.h"
+#include "aot.h"
+
+// Compiled files stored by gsc_CreateOptions.write_cache and loaded back with read_cache, see cache.c
+#define CACHE_VERSION (1)
+
+// Hash of everything the compiled code depends on, a cached file with another key is compiled again
+uint64_t cache_key(const char *source, int flags, HashTrie *globals);
+
+// GSC_OK once the file is loaded, GSC_NOT_FOUND if the data is stale or not a cached file
+int cache_load(gsc_Context *ctx, const char *name, const char *source, const void *data, int size, uint64_t key, Arena temp);
+
+// Serializes a compiled file into arena, string indices are into strtab
+uint32_t cache_serialize(StringTable *strtab,
+						 CompiledFile *file,
+						 uint64_t key,
+						 const AotGlobal *globals,
+						 int global_count,
+						 Arena *arena,
+						 char **data);
+
+// Serializes a compiled file and passes it to write_cache, globals are its file-level variables
+void cache_write(gsc_Context *ctx,
+				 const char *name,
+				 const char *filename,
+				 uint64_t key,
+				 const AotGlobal *globals,
+				 int global_count,
+				 Arena temp);
@@ -7,7 +7,8 @@
 #include <stdarg.h>
 #include "include/gsc.h"
 
-static void property(Compiler *c, ASTNode *n, int op);
+static int property(Compiler *c, ASTNode *n, int op);
+static void emit_field(Compiler *c, int opcode, int key);
 
 static Node *node(Compiler *c, Node **list)
 {
@@ -106,53 +107,79 @@ static void error(Compiler *c, const char *fmt, ...)
 		abort();
 }
 
-static Operand string(Compiler *c, const char *str)
+static int string(Compiler *c, const char *str)
 {
-	return (Operand) { .type = OPERAND_TYPE_INDEXED_STRING, .value.string_index = string_table_intern(c->strings, str) };
+	return string_table_intern(c->strings, str);
 }
 
-static Operand integer(int64_t i)
+static int constant(Compiler *c, Constant k)
 {
-	return (Operand) { .type = OPERAND_TYPE_INT, .value.integer = i };
+	for(int i = 0; i < c->constant_count; ++i)
+	{
+		if(c->constants[i].type != k.type)
+			continue;
+		if(k.type == AST_LITERAL_TYPE_VECTOR ? !memcmp(c->constants[i].value.vector, k.value.vector, sizeof(k.value.vector))
+											 : c->constants[i].value.integer == k.value.integer)
+			return i;
+	}
+	if(c->constant_count >= c->max_constant_count)
+		error(c, "Max constants reached");
+	c->constants[c->constant_count] = k;
+	return c->constant_count++;
 }
 
-static Operand number(float f)
+static int string_constant(Compiler *c, int type, const char *str)
 {
-	return (Operand) { .type = OPERAND_TYPE_FLOAT, .value.number = f };
+	Constant k = { .type = type, .value.integer = 0 };
+	k.value.string_index = string(c, str);
+	return constant(c, k);
 }
 
-static Operand NONE = { .type = OPERAND_TYPE_NONE };
+static int function_constant(Compiler *c, const char *function, const char *file)
+{
+	Constant k = { .type = AST_LITERAL_TYPE_FUNCTION, .value.integer = 0 };
+	k.value.function.function = string(c, function);
+	k.value.function.file = file ? string(c, file) : -1;
+	return constant(c, k);
+}
 
 static size_t emit_base(Compiler *c, Opcode op)
 {
 	if(c->instruction_count >= c->max_instruction_count)
 		error(c, "Max instructions reached");
-	Instruction *instr = &c->instructions[c->instruction_count];
+	size_t idx = c->instruction_count++;
+	Instruction *instr = &c->instructions[idx];
 	instr->opcode = op;
-	instr->offset = c->instruction_count;
-	instr->line = c->node ? c->node->line : 0;
+	instr->a = 0;
+	instr->b = 0;
+	instr->c = 0;
 	if(op == OP_JMP || op == OP_JZ || op == OP_JNZ)
-		instr->operands[0] = integer(-1);  /* patched later; -1 = unresolved */
-	c->instruction_count++;
-	return instr->offset;
+		instr->c = -1;  /* patched later; -1 = unresolved */
+	if(c->lines)
+		c->lines[idx] = c->node ? c->node->line : 0;
+	return idx;
 }
 
-static size_t emit_operands(Compiler *c, Opcode opcode, int operand_count, ...)
+static size_t emit_operands(Compiler *c, Opcode opcode, int a, int b, int32_t operand)
 {
 	size_t idx = emit_base(c, opcode);
-	va_list args;
-	va_start(args, operand_count);
-	for(int i = 0; i < operand_count; i++) {
-		c->instructions[idx].operands[i] = va_arg(args, Operand);
-	}
-	va_end(args);
+	Instruction *instr = &c->instructions[idx];
+	if(a < 0 || a > 0xff || b < 0 || b > 0xffff)
+		error(c, "Operand out of range");
+	instr->a = a;
+	instr->b = b;
+	instr->c = operand;
 	return idx;
 }
 
+static size_t push_string(Compiler *c, int type, const char *str)
+{
+	return emit_operands(c, OP_PUSH_CONST, 0, 0, string_constant(c, type, str));
+}
+
 #define emit(c, op) emit_base(c, op)
-#define emit1(c, op, o1) emit_operands(c, op, 1, o1)
-#define emit2(c, op, o1, o2) emit_operands(c, op, 2, o1, o2)
-#define emit4(c, op, o1, o2, o3, o4) emit_operands(c, op, 4, o1, o2, o3, o4)
+#define emit1(c, op, o) emit_operands(c, op, 0, 0, o)
+#define emit3(c, op, a, b, o) emit_operands(c, op, a, b, o)
 
 // Program counter
 static int ip(Compiler *c)
@@ -162,7 +189,7 @@ static int ip(Compiler *c)
 
 static size_t reljmp_(Compiler *c, Opcode opcode, int current, int destination)
 {
-	return emit1(c, opcode, integer(destination - current - 1));
+	return emit1(c, opcode, destination - current - 1);
 }
 
 static size_t reljmp_current(Compiler *c, Opcode opcode, int destination)
@@ -173,8 +200,8 @@ static size_t reljmp_current(Compiler *c, Opcode opcode, int destination)
 static void patch_reljmp(Compiler *c, size_t ins)
 {
 	int destination = ip(c);
-	int current = c->instructions[ins].offset;
-	c->instructions[ins].operands[0] = integer(destination - current - 1);
+	int current = ins;
+	c->instructions[ins].c = destination - current - 1;
 	// printf("  PATCH %s at ip=%zu -> dest=%d (rel=%d)\n",
 	//     opcode_names[c->instructions[ins].opcode], ins, destination, destination - current - 1);
 }
@@ -224,12 +251,12 @@ static void decrement_scope(Compiler *c, int continue_offset, int break_offset)
 
 		if(j->kind == JUMP_BREAK && scope->allows_break)
 		{
-			c->instructions[j->ip].operands[0] = integer(break_offset - (int)j->ip - 1);
+			c->instructions[j->ip].c = break_offset - (int)j->ip - 1;
 			j->ip = (size_t)-1;
 		}
 		else if(j->kind == JUMP_CONTINUE && scope->allows_continue && continue_offset != -1)
 		{
-			c->instructions[j->ip].operands[0] = integer(continue_offset - (int)j->ip - 1);
+			c->instructions[j->ip].c = continue_offset - (int)j->ip - 1;
 			j->ip = (size_t)-1;
 		}
 	}
@@ -269,21 +296,21 @@ static void callee(Compiler *c, ASTNode *n, int call_flags, int numarguments)
 			// visit(n->ast_member_expr_data.object); // Moved to ASTCallExpr
 			// call_flags |= VM_CALL_FLAG_METHOD;
 			
-			property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
+			int key = property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
 			visit(n->ast_member_expr_data.object);
-			emit(c, OP_LOAD_FIELD);
-			emit4(c, OP_CALL_PTR, NONE, NONE, integer(numarguments), integer(call_flags));
+			emit_field(c, OP_LOAD_FIELD, key);
+			emit3(c, OP_CALL_PTR, call_flags, numarguments, 0);
 		}
 		break;
 		case AST_IDENTIFIER:
 		{
-			emit4(c, OP_CALL, string(c, n->ast_identifier_data.name), NONE, integer(numarguments), integer(call_flags));
+			emit3(c, OP_CALL, call_flags, numarguments, function_constant(c, n->ast_identifier_data.name, NULL));
 		}
 		break;
 		case AST_FUNCTION_POINTER_EXPR:
 		{
 			visit(n->ast_function_pointer_expr_data.expression);
-			emit4(c, OP_CALL_PTR, NONE, NONE, integer(numarguments), integer(call_flags));
+			emit3(c, OP_CALL_PTR, call_flags, numarguments, 0);
 		}
 		break;
 		case AST_LITERAL:
@@ -295,12 +322,13 @@ static void callee(Compiler *c, ASTNode *n, int call_flags, int numarguments)
 				error(c, "Not a file reference");
 			if(lit->value.function.function->type != AST_IDENTIFIER)
 				error(c, "Not a identifier");
-			emit4(c,
+			emit3(c,
 				  OP_CALL,
-				  string(c, lit->value.function.function->ast_identifier_data.name),
-				  string(c, lit->value.function.file->ast_file_reference_data.file),
-				  integer(numarguments),
-				  integer(call_flags));
+				  call_flags,
+				  numarguments,
+				  function_constant(c,
+									lit->value.function.function->ast_identifier_data.name,
+									lit->value.function.file->ast_file_reference_data.file));
 		}
 		break;
 
@@ -423,51 +451,63 @@ IMPL_VISIT(ASTWhileStmt)
 
 IMPL_VISIT(ASTLiteral)
 {
-	size_t instr_idx = emit(c, OP_PUSH);
-	Instruction *instr = &c->instructions[instr_idx];
-	instr->operands[0] = integer(n->type);
 	switch(n->type)
 	{
 		case AST_LITERAL_TYPE_LOCALIZED_STRING:
 		case AST_LITERAL_TYPE_STRING:
 		{
-			instr->operands[1] = string(c, n->value.string);
+			push_string(c, n->type, n->value.string);
 		}
 		break;
 		case AST_LITERAL_TYPE_BOOLEAN:
 		{
-			instr->operands[1] = integer(n->value.boolean);
+			emit3(c, OP_PUSH, n->type, 0, n->value.boolean);
 		}
 		break;
 		case AST_LITERAL_TYPE_INTEGER:
 		{
-			instr->operands[1] = integer(n->value.integer);
+			if(n->value.integer >= INT32_MIN && n->value.integer <= INT32_MAX)
+			{
+				emit3(c, OP_PUSH, n->type, 0, (int32_t)n->value.integer);
+			}
+			else
+			{
+				Constant k = { .type = n->type, .value.integer = n->value.integer };
+				emit1(c, OP_PUSH_CONST, constant(c, k));
+			}
 		}
 		break;
 		case AST_LITERAL_TYPE_UNDEFINED:
 		{
-			instr->operands[1] = NONE;
+			emit3(c, OP_PUSH, n->type, 0, 0);
 		}
 		break;
 		case AST_LITERAL_TYPE_FLOAT:
 		{
-			instr->operands[1] = number(n->value.number);
+			int32_t bits;
+			memcpy(&bits, &n->value.number, sizeof(bits));
+			emit3(c, OP_PUSH, n->type, 0, bits);
+		}
+		break;
+		case AST_LITERAL_TYPE_VECTOR:
+		{
+			Constant k = { .type = n->type };
+			memcpy(k.value.vector, n->value.vector, sizeof(k.value.vector));
+			emit1(c, OP_PUSH_CONST, constant(c, k));
 		}
 		break;
 		case AST_LITERAL_TYPE_FUNCTION:
 		{
+			const char *file = c->path;
 			if(n->value.function.file)
 			{
 				if(n->value.function.file->type != AST_FILE_REFERENCE)
 					error(c, "Not a file reference");
-				instr->operands[2] = string(c, n->value.function.file->ast_file_reference_data.file);
-			} else
-			{
-				instr->operands[2] = string(c, c->path);
+				file = n->value.function.file->ast_file_reference_data.file;
 			}
 			if(n->value.function.function->type != AST_IDENTIFIER)
 				error(c, "Not a function identifier");
-			instr->operands[1] = string(c, n->value.function.function->ast_identifier_data.name);
+			emit1(c, OP_PUSH_CONST, function_constant(c, n->value.function.function->ast_identifier_data.name, file));
 		}
 		break;
 
@@ -484,7 +524,7 @@ IMPL_VISIT(ASTVectorExpr)
 	{
 		visit(n->elements[n->numelements - i - 1]);
 	}
-	emit1(c, OP_VECTOR, integer(n->numelements));
+	emit3(c, OP_VECTOR, 0, n->numelements, 0);
 }
 
 IMPL_VISIT(ASTIfStmt)
@@ -527,28 +567,46 @@ static bool is_expr(ASTNode *n)
 	return false;
 }
 
-static void property(Compiler *c, ASTNode *n, int op)
+// Strings like "3" are the same key as the integer 3, which may be in the array part of an object
+static bool is_index_string(const char *s)
+{
+	if(!*s || (s[0] == '0' && s[1]))
+		return false;
+	for(; *s; ++s)
+	{
+		if(*s < '0' || *s > '9')
+			return false;
+	}
+	return true;
+}
+
+// Keys known when compiling are returned as a lower-case string index for the a/c operand of the field instruction
+// Otherwise the key is pushed and folded by the VM, then it's -1
+static int property(Compiler *c, ASTNode *n, int op)
 {
 	if(op == '[')
 	{
 		if(!is_expr(n))
 			error(c, "Invalid node %s for property", ast_node_names[n->type]);
+		if(n->type == AST_LITERAL && n->ast_literal_data.type == AST_LITERAL_TYPE_STRING &&
+		   !is_index_string(n->ast_literal_data.value.string))
+			return string(c, lowercase(c, n->ast_literal_data.value.string));
 		visit(n);
-		return;
+		return -1;
 	}
 	switch(n->type)
 	{
 		case AST_IDENTIFIER:
 		{
-			emit4(c, OP_PUSH, integer(AST_LITERAL_TYPE_STRING), string(c, n->ast_identifier_data.name), NONE, NONE);
+			return string(c, lowercase(c, n->ast_identifier_data.name));
 		}
 		break;
 		case AST_MEMBER_EXPR:
 		{
 			// lvalue(c, n->ast_member_expr_data.object);
-			property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
+			int key = property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
 			visit(n->ast_member_expr_data.object);
-			emit(c, OP_LOAD_FIELD);
+			emit_field(c, OP_LOAD_FIELD, key);
 		}
 		break;
 		case AST_LITERAL:
@@ -558,12 +616,12 @@ static void property(Compiler *c, ASTNode *n, int op)
 			{
 				case AST_LITERAL_TYPE_STRING:
 				{
-					emit4(c, OP_PUSH, integer(lit->type), string(c, lit->value.string), NONE, NONE);
+					return string(c, lowercase(c, lit->value.string));
 				}
 				break;
 				// case AST_LITERAL_TYPE_INTEGER:
 				// {
-				// 	emit4(c, OP_PUSH, integer(lit->type), integer(lit->value.integer), NONE, NONE);
+				// 	emit3(c, OP_PUSH, lit->type, 0, lit->value.integer);
 				// }
 				// break;
 				default:
@@ -580,6 +638,15 @@ static void property(Compiler *c, ASTNode *n, int op)
 		}
 		break;
 	}
+	return -1;
+}
+
+static void emit_field(Compiler *c, int opcode, int key)
+{
+	if(key == -1)
+		emit(c, opcode);
+	else
+		emit3(c, opcode, 1, 0, key);
 }
 
 static int define_local_variable(Compiler *c, const char *name, bool is_parm)
@@ -593,12 +660,15 @@ static int define_local_variable(Compiler *c, const char *name, bool is_parm)
 			error(c, "Parameter '%s' already defined", name);
 		return *(int *)entry->value;
 	}
+	if(c->variable_index >= COMPILER_MAX_LOCALS)
+		error(c, "Too many local variables (%d)", COMPILER_MAX_LOCALS);
 	entry->value = new(c->arena, int, 1);
 	*(int *)entry->value = c->variable_index++;
 	return c->variable_index - 1;
 }
 
-static void identifier(Compiler *c, ASTNode *n)
+// Returns the local slot the reference is taken to, -1 for globals
+static int identifier(Compiler *c, ASTNode *n)
 {
 	HashTrieNode *entry = NULL;
 	if(c->globals)
@@ -606,15 +676,25 @@ static void identifier(Compiler *c, ASTNode *n)
 	if(!entry)
 	{
 		int idx = define_local_variable(c, n->ast_identifier_data.name, false);
-		emit4(c, OP_REF, integer(idx), NONE, NONE, NONE);
-	}
-	else
-	{
-		// emit2(c, OP_GLOBAL, string(c, n->ast_identifier_data.name), integer(1));
-		property(c, (ASTNode*)n, '.');
-		emit1(c, OP_GLOBAL, integer(1));
-		emit(c, OP_FIELD_REF);
+		emit1(c, OP_REF, idx);
+		return idx;
 	}
+	// emit2(c, OP_GLOBAL, string(c, n->ast_identifier_data.name), integer(1));
+	int key = property(c, (ASTNode*)n, '.');
+	emit3(c, OP_GLOBAL, 1, 0, 0);
+	emit_field(c, OP_FIELD_REF, key);
+	return -1;
+}
+
+// References from OP_REF are consumed by the next instruction, except the ones passed to waittill
+// These are held until the event arrives, so the local has to stay at the same address
+static void captured_identifier(Compiler *c, ASTNode *n)
+{
+	if(n->type != AST_IDENTIFIER)
+		error(c, "Expected identifier for waittill argument");
+	int idx = identifier(c, n);
+	if(idx != -1)
+		c->boxed_locals[idx] = true;
 }
 
 static void lvalue(Compiler *c, ASTNode *n)
@@ -623,7 +703,7 @@ static void lvalue(Compiler *c, ASTNode *n)
 	{
 		case AST_SELF:
 		{
-			emit4(c, OP_REF, integer(0), NONE, NONE, NONE);
+			emit1(c, OP_REF, 0);
 		}
 		break;
 
@@ -634,9 +714,9 @@ static void lvalue(Compiler *c, ASTNode *n)
 		break;
 		case AST_MEMBER_EXPR:
 		{
-			property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
+			int key = property(c, n->ast_member_expr_data.prop, n->ast_member_expr_data.op);
 			lvalue(c, n->ast_member_expr_data.object);
-			emit(c, OP_FIELD_REF);
+			emit_field(c, OP_FIELD_REF, key);
 		}
 		break;
 		
@@ -648,60 +728,140 @@ static void lvalue(Compiler *c, ASTNode *n)
 	}
 }
 
+static int switch_table(Compiler *c)
+{
+	if(!c->switch_tables)
+		error(c, "Switch outside of a function");
+	if(c->switch_table_count >= c->max_switch_table_count)
+	{
+		int n = c->max_switch_table_count * 2;
+		SwitchTable *tables = new(c->arena, SwitchTable, n);
+		memcpy(tables, c->switch_tables, sizeof(SwitchTable) * c->switch_table_count);
+		c->switch_tables = tables;
+		c->max_switch_table_count = n;
+	}
+	return c->switch_table_count++;
+}
+
+static int64_t switch_key(Compiler *c, ASTLiteral *lit)
+{
+	if(lit->type == AST_LITERAL_TYPE_INTEGER)
+		return lit->value.integer;
+	return string(c, lit->value.string);
+}
+
+// Cases that are all integer or all string literals dispatch through a table with one instruction
+// Dense integers index a jump table directly, the rest are hashed on the integer or interned string index
+// Other cases compare the discriminant against each case in order
 IMPL_VISIT(ASTSwitchStmt)
 {
 	increment_scope(c, (ASTNode*)n, 1, 0); /* break yes, continue no (bubbles up) */
 
-	ASTSwitchCase *default_case = NULL;
-	size_t case_jnz[256]; // TODO: increase limit
-	size_t numcases = 0;
-
+	size_t numcases = 0, integers = 0, strings = 0;
+	int64_t min = 0, max = 0;
 	for(ASTSwitchCase *it = n->cases; it; it = (ASTSwitchCase *)((ASTNode *)it)->next)
 	{
 		if(((ASTNode *)it)->type != AST_SWITCH_CASE)
 			error(c, "Expected case got '%s'", ast_node_names[((ASTNode *)it)->type]);
-
 		if(!it->test)
-		{
-			default_case = it;
 			continue;
+		ASTLiteral *lit = it->test->type == AST_LITERAL ? &it->test->ast_literal_data : NULL;
+		if(lit && lit->type == AST_LITERAL_TYPE_INTEGER)
+		{
+			if(!integers++ || lit->value.integer < min)
+				min = lit->value.integer;
+			if(integers == 1 || lit->value.integer > max)
+				max = lit->value.integer;
 		}
-		
-		visit(n->discriminant);
-		visit(it->test);
-		emit4(c, OP_BINOP, integer(TK_EQUAL), NONE, NONE, NONE);
-		emit(c, OP_TEST);
-		size_t jnz = emit(c, OP_JNZ);
-		if(numcases >= 256)
-			error(c, "Maximum amount of cases is 256");
-		case_jnz[numcases++] = jnz;
+		else if(lit && (lit->type == AST_LITERAL_TYPE_STRING || lit->type == AST_LITERAL_TYPE_LOCALIZED_STRING))
+		{
+			strings++;
+		}
+		numcases++;
 	}
+	bool table = numcases > 0 && (integers == numcases || strings == numcases);
+	bool jump_table = table && integers == numcases && (uint64_t)max - min < numcases * 2 + 8;
+
+	visit(n->discriminant);
+	int table_index = -1;
+	size_t *case_jnz = new(c->arena, size_t, numcases + 1);
 	int jmp_default = -1;
-	if(default_case)
+	if(table)
 	{
+		table_index = switch_table(c);
+		emit3(c, jump_table ? OP_JUMP_TABLE : OP_SWITCH_HASH, strings == numcases, 0, table_index);
+	}
+	else
+	{
+		// Evaluated once, the cases compare against a hidden local
+		int slot = define_local_variable(c, "$switch", false);
+		emit1(c, OP_REF, slot);
+		emit(c, OP_STORE);
+		emit(c, OP_POP);
+		size_t i = 0;
+		for(ASTSwitchCase *it = n->cases; it; it = (ASTSwitchCase *)((ASTNode *)it)->next)
+		{
+			if(!it->test)
+				continue;
+			emit1(c, OP_LOAD, slot);
+			visit(it->test);
+			emit1(c, OP_BINOP, TK_EQUAL);
+			emit(c, OP_TEST);
+			case_jnz[i++] = emit(c, OP_JNZ);
+		}
 		jmp_default = emit(c, OP_JMP);
 	}
-	
-	numcases = 0;
 
+	// Bodies are laid out in source order so falling through a case reaches the next one
+	int *targets = new(c->arena, int, numcases + 1);
+	int default_target = -1;
+	size_t i = 0;
 	for(ASTSwitchCase *it = n->cases; it; it = (ASTSwitchCase *)((ASTNode *)it)->next)
 	{
-		if(!it->test)
+		if(it->test)
 		{
-			continue;
+			if(!table)
+				patch_reljmp(c, case_jnz[i]);
+			targets[i++] = ip(c);
+		}
+		else
+		{
+			if(!table)
+				patch_reljmp(c, jmp_default);
+			default_target = ip(c);
 		}
-		patch_reljmp(c, case_jnz[numcases++]);
 		for(ASTNode *consequent = it->consequent; consequent; consequent = consequent->next)
 		{
 			visit(consequent);
 		}
 	}
-	if(default_case)
-	{
+	if(!table && default_target == -1)
 		patch_reljmp(c, jmp_default);
-		for(ASTNode *consequent = default_case->consequent; consequent; consequent = consequent->next)
+
+	if(table)
+	{
+		SwitchTable *t = &c->switch_tables[table_index];
+		t->min = min;
+		t->default_target = default_target == -1 ? ip(c) : default_target;
+		t->count = 2;
+		if(jump_table)
+			t->count = max - min + 1;
+		else
 		{
-			visit(consequent);
+			while(t->count < numcases * 2)
+				t->count *= 2;
+		}
+		t->entries = new(c->arena, SwitchEntry, t->count);
+		for(int k = 0; k < t->count; k++)
+		{
+			t->entries[k].key = jump_table ? min + k : 0;
+			t->entries[k].target = -1;
+		}
+		i = 0;
+		for(ASTSwitchCase *it = n->cases; it; it = (ASTSwitchCase *)((ASTNode *)it)->next)
+		{
+			if(it->test)
+				switch_insert(t, jump_table, switch_key(c, &it->test->ast_literal_data), targets[i++]);
 		}
 	}
 	decrement_scope(c, -1, ip(c));
@@ -752,17 +912,11 @@ IMPL_VISIT(ASTUnaryExpr)
 	switch (n->op)
 	{
 		case '-':
-		{
-			visit(n->argument);
-			emit(c, OP_CONST_0);
-			emit4(c, OP_BINOP, integer(n->op), NONE, NONE, NONE);
-		}
-		break;
 		case '!':
 		case '~':
 		{
 			visit(n->argument);
-			emit4(c, OP_UNARY, integer(n->op), NONE, NONE, NONE);
+			emit1(c, OP_UNARY, n->op);
 		}
 		break;
 		case TK_INCREMENT:
@@ -779,11 +933,11 @@ IMPL_VISIT(ASTUnaryExpr)
 			emit(c, OP_CONST_1);
 			if(n->op == TK_INCREMENT)
 			{
-				emit4(c, OP_BINOP, integer('+'), NONE, NONE, NONE);
+				emit1(c, OP_BINOP, '+');
 			}
 			else
 			{
-				emit4(c, OP_BINOP, integer('-'), NONE, NONE, NONE);
+				emit1(c, OP_BINOP, '-');
 			}
 			
 			lvalue(c, n->argument);
@@ -800,14 +954,14 @@ IMPL_VISIT(ASTUnaryExpr)
 }
 IMPL_VISIT(ASTMemberExpr)
 {
-	property(c, n->prop, n->op);
+	int key = property(c, n->prop, n->op);
 	visit(n->object);
-	emit(c, OP_LOAD_FIELD);
+	emit_field(c, OP_LOAD_FIELD, key);
 }
 
 IMPL_VISIT(ASTSelf)
 {
-	emit4(c, OP_LOAD, integer(0), NONE, NONE, NONE);
+	emit1(c, OP_LOAD, 0);
 }
 
 IMPL_VISIT(ASTIdentifier)
@@ -820,17 +974,17 @@ IMPL_VISIT(ASTIdentifier)
 		//entry = hash_trie_upsert(&c->variables, lowercase(c, n->name), NULL, false);
 		//if(!entry)
 		//	error(c, "No variable '%s'", n->name);
-		//emit4(c, OP_LOAD, integer(*(int *)entry->value), NONE, NONE, NONE);
+		//emit1(c, OP_LOAD, *(int *)entry->value);
 		// Create the local implicitly and default it to undefined
 		int idx = define_local_variable(c, n->name, false);
-		emit4(c, OP_LOAD, integer(idx), NONE, NONE, NONE);
+		emit1(c, OP_LOAD, idx);
 	}
 	else
 	{
 		// emit2(c, OP_GLOBAL, string(c, n->name), integer(0));
-		property(c, (ASTNode*)n, '.');
-		emit1(c, OP_GLOBAL, integer(0));
-		emit(c, OP_LOAD_FIELD);
+		int key = property(c, (ASTNode*)n, '.');
+		emit3(c, OP_GLOBAL, 0, 0, 0);
+		emit_field(c, OP_LOAD_FIELD, key);
 	}
 }
 IMPL_VISIT(ASTAssignmentExpr)
@@ -847,7 +1001,7 @@ IMPL_VISIT(ASTAssignmentExpr)
 		visit(n->lhs);
 		visit(n->rhs);
 		assert(n->op != TK_LOGICAL_AND && n->op != TK_LOGICAL_OR);
-		emit4(c, OP_BINOP, integer(n->op), NONE, NONE, NONE);
+		emit1(c, OP_BINOP, n->op);
 		lvalue(c, n->lhs);
 		emit(c, OP_STORE);
 		// visit(n->lhs);
@@ -866,7 +1020,7 @@ IMPL_VISIT(ASTBinaryExpr)
 			emit(c, OP_CONST_1);
 			visit(n->rhs);
 
-			emit4(c, OP_BINOP, integer(n->op), NONE, NONE, NONE);
+			emit1(c, OP_BINOP, n->op);
 			int jmp = emit(c, OP_JMP);
 			
 			patch_reljmp(c, jz);
@@ -883,7 +1037,7 @@ IMPL_VISIT(ASTBinaryExpr)
 			emit(c, OP_CONST_0);
 			visit(n->rhs);
 
-			emit4(c, OP_BINOP, integer(n->op), NONE, NONE, NONE);
+			emit1(c, OP_BINOP, n->op);
 			int jmp = emit(c, OP_JMP);
 			
 			patch_reljmp(c, jnz);
@@ -895,7 +1049,7 @@ IMPL_VISIT(ASTBinaryExpr)
 		{
 			visit(n->lhs);
 			visit(n->rhs);
-			emit4(c, OP_BINOP, integer(n->op), NONE, NONE, NONE);
+			emit1(c, OP_BINOP, n->op);
 		}
 		break;
 	}
@@ -924,12 +1078,12 @@ IMPL_VISIT(ASTCallExpr)
 		for(size_t i = 0; i < n->numarguments; ++i)
 		{
 			if(pass_as_ref && n->numarguments - 1 != i)
-				identifier(c, n->arguments[n->numarguments - i - 1]);
+				captured_identifier(c, n->arguments[n->numarguments - i - 1]);
 			else
 				visit(n->arguments[n->numarguments - i - 1]);
 		}
 		visit(n->object);
-		emit2(c, thread_op, integer(n->numarguments), NONE);
+		emit3(c, thread_op, 0, n->numarguments, 0);
 		return;
 	}
 
@@ -943,7 +1097,7 @@ IMPL_VISIT(ASTCallExpr)
 	for(size_t i = 0; i < n->numarguments; ++i)
 	{
 		if(pass_args_as_ref && n->numarguments - 1 != i)
-			identifier(c, n->arguments[n->numarguments - i - 1]);
+			captured_identifier(c, n->arguments[n->numarguments - i - 1]);
 		else
 			visit(n->arguments[n->numarguments - i - 1]);
 	}
@@ -965,10 +1119,10 @@ IMPL_VISIT(ASTCallExpr)
 		}
 		else
 		{
-			emit4(c, OP_LOAD, integer(0), NONE, NONE, NONE);
+			emit1(c, OP_LOAD, 0);
 		}
 	}
-	emit2(c, OP_PUSH, integer(AST_LITERAL_TYPE_INTEGER), integer(n->numarguments));
+	emit3(c, OP_PUSH, AST_LITERAL_TYPE_INTEGER, 0, n->numarguments);
 	callee(c, n->callee, call_flags, n->numarguments);
 }
 IMPL_VISIT(ASTExprStmt)
@@ -998,27 +1152,7 @@ IMPL_VISIT(ASTBlockStmt)
 
 static void print_instruction(Compiler *c, Instruction *instr)
 {
-	printf("%d: %s ", instr->offset, opcode_names[instr->opcode]);
-	for(size_t i = 0; i < MAX_OPERANDS; ++i)
-	{
-		if(instr->operands[i].type != OPERAND_TYPE_NONE)
-		{
-			switch(instr->operands[i].type)
-			{
-				case OPERAND_TYPE_INDEXED_STRING:
-					printf("%s ", string_table_get(c->strings, instr->operands[i].value.string_index));
-					break;
-				case OPERAND_TYPE_INT:
-					printf("%" PRId64" ", instr->operands[i].value.integer);
-				break;
-				case OPERAND_TYPE_FLOAT:
-					printf("%f ", instr->operands[i].value.number);
-				break;
-			}
-			// printf("%s ", operand_type_names[instr->operands[i].type]);
-		}
-	}
-	printf("\n");
+	printf("%d: %s %d %d %d\n", (int)(instr - c->instructions), opcode_names[instr->opcode], instr->a, instr->b, instr->c);
 }
 
 // void dump_instructions(Compiler *c, Instruction *instructions)
@@ -1036,6 +1170,8 @@ IMPL_VISIT(ASTFunction)
 
 int compile_node(Instruction *instructions,
 				 int max_instruction_count,
+				 Constant *constants,
+				 int max_constant_count,
 				 Compiler *c,
 				 Arena temp,
 				 ASTNode *n,
@@ -1043,6 +1179,7 @@ int compile_node(Instruction *instructions,
 				 StringTable *strtab, HashTrie *globals)
 {
 	hash_trie_init(&c->variables);
+	memset(c->boxed_locals, 0, sizeof(c->boxed_locals));
 	c->globals = globals;
 	c->arena = &temp;
 	c->strings = strtab;
@@ -1054,7 +1191,14 @@ int compile_node(Instruction *instructions,
 	c->instructions = instructions;
 	c->instruction_count = 0;
 	c->max_instruction_count = max_instruction_count;
+	c->lines = NULL;
+	c->constants = constants;
+	c->constant_count = 0;
+	c->max_constant_count = max_constant_count;
 	c->current_scope = 0;
+	c->switch_tables = NULL;
+	c->switch_table_count = 0;
+	c->max_switch_table_count = 0;
 	c->node = (ASTNode*)n;
 	visit(n);
 	c->arena = NULL;
@@ -1062,15 +1206,132 @@ int compile_node(Instruction *instructions,
 }
 
 
+static void write_varint(uint8_t *buf, int *n, uint32_t v)
+{
+	do
+	{
+		uint8_t byte = v & 0x7f;
+		v >>= 7;
+		if(v)
+			byte |= 0x80;
+		buf[(*n)++] = byte;
+	} while(v);
+}
+
+static void line_table(Compiler *c, Arena *perm, CompiledFunction *cf)
+{
+	cf->line_table = NULL;
+	cf->line_table_size = 0;
+	if(!c->lines || c->instruction_count == 0)
+		return;
+	// Two varints of at most 5 bytes for each instruction
+	uint8_t *buf = new(c->arena, uint8_t, c->instruction_count * 10);
+	int n = 0;
+	int prev_ip = 0, prev_line = 0;
+	for(int i = 0; i < c->instruction_count; i++)
+	{
+		int line = c->lines[i];
+		if(i > 0 && line == prev_line)
+			continue;
+		int delta = line - prev_line;
+		write_varint(buf, &n, i - prev_ip);
+		write_varint(buf, &n, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+		prev_ip = i;
+		prev_line = line;
+	}
+	cf->line_table = new(perm, uint8_t, n);
+	memcpy(cf->line_table, buf, n);
+	cf->line_table_size = n;
+}
+
+static bool is_comparison(int op)
+{
+	switch(op)
+	{
+		case '<':
+		case '>':
+		case TK_LEQUAL:
+		case TK_GEQUAL:
+		case TK_EQUAL:
+		case TK_NEQUAL: return true;
+	}
+	return false;
+}
+
+// Returns the number of instructions the superinstruction at ins stands for, 0 if there's none
+static int superinstruction(Instruction *ins, int n, Opcode *op)
+{
+	if(n >= 6 && ins[0].opcode == OP_LOAD
+		&& (ins[1].opcode == OP_CONST_1 || (ins[1].opcode == OP_PUSH && ins[1].a == AST_LITERAL_TYPE_INTEGER))
+		&& ins[2].opcode == OP_BINOP
+		&& (ins[2].c == '+' || ins[2].c == '-' || ins[2].c == TK_PLUS_ASSIGN || ins[2].c == TK_MINUS_ASSIGN)
+		&& ins[3].opcode == OP_REF && ins[3].c == ins[0].c && ins[4].opcode == OP_STORE && ins[5].opcode == OP_POP)
+	{
+		*op = OP_INC_LOCAL;
+		return 6;
+	}
+	if(n >= 3 && ins[0].opcode == OP_REF && ins[1].opcode == OP_STORE && ins[2].opcode == OP_POP)
+	{
+		*op = OP_STORE_LOCAL;
+		return 3;
+	}
+	if(n >= 3 && ins[0].opcode == OP_BINOP && is_comparison(ins[0].c) && ins[1].opcode == OP_TEST
+		&& ins[2].opcode == OP_JZ)
+	{
+		*op = OP_CMP_JZ;
+		return 3;
+	}
+	if(n >= 2 && ins[0].opcode == OP_TEST && (ins[1].opcode == OP_JZ || ins[1].opcode == OP_JNZ))
+	{
+		*op = ins[1].opcode == OP_JZ ? OP_TEST_JZ : OP_TEST_JNZ;
+		return 2;
+	}
+	if(n >= 2 && ins[0].opcode == OP_LOAD && ins[1].opcode == OP_LOAD_FIELD)
+	{
+		*op = OP_LOAD_LOCAL_FIELD;
+		return 2;
+	}
+	Opcode next;
+	if(n >= 2 && ins[0].opcode == OP_LOAD && ins[1].opcode == OP_LOAD && !superinstruction(ins + 1, n - 1, &next))
+	{
+		*op = OP_LOAD2;
+		return 2;
+	}
+	return 0;
+}
+
+// Picked from the most frequent opcode pairs in gsc_bench's histogram
+// Only the opcode of the first instruction is replaced, jumps into the middle of a sequence still run the originals
+static void fuse_instructions(Compiler *c)
+{
+	for(int i = 0; i < c->instruction_count;)
+	{
+		Opcode op;
+		int n = superinstruction(&c->instructions[i], c->instruction_count - i, &op);
+		if(!n)
+		{
+			i++;
+			continue;
+		}
+		c->instructions[i].opcode = op;
+		i += n;
+	}
+}
+
 int compile_function(Compiler *c, Arena *perm, Arena temp, ASTFunction *n, int *local_count, CompiledFunction *cf)
 {
 	hash_trie_init(&c->variables);
+	memset(c->boxed_locals, 0, sizeof(c->boxed_locals));
 	c->arena = &temp;
 	c->variable_index = 0;
 	c->current_scope = 0;
 	c->instruction_count = 0;
 	c->max_instruction_count = MAX_INSTRUCTIONS;
+	c->constant_count = 0;
 	c->jump_count = 0;
+	c->switch_table_count = 0;
+	c->max_switch_table_count = 8;
+	c->switch_tables = new(c->arena, SwitchTable, c->max_switch_table_count);
 
 	// debug_info_node(c, (ASTNode*)n);
 	c->node = (ASTNode*)n;
@@ -1099,13 +1360,58 @@ int compile_function(Compiler *c, Arena *perm, Arena temp, ASTFunction *n, int *
 	{
 		Instruction *ins = &c->instructions[i];
 		if((ins->opcode == OP_JMP || ins->opcode == OP_JZ || ins->opcode == OP_JNZ)
-			&& ins->operands[0].value.integer == -1)
+			&& ins->c == -1)
 		{
 			fprintf(stderr, "  \033[1;33mwarn\033[0m[compiler]: unresolved %s in %s::%s line %d (ip=%d)\n",
-				opcode_names[ins->opcode], c->path, n->name, ins->line, i);
-			ins->operands[0] = integer(0);
+				opcode_names[ins->opcode], c->path, n->name, c->lines ? c->lines[i] : -1, i);
+			ins->c = 0;
 		}
 	}
+	cf->boxed_local_count = 0;
+	for(int i = 0; i < c->variable_index; i++)
+		cf->boxed_local_count += c->boxed_locals[i];
+	cf->boxed_locals = cf->boxed_local_count ? new(perm, int, cf->boxed_local_count) : NULL;
+	for(int i = 0, j = 0; i < c->variable_index; i++)
+	{
+		if(c->boxed_locals[i])
+			cf->boxed_locals[j++] = i;
+	}
+	for(int i = 0; cf->boxed_local_count && i < c->instruction_count; i++)
+	{
+		Instruction *ins = &c->instructions[i];
+		if(ins->opcode == OP_LOAD && c->boxed_locals[ins->c])
+			ins->opcode = OP_LOAD_BOXED;
+		else if(ins->opcode == OP_REF && c->boxed_locals[ins->c])
+			ins->opcode = OP_REF_BOXED;
+	}
+	fuse_instructions(c);
+	cf->constant_count = c->constant_count;
+	cf->constants = new(perm, Constant, c->constant_count);
+	memcpy(cf->constants, c->constants, sizeof(Constant) * c->constant_count);
+	cf->call_targets = new(perm, CallTarget, c->constant_count);
+	cf->field_cache_count = 0;
+	for(int i = 0; i < c->instruction_count; i++)
+	{
+		Instruction *ins = &c->instructions[i];
+		if(ins->opcode != OP_LOAD_FIELD && ins->opcode != OP_FIELD_REF)
+			continue;
+		if(cf->field_cache_count >= UINT16_MAX)
+			error(c, "Too many field accesses in function");
+		ins->b = cf->field_cache_count++;
+	}
+	cf->field_caches = new(perm, FieldCache, cf->field_cache_count);
+	cf->switch_table_count = c->switch_table_count;
+	cf->switch_tables = new(perm, SwitchTable, c->switch_table_count);
+	for(int i = 0; i < c->switch_table_count; i++)
+	{
+		SwitchTable *t = &cf->switch_tables[i];
+		*t = c->switch_tables[i];
+		t->entries = new(perm, SwitchEntry, t->count);
+		memcpy(t->entries, c->switch_tables[i].entries, sizeof(SwitchEntry) * t->count);
+	}
+	for(int i = 0; i < cf->field_cache_count; i++)
+		cf->field_caches[i].key = -1;
+	line_table(c, perm, cf);
 	c->arena = NULL;
 	return c->instruction_count;
 }
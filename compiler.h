@@ -32,22 +32,32 @@ typedef struct
 } Scope;
 
 #define COMPILER_MAX_SCOPES (32)
+#define COMPILER_MAX_LOCALS (256)
 
 typedef struct
 {
 	size_t variable_index;
 	HashTrie variables;
+	bool boxed_locals[COMPILER_MAX_LOCALS]; // Locals that a reference is taken to which outlives the instruction
 	HashTrie *globals;
 	jmp_buf *jmp;
 
     Instruction *instructions;
+	int *lines; // Line for each instruction, NULL if not tracked
 	int instruction_count;
 	int max_instruction_count;
+	Constant *constants;
+	int constant_count;
+	int max_constant_count;
 	Arena *arena;
 	StringTable *strings;
 	Scope scopes[COMPILER_MAX_SCOPES];
 	size_t current_scope;
 
+	SwitchTable *switch_tables; // NULL when not compiling a function
+	int switch_table_count;
+	int max_switch_table_count;
+
 	PendingJump jumps[MAX_PENDING_JUMPS];
 	int jump_count;
 	// Makes debugging easier, set source if we still have source available and node to the statement for line number information
@@ -76,9 +86,13 @@ int compile_file(const char *path,
 				 StringTable *strtab,
 				 int flags,
 				 HashTrie *globals);
+// Compiles a function that compile_file only indexed (GSC_COMPILE_FLAG_LAZY) in place
+int compile_lazy_function(CompiledFunction *f, Arena *perm, Arena scratch, StringTable *strtab);
 
 int compile_node(Instruction *instructions,
 				 int max_instruction_count,
+				 Constant *constants,
+				 int max_constant_count,
 				 Compiler *c,
 				 Arena temp,
 				 ASTNode *n,
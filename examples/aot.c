@@ -0,0 +1,739 @@
+// Compiles scripts ahead of time into C that registers them with gsc_load_precompiled, see aot.h
+// gsc_aot [-o output.c] [-n register function] [-g global]... script...
+// The scripts and every file they reference end up in the output, level is a global unless -g is given
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gsc.h>
+#include "library.h"
+#include "ast.h"
+#include "lexer.h"
+
+static char *read_text_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if(!fp)
+		return NULL;
+	long n = 0;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	char *data = calloc(1, n + 1);
+	rewind(fp);
+	fread(data, 1, n, fp);
+	fclose(fp);
+	return data;
+}
+
+static void *allocate_memory(void *ctx, int size)
+{
+	return malloc(size);
+}
+
+static void free_memory(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const char *read_file(void *ctx, const char *filename, int *status)
+{
+	char temp[256];
+	snprintf(temp, sizeof(temp), "%s.gsc", filename);
+	char *data = read_text_file(temp);
+	if(!data)
+	{
+		*status = GSC_NOT_FOUND;
+		return NULL;
+	}
+	*status = GSC_OK;
+	return data;
+}
+
+static FILE *out;
+
+// File-level variables, in the order gsc_compile ran them
+typedef struct
+{
+	char file[256];
+	const char *name;
+	Instruction *instructions;
+	int instruction_count;
+	Constant *constants;
+	int constant_count;
+} Global;
+
+static Global globals[256];
+static int global_count;
+static const char *compiling;
+
+static void add_global(void *userdata,
+					   const char *name,
+					   const Instruction *instructions,
+					   int instruction_count,
+					   const Constant *constants,
+					   int constant_count)
+{
+	if(global_count >= 256)
+		return;
+	Global *g = &globals[global_count++];
+	// Named like gsc_compile_source names the file
+	const char *sep = strrchr(compiling, '.');
+	snprintf(g->file, sizeof(g->file), "%.*s", sep ? (int)(sep - compiling) : (int)strlen(compiling), compiling);
+	g->name = strdup(name);
+	g->instructions = malloc(sizeof(Instruction) * instruction_count);
+	memcpy(g->instructions, instructions, sizeof(Instruction) * instruction_count);
+	g->instruction_count = instruction_count;
+	g->constants = malloc(sizeof(Constant) * (constant_count + 1));
+	memcpy(g->constants, constants, sizeof(Constant) * constant_count);
+	g->constant_count = constant_count;
+}
+
+static int compile(gsc_Context *ctx, const char *filename)
+{
+	compiling = filename;
+	return compile_script(ctx, filename, 0, add_global, NULL);
+}
+
+static void string_literal(const char *s)
+{
+	if(!s)
+	{
+		fprintf(out, "NULL");
+		return;
+	}
+	fputc('"', out);
+	for(; *s; s++)
+	{
+		unsigned char ch = *s;
+		if(ch == '"' || ch == '\\')
+			fprintf(out, "\\%c", ch);
+		else if(ch < 0x20 || ch >= 0x7f)
+			fprintf(out, "\\%03o", ch);
+		else
+			fputc(ch, out);
+	}
+	fputc('"', out);
+}
+
+static void float_literal(float f)
+{
+	fprintf(out, "%af", f);
+}
+
+// Strings of a file get indices of their own, the ones of the string table differ between runs
+typedef struct
+{
+	StringTable *table;
+	int *local; // String table index to index in the file, -1 if unused
+	int *used;
+	int count;
+} Strings;
+
+static int local_string(Strings *s, int index)
+{
+	if(s->local[index] == -1)
+	{
+		s->local[index] = s->count;
+		s->used[s->count++] = index;
+	}
+	return s->local[index];
+}
+
+static const char *c_arithmetic(int op, bool integer)
+{
+	switch(op)
+	{
+		case '+': case TK_PLUS_ASSIGN: return "+";
+		case '-': case TK_MINUS_ASSIGN: return "-";
+		case '*': case TK_MUL_ASSIGN: return "*";
+	}
+	if(!integer)
+		return NULL;
+	switch(op)
+	{
+		case '&': case TK_AND_ASSIGN: return "&";
+		case '|': case TK_OR_ASSIGN: return "|";
+		case '^': case TK_XOR_ASSIGN: return "^";
+	}
+	return NULL;
+}
+
+static const char *c_comparison(int op)
+{
+	switch(op)
+	{
+		case '<': return "<";
+		case '>': return ">";
+		case TK_LEQUAL: return "<=";
+		case TK_GEQUAL: return ">=";
+		case TK_EQUAL: return "==";
+		case TK_NEQUAL: return "!=";
+	}
+	return NULL;
+}
+
+static bool constant_literal(CompiledFunction *cf, Instruction *ins)
+{
+	switch(ins->opcode)
+	{
+		case OP_UNDEF: fprintf(out, "(Variable){ .type = VAR_UNDEFINED }"); return true;
+		case OP_CONST_0:
+		case OP_CONST_1: fprintf(out, "(Variable){ .u.ival = %d, .type = VAR_INTEGER }", ins->opcode == OP_CONST_1); return true;
+		case OP_PUSH:
+			switch(ins->a)
+			{
+				case AST_LITERAL_TYPE_FLOAT:
+				{
+					float f;
+					memcpy(&f, &ins->c, sizeof(f));
+					fprintf(out, "(Variable){ .u.fval = ");
+					float_literal(f);
+					fprintf(out, ", .type = VAR_FLOAT }");
+				}
+				return true;
+				case AST_LITERAL_TYPE_BOOLEAN: fprintf(out, "(Variable){ .u.ival = %d, .type = VAR_BOOLEAN }", ins->c); return true;
+				case AST_LITERAL_TYPE_INTEGER: fprintf(out, "(Variable){ .u.ival = %d, .type = VAR_INTEGER }", ins->c); return true;
+				case AST_LITERAL_TYPE_UNDEFINED: fprintf(out, "(Variable){ .type = VAR_UNDEFINED }"); return true;
+			}
+			return false;
+		case OP_PUSH_CONST:
+		{
+			Constant *k = &cf->constants[ins->c];
+			if(k->type == AST_LITERAL_TYPE_INTEGER)
+			{
+				fprintf(out, "(Variable){ .u.ival = %lldLL, .type = VAR_INTEGER }", (long long)k->value.integer);
+				return true;
+			}
+			if(k->type == AST_LITERAL_TYPE_VECTOR)
+			{
+				fprintf(out, "(Variable){ .u.vval = { ");
+				for(int i = 0; i < 3; i++)
+				{
+					float_literal(k->value.vector[i]);
+					fprintf(out, i < 2 ? ", " : " }, .type = VAR_VECTOR }");
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+static void mark_target(bool *targets, int n, int ip)
+{
+	if(ip >= 0 && ip < n)
+		targets[ip] = true;
+}
+
+// Inline switch on an integer key, JUMP_TABLE and SWITCH_HASH without strings
+static void emit_switch(CompiledFunction *cf, int ip)
+{
+	SwitchTable *t = &cf->switch_tables[cf->instructions[ip].c];
+	fprintf(out, "\t\tif(AOT_TOP(-1)->type == VAR_INTEGER || AOT_TOP(-1)->type == VAR_BOOLEAN)\n\t\t{\n");
+	fprintf(out, "\t\t\tint64_t key = AOT_TOP(-1)->u.ival;\n\t\t\tthr->sp--;\n\t\t\tswitch(key)\n\t\t\t{\n");
+	for(int i = 0; i < t->count; i++)
+	{
+		if(t->entries[i].target != -1)
+			fprintf(out, "\t\t\t\tcase %lldLL: goto L%d;\n", (long long)t->entries[i].key, t->entries[i].target);
+	}
+	fprintf(out, "\t\t\t}\n\t\t\tgoto L%d;\n\t\t}\n", t->default_target);
+	fprintf(out, "\t\tAOT_STEP(%d);\n", ip);
+}
+
+static void emit_instruction(CompiledFunction *cf, int ip)
+{
+	Instruction *ins = &cf->instructions[ip];
+	switch(ins->opcode)
+	{
+		case OP_NOP: return;
+		case OP_WAIT:
+		case OP_WAITTILL: fprintf(out, "\t\tAOT_YIELD(%d);\n", ip); return;
+		case OP_JMP: fprintf(out, "\t\tgoto L%d;\n", ip + 1 + ins->c); return;
+		case OP_JZ: fprintf(out, "\t\tif(!thr->result)\n\t\t\tgoto L%d;\n", ip + 1 + ins->c); return;
+		case OP_JNZ: fprintf(out, "\t\tif(thr->result)\n\t\t\tgoto L%d;\n", ip + 1 + ins->c); return;
+
+		// The rest of a superinstruction follows as instructions of their own
+		case OP_INC_LOCAL:
+			fprintf(out, "\t\tif(sf->locals[%d].type == VAR_INTEGER)\n\t\t{\n", ins->c);
+			fprintf(out, "\t\t\tsf->locals[%d].u.ival %s= %d;\n", ins->c,
+					ins[2].c == '+' || ins[2].c == TK_PLUS_ASSIGN ? "+" : "-",
+					ins[1].opcode == OP_CONST_1 ? 1 : ins[1].c);
+			fprintf(out, "\t\t\tgoto L%d;\n\t\t}\n", ip + 6);
+			// Falls back to the load it starts with
+		case OP_LOAD:
+		case OP_LOAD2:
+		case OP_LOAD_LOCAL_FIELD:
+		case OP_REF_BOXED: fprintf(out, "\t\tAOT_PUSH(sf->locals[%d]);\n", ins->c); return;
+		case OP_LOAD_BOXED: fprintf(out, "\t\tAOT_PUSH(*sf->locals[%d].u.refval);\n", ins->c); return;
+		case OP_REF:
+		case OP_STORE_LOCAL: fprintf(out, "\t\tAOT_PUSH_REF(%d);\n", ins->c); return;
+
+		case OP_UNDEF:
+		case OP_CONST_0:
+		case OP_CONST_1:
+		case OP_PUSH:
+		case OP_PUSH_CONST:
+		{
+			long at = ftell(out);
+			fprintf(out, "\t\tAOT_PUSH(");
+			if(constant_literal(cf, ins))
+			{
+				fprintf(out, ");\n");
+				return;
+			}
+			fseek(out, at, SEEK_SET);
+		}
+		break;
+
+		case OP_POP: fprintf(out, "\t\tif(AOT_TOP(-1)->type != VAR_OBJECT)\n\t\t\tthr->sp--;\n\t\telse\n\t"); break;
+		case OP_STORE: fprintf(out, "\t\tif(AOT_CAN_STORE())\n\t\t\tAOT_STORE();\n\t\telse\n\t"); break;
+		case OP_TEST:
+		case OP_TEST_JZ:
+		case OP_TEST_JNZ: fprintf(out, "\t\tif(AOT_CAN_TEST())\n\t\t\tAOT_TEST();\n\t\telse\n\t"); break;
+
+		case OP_BINOP:
+		{
+			const char *cmp = c_comparison(ins->c);
+			const char *integer = c_arithmetic(ins->c, true);
+			const char *real = c_arithmetic(ins->c, false);
+			if(cmp)
+			{
+				fprintf(out, "\t\tif(AOT_BOTH(VAR_INTEGER))\n\t\t\tAOT_COMPARE(ival, %s);\n", cmp);
+				fprintf(out, "\t\telse if(AOT_BOTH(VAR_FLOAT))\n\t\t\tAOT_COMPARE(fval, %s);\n\t\telse\n\t", cmp);
+			}
+			else if(integer)
+			{
+				fprintf(out, "\t\tif(AOT_BOTH(VAR_INTEGER))\n\t\t\tAOT_ARITH(ival, %s);\n", integer);
+				if(real)
+					fprintf(out, "\t\telse if(AOT_BOTH(VAR_FLOAT))\n\t\t\tAOT_ARITH(fval, %s);\n", real);
+				fprintf(out, "\t\telse\n\t");
+			}
+		}
+		break;
+
+		case OP_CMP_JZ:
+		{
+			const char *cmp = c_comparison(ins->c);
+			int target = ip + 3 + ins[2].c;
+			fprintf(out, "\t\tif(AOT_BOTH(VAR_INTEGER))\n\t\t\tAOT_COMPARE_JZ(ival, %s, L%d, L%d);\n", cmp, target, ip + 3);
+			fprintf(out, "\t\tif(AOT_BOTH(VAR_FLOAT))\n\t\t\tAOT_COMPARE_JZ(fval, %s, L%d, L%d);\n", cmp, target, ip + 3);
+		}
+		break;
+
+		case OP_JUMP_TABLE: emit_switch(cf, ip); return;
+		case OP_SWITCH_HASH:
+			if(!ins->a)
+			{
+				emit_switch(cf, ip);
+				return;
+			}
+			break;
+	}
+	fprintf(out, "\t\tAOT_STEP(%d);\n", ip);
+}
+
+static void emit_native(CompiledFunction *cf, const char *name, Arena temp)
+{
+	int n = cf->instruction_count;
+	bool *targets = new(&temp, bool, n);
+	for(int ip = 0; ip < n; ip++)
+	{
+		Instruction *ins = &cf->instructions[ip];
+		switch(ins->opcode)
+		{
+			case OP_JMP:
+			case OP_JZ:
+			case OP_JNZ: mark_target(targets, n, ip + 1 + ins->c); break;
+			case OP_INC_LOCAL: mark_target(targets, n, ip + 6); break;
+			case OP_CMP_JZ:
+				mark_target(targets, n, ip + 3);
+				mark_target(targets, n, ip + 3 + ins[2].c);
+				break;
+			case OP_JUMP_TABLE:
+			case OP_SWITCH_HASH:
+			{
+				SwitchTable *t = &cf->switch_tables[ins->c];
+				mark_target(targets, n, t->default_target);
+				for(int i = 0; i < t->count; i++)
+					mark_target(targets, n, t->entries[i].target);
+			}
+			break;
+		}
+	}
+	fprintf(out, "static int %s(VM *vm)\n{\n", name);
+	fprintf(out, "\tThread *thr = vm->thread;\n\tStackFrame *sf = &thr->frames[thr->bp];\n");
+	fprintf(out, "dispatch:\n\tswitch(sf->ip)\n\t{\n");
+	for(int ip = 0; ip < n; ip++)
+	{
+		fprintf(out, "\tcase %d: // %s\n", ip, opcode_names[cf->instructions[ip].opcode]);
+		if(targets[ip])
+			fprintf(out, "\tL%d:\n", ip);
+		emit_instruction(cf, ip);
+	}
+	fprintf(out, "\t}\n\treturn VM_NATIVE_INTERPRET;\n}\n\n");
+}
+
+static void collect_strings(CompiledFunction *cf, Strings *s)
+{
+	for(int i = 0; i < cf->instruction_count; i++)
+	{
+		Instruction *ins = &cf->instructions[i];
+		if((ins->opcode == OP_LOAD_FIELD || ins->opcode == OP_FIELD_REF) && ins->a)
+			local_string(s, ins->c);
+		if(ins->opcode == OP_SWITCH_HASH && ins->a)
+		{
+			SwitchTable *t = &cf->switch_tables[ins->c];
+			for(int k = 0; k < t->count; k++)
+			{
+				if(t->entries[k].target != -1)
+					local_string(s, t->entries[k].key);
+			}
+		}
+	}
+	for(int i = 0; i < cf->constant_count; i++)
+	{
+		Constant *k = &cf->constants[i];
+		if(k->type == AST_LITERAL_TYPE_STRING || k->type == AST_LITERAL_TYPE_LOCALIZED_STRING)
+			local_string(s, k->value.string_index);
+		if(k->type == AST_LITERAL_TYPE_FUNCTION)
+		{
+			local_string(s, k->value.function.function);
+			if(k->value.function.file != -1)
+				local_string(s, k->value.function.file);
+		}
+	}
+}
+
+static void emit_instructions(CompiledFunction *cf, const char *prefix, Strings *s)
+{
+	fprintf(out, "static const Instruction %s_instructions[] = {\n", prefix);
+	for(int i = 0; i < cf->instruction_count; i++)
+	{
+		Instruction ins = cf->instructions[i];
+		if((ins.opcode == OP_LOAD_FIELD || ins.opcode == OP_FIELD_REF) && ins.a)
+			ins.c = s->local[ins.c];
+		fprintf(out, "\t{ OP_%s, %d, %d, %d },\n", opcode_names[ins.opcode], ins.a, ins.b, ins.c);
+	}
+	fprintf(out, "};\n");
+}
+
+static void emit_constants(CompiledFunction *cf, const char *prefix, Strings *s)
+{
+	if(cf->constant_count == 0)
+		return;
+	fprintf(out, "static const Constant %s_constants[] = {\n", prefix);
+	for(int i = 0; i < cf->constant_count; i++)
+	{
+		Constant *k = &cf->constants[i];
+		fprintf(out, "\t{ .type = %d, ", k->type);
+		switch(k->type)
+		{
+			case AST_LITERAL_TYPE_STRING:
+			case AST_LITERAL_TYPE_LOCALIZED_STRING:
+				fprintf(out, ".value.string_index = %d", s->local[k->value.string_index]);
+				break;
+			case AST_LITERAL_TYPE_FUNCTION:
+				fprintf(out,
+						".value.function = { %d, %d }",
+						s->local[k->value.function.function],
+						k->value.function.file == -1 ? -1 : s->local[k->value.function.file]);
+				break;
+			case AST_LITERAL_TYPE_VECTOR:
+				fprintf(out, ".value.vector = { ");
+				for(int j = 0; j < 3; j++)
+				{
+					float_literal(k->value.vector[j]);
+					fprintf(out, j < 2 ? ", " : " }");
+				}
+				break;
+			default: fprintf(out, ".value.integer = %lldLL", (long long)k->value.integer); break;
+		}
+		fprintf(out, " },\n");
+	}
+	fprintf(out, "};\n");
+}
+
+static void emit_function(CompiledFunction *cf, const char *prefix, Strings *s, Arena temp)
+{
+	fprintf(out, "// %s::%s\n", cf->file->name, cf->name);
+	emit_instructions(cf, prefix, s);
+
+	emit_constants(cf, prefix, s);
+
+	for(int i = 0; i < cf->switch_table_count; i++)
+	{
+		SwitchTable *t = &cf->switch_tables[i];
+		bool strings = false;
+		for(int j = 0; j < cf->instruction_count; j++)
+			strings |= cf->instructions[j].opcode == OP_SWITCH_HASH && cf->instructions[j].a && cf->instructions[j].c == i;
+		fprintf(out, "static SwitchEntry %s_switch_%d[] = {", prefix, i);
+		for(int j = 0; j < t->count; j++)
+		{
+			int64_t key = t->entries[j].key;
+			if(strings && t->entries[j].target != -1)
+				key = s->local[key];
+			fprintf(out, "%s{ %lldLL, %d }", j == 0 ? "\n\t" : j % 4 ? ", " : ",\n\t", (long long)key, t->entries[j].target);
+		}
+		fprintf(out, "\n};\n");
+	}
+	if(cf->switch_table_count > 0)
+	{
+		fprintf(out, "static const SwitchTable %s_switch_tables[] = {\n", prefix);
+		for(int i = 0; i < cf->switch_table_count; i++)
+		{
+			SwitchTable *t = &cf->switch_tables[i];
+			fprintf(out, "\t{ %lldLL, %d, %d, %s_switch_%d },\n", (long long)t->min, t->count, t->default_target, prefix, i);
+		}
+		fprintf(out, "};\n");
+	}
+
+	if(cf->line_table_size > 0)
+	{
+		fprintf(out, "static const uint8_t %s_lines[] = {", prefix);
+		for(int i = 0; i < cf->line_table_size; i++)
+			fprintf(out, "%s%d", i == 0 ? "\n\t" : i % 16 ? ", " : ",\n\t", cf->line_table[i]);
+		fprintf(out, "\n};\n");
+	}
+	if(cf->boxed_local_count > 0)
+	{
+		fprintf(out, "static const int %s_boxed[] = {", prefix);
+		for(int i = 0; i < cf->boxed_local_count; i++)
+			fprintf(out, "%s%d", i ? ", " : " ", cf->boxed_locals[i]);
+		fprintf(out, " };\n");
+	}
+	if(cf->local_count > 0 && cf->variable_names)
+	{
+		fprintf(out, "static const char *const %s_names[] = {", prefix);
+		for(size_t i = 0; i < cf->local_count; i++)
+		{
+			fprintf(out, i ? ", " : " ");
+			string_literal(cf->variable_names[i]);
+		}
+		fprintf(out, " };\n");
+	}
+	fprintf(out, "\n");
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s_native", prefix);
+	emit_native(cf, name, temp);
+}
+
+#define ARRAY_OR_NULL(COUNT, FORMAT, ...)          \
+	do                                             \
+	{                                              \
+		if(COUNT)                                  \
+			fprintf(out, FORMAT ", ", __VA_ARGS__); \
+		else                                       \
+			fprintf(out, "NULL, ");                \
+	} while(0)
+
+static void emit_file(gsc_Context *ctx, CompiledFile *file, int index, Arena temp)
+{
+	StringTable *table = &ctx->strtab;
+	Strings s = { .table = table };
+	s.local = new(&temp, int, table->index);
+	s.used = new(&temp, int, table->index);
+	for(int i = 0; i < table->index; i++)
+		s.local[i] = -1;
+
+	// Functions of included files are only linked in, they're emitted with the file they come from
+	int count = 0;
+	for(HashTrieNode *it = file->functions.head; it; it = it->next)
+	{
+		CompiledFunction *cf = it->value;
+		if(cf->file != file)
+			continue;
+		collect_strings(cf, &s);
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "f%d_%d", index, count++);
+		emit_function(cf, prefix, &s, temp);
+	}
+
+	int globals_in_file = 0;
+	for(int j = 0; j < global_count; j++)
+	{
+		Global *g = &globals[j];
+		if(strcmp(g->file, file->name))
+			continue;
+		CompiledFunction initializer = { .instructions = g->instructions,
+										 .instruction_count = g->instruction_count,
+										 .constants = g->constants,
+										 .constant_count = g->constant_count };
+		collect_strings(&initializer, &s);
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "f%d_global_%d", index, globals_in_file++);
+		emit_instructions(&initializer, prefix, &s);
+		emit_constants(&initializer, prefix, &s);
+	}
+	if(globals_in_file > 0)
+	{
+		fprintf(out, "static const AotGlobal f%d_globals[] = {\n", index);
+		for(int j = 0, k = 0; j < global_count; j++)
+		{
+			Global *g = &globals[j];
+			if(strcmp(g->file, file->name))
+				continue;
+			fprintf(out, "\t{ ");
+			string_literal(g->name);
+			fprintf(out, ", f%d_global_%d_instructions, %d, ", index, k, g->instruction_count);
+			ARRAY_OR_NULL(g->constant_count, "f%d_global_%d_constants", index, k);
+			fprintf(out, "%d },\n", g->constant_count);
+			k++;
+		}
+		fprintf(out, "};\n");
+	}
+
+	fprintf(out, "// %s\n", file->name);
+	fprintf(out, "static const AotFunction f%d_functions[] = {\n", index);
+	int i = 0;
+	for(HashTrieNode *it = file->functions.head; it; it = it->next)
+	{
+		CompiledFunction *cf = it->value;
+		if(cf->file != file)
+			continue;
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "f%d_%d", index, i++);
+		fprintf(out, "\t{ ");
+		string_literal(cf->name);
+		fprintf(out, ", %d, %d, %d, %s_instructions, %d, ", (int)cf->parameter_count, (int)cf->local_count, cf->line, prefix, cf->instruction_count);
+		ARRAY_OR_NULL(cf->constant_count, "%s_constants", prefix);
+		fprintf(out, "%d, ", cf->constant_count);
+		ARRAY_OR_NULL(cf->switch_table_count, "%s_switch_tables", prefix);
+		fprintf(out, "%d, %d, ", cf->switch_table_count, cf->field_cache_count);
+		ARRAY_OR_NULL(cf->line_table_size, "%s_lines", prefix);
+		fprintf(out, "%d, ", cf->line_table_size);
+		ARRAY_OR_NULL(cf->boxed_local_count, "%s_boxed", prefix);
+		fprintf(out, "%d, ", cf->boxed_local_count);
+		ARRAY_OR_NULL(cf->local_count > 0 && cf->variable_names, "%s_names", prefix);
+		fprintf(out, "%s_native },\n", prefix);
+	}
+	fprintf(out, "};\n");
+
+	fprintf(out, "static const char *const f%d_strings[] = {", index);
+	for(int j = 0; j < s.count; j++)
+	{
+		fprintf(out, j ? ",\n\t" : "\n\t");
+		string_literal(string_table_get(table, s.used[j]));
+	}
+	fprintf(out, "%s};\n", s.count ? "\n" : " NULL ");
+
+	const HashTrie *lists[] = { &file->includes, &file->file_references };
+	const char *names[] = { "includes", "references" };
+	int counts[2] = { 0 };
+	for(int j = 0; j < 2; j++)
+	{
+		fprintf(out, "static const char *const f%d_%s[] = {", index, names[j]);
+		for(HashTrieNode *it = lists[j]->head; it; it = it->next, counts[j]++)
+		{
+			fprintf(out, counts[j] ? ", " : " ");
+			string_literal(it->key);
+		}
+		fprintf(out, "%s};\n", counts[j] ? " " : " NULL ");
+	}
+
+	fprintf(out, "static const AotFile f%d = { ", index);
+	string_literal(file->name);
+	fprintf(out,
+			", f%d_strings, %d, f%d_includes, %d, f%d_references, %d, f%d_functions, %d, ",
+			index,
+			s.count,
+			index,
+			counts[0],
+			index,
+			counts[1],
+			index,
+			count);
+	ARRAY_OR_NULL(globals_in_file, "f%d_globals", index);
+	fprintf(out, "%d };\n\n", globals_in_file);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL;
+	const char *function = "gsc_aot_register";
+	const char *globals[64];
+	const char *scripts[256];
+	int global_count = 0, script_count = 0;
+	for(int i = 1; i < argc; i++)
+	{
+		if(!strcmp(argv[i], "-o") && i + 1 < argc)
+			output = argv[++i];
+		else if(!strcmp(argv[i], "-n") && i + 1 < argc)
+			function = argv[++i];
+		else if(!strcmp(argv[i], "-g") && i + 1 < argc && global_count < 64)
+			globals[global_count++] = argv[++i];
+		else if(script_count < 256)
+			scripts[script_count++] = argv[i];
+	}
+	if(script_count == 0)
+	{
+		fprintf(stderr, "usage: gsc_aot [-o output.c] [-n register function] [-g global]... script...\n");
+		return 1;
+	}
+	if(global_count == 0)
+		globals[global_count++] = "level";
+
+	gsc_CreateOptions opts = { .allocate_memory = allocate_memory,
+							   .free_memory = free_memory,
+							   .read_file = read_file,
+							   .main_memory_size = 256 * 1024 * 1024,
+							   .string_table_memory_size = 16 * 1024 * 1024,
+							   .temp_memory_size = 32 * 1024 * 1024,
+							   .max_threads = 16,
+							   .default_self = "level" };
+	gsc_Context *ctx = gsc_create(opts);
+	if(!ctx)
+	{
+		fprintf(stderr, "Failed to create context\n");
+		return 1;
+	}
+	// The compiler only emits global lookups for names that are globals when it runs
+	for(int i = 0; i < global_count; i++)
+	{
+		gsc_add_object(ctx);
+		gsc_set_global(ctx, globals[i]);
+	}
+	for(int i = 0; i < script_count; i++)
+	{
+		int result = compile(ctx, scripts[i]);
+		const char *dep;
+		while(result == GSC_OK && (dep = gsc_next_compile_dependency(ctx)))
+			result = compile(ctx, dep);
+		if(result != GSC_OK)
+		{
+			fprintf(stderr, "Failed to compile '%s' (result: %d)\n", scripts[i], result);
+			return 1;
+		}
+	}
+	// Includes are copied into the files that include them
+	if(gsc_link(ctx) != GSC_OK)
+		return 1;
+
+	out = output ? fopen(output, "wb") : stdout;
+	if(!out)
+	{
+		fprintf(stderr, "Can't write '%s'\n", output);
+		return 1;
+	}
+	fprintf(out, "// Generated by gsc_aot, compiled with the gsc sources it was generated with\n");
+	fprintf(out, "#include \"aot.h\"\n\n");
+	int count = 0;
+	for(HashTrieNode *it = ctx->files.head; it; it = it->next)
+	{
+		CompiledFile *file = it->value;
+		if(file->state == COMPILE_STATE_DONE)
+			emit_file(ctx, file, count++, ctx->temp);
+	}
+	fprintf(out, "int %s(gsc_Context *ctx)\n{\n", function);
+	fprintf(out, "\tstatic const AotFile *files[] = {");
+	for(int i = 0; i < count; i++)
+		fprintf(out, "%s&f%d", i ? ", " : " ", i);
+	fprintf(out, " };\n");
+	fprintf(out, "\tfor(int i = 0; i < %d; i++)\n\t{\n", count);
+	fprintf(out, "\t\tint result = gsc_load_precompiled(ctx, files[i]);\n");
+	fprintf(out, "\t\tif(result != GSC_OK)\n\t\t\treturn result;\n\t}\n\treturn GSC_OK;\n}\n");
+	if(out != stdout)
+		fclose(out);
+	gsc_destroy(ctx);
+	return 0;
+}
@@ -0,0 +1,154 @@
+// Interpreter microbenchmark, built from the library sources with VM_PROFILE so the instruction counter is available
+// gsc_bench [script] [function] [runs] [histogram entries] [jit threshold]
+// The instruction count only covers what the interpreter runs, not machine code from the JIT
+// gsc_bench_aot runs examples/bench compiled ahead of time by gsc_aot instead
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <gsc.h>
+#include "library.h"
+
+static char *read_text_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if(!fp)
+		return NULL;
+	long n = 0;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	char *data = calloc(1, n + 1);
+	rewind(fp);
+	fread(data, 1, n, fp);
+	fclose(fp);
+	return data;
+}
+
+static void *allocate_memory(void *ctx, int size)
+{
+	return malloc(size);
+}
+
+static void free_memory(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const char *read_file(void *ctx, const char *filename, int *status)
+{
+	char temp[256];
+	snprintf(temp, sizeof(temp), "%s.gsc", filename);
+	char *data = read_text_file(temp);
+	if(!data)
+	{
+		*status = GSC_NOT_FOUND;
+		return NULL;
+	}
+	*status = GSC_OK;
+	return data;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static gsc_PoolStats pool_stats[16];
+static int pool_count;
+static gsc_EventStats event_stats;
+
+static int run(const char *file, const char *function, double *elapsed, uint64_t *instructions, int histogram, int jit)
+{
+	gsc_CreateOptions opts = { .allocate_memory = allocate_memory,
+							   .free_memory = free_memory,
+							   .read_file = read_file,
+							   .main_memory_size = 256 * 1024 * 1024,
+							   .string_table_memory_size = 16 * 1024 * 1024,
+							   .temp_memory_size = 32 * 1024 * 1024,
+							   .max_threads = 1 << 16,
+							   .default_self = "level",
+							   .jit = jit > 0,
+							   .jit_threshold = jit };
+	gsc_Context *ctx = gsc_create(opts);
+	if(!ctx)
+	{
+		fprintf(stderr, "Failed to create context\n");
+		return GSC_ERROR;
+	}
+	gsc_add_tagged_object(ctx, "#level");
+	gsc_set_global(ctx, "level");
+
+	void register_script_functions(gsc_Context * ctx);
+	register_script_functions(ctx);
+
+#ifdef GSC_BENCH_AOT
+	// Generated by gsc_aot from examples/bench, the file argument has to name that
+	int gsc_aot_register(gsc_Context * ctx);
+	int result = gsc_aot_register(ctx);
+#else
+	int result = gsc_compile(ctx, file, 0);
+	const char *dep;
+	while(result == GSC_OK && (dep = gsc_next_compile_dependency(ctx)))
+		result = gsc_compile(ctx, dep, 0);
+#endif
+	if(result == GSC_OK)
+		result = gsc_link(ctx);
+	if(result != GSC_OK)
+	{
+		fprintf(stderr, "Failed to compile '%s' (result: %d)\n", file, result);
+		gsc_destroy(ctx);
+		return result;
+	}
+
+	double start = seconds();
+	gsc_call(ctx, file, function, 0);
+	while(GSC_OK != gsc_update(ctx, 1.f / 20.f))
+	{
+	}
+	*elapsed = seconds() - start;
+	*instructions = ctx->vm->profile.instructions;
+	if(histogram > 0)
+		vm_profile_dump(ctx->vm, stdout, histogram);
+	pool_count = gsc_pool_stats(ctx, pool_stats, 16);
+	gsc_event_stats(ctx, &event_stats);
+	gsc_destroy(ctx);
+	return GSC_OK;
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = argc > 1 ? argv[1] : "examples/bench";
+	const char *function = argc > 2 ? argv[2] : "main";
+	int runs = argc > 3 ? atoi(argv[3]) : 5;
+	int histogram = argc > 4 ? atoi(argv[4]) : 0;
+	int jit = argc > 5 ? atoi(argv[5]) : 0;
+	if(runs < 1)
+		runs = 1;
+
+	double best = 0.0;
+	uint64_t instructions = 0;
+	for(int i = 0; i < runs; ++i)
+	{
+		double elapsed;
+		if(run(file, function, &elapsed, &instructions, i == runs - 1 ? histogram : 0, jit) != GSC_OK)
+			return 1;
+		if(i == 0 || elapsed < best)
+			best = elapsed;
+	}
+	printf("%s::%s\n", file, function);
+	printf("instructions: %" PRIu64 "\n", instructions);
+	printf("best of %d: %.3f ms\n", runs, best * 1000.0);
+	printf("%.2f M instructions/sec\n", best > 0.0 ? (double)instructions / best / 1e6 : 0.0);
+	for(int i = 0; i < pool_count && i < 16; ++i)
+		printf("pool %-14s %4d bytes, %7d used / %7d allocated in %d chunks\n",
+			   pool_stats[i].name,
+			   pool_stats[i].item_size,
+			   pool_stats[i].used,
+			   pool_stats[i].allocated,
+			   pool_stats[i].chunks);
+	printf("events deferred %d, peak backlog %d\n", event_stats.deferred, event_stats.peak_queued);
+	return 0;
+}
@@ -29,17 +29,14 @@ static char *read_text_file(const char *path)
 	return data;
 }
 
-char *heap;
 void *allocate_memory(void *ctx, int size)
 {
-	char *current = heap;
-	heap += size;
-	return current;
+	return malloc(size);
 }
 
 void free_memory(void *ctx, void *ptr)
 {
-	// free(ptr);
+	free(ptr);
 }
 
 const char *read_file(void *ctx, const char *filename, int *status)
@@ -56,6 +53,57 @@ const char *read_file(void *ctx, const char *filename, int *status)
 	return data;
 }
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Compiled files go to $GSC_CACHE/<file>.gscc, mapped instead of compiled on the next run
+static const char *cache_directory;
+
+static void cache_path(char *path, size_t size, const char *filename)
+{
+	int n = snprintf(path, size, "%s/", cache_directory);
+	for(const char *p = filename; *p && n < (int)size - 6; p++)
+		path[n++] = *p == '/' || *p == '\\' ? '_' : *p;
+	snprintf(path + n, size - n, ".gscc");
+}
+
+static const void *read_cache(void *ctx, const char *filename, int *size)
+{
+	char path[512];
+	cache_path(path, sizeof(path), filename);
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	struct stat st;
+	void *data = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+	// Stays mapped until the process exits, the context uses it in place
+	*size = (int)st.st_size;
+	return data;
+}
+
+static void write_cache(void *ctx, const char *filename, const void *data, int size)
+{
+	char path[512], temp[530];
+	cache_path(path, sizeof(path), filename);
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+	FILE *fp = fopen(temp, "wb");
+	if(!fp)
+		return;
+	bool written = fwrite(data, 1, size, fp) == (size_t)size;
+	if(fclose(fp) == 0 && written)
+		rename(temp, path);
+	else
+		remove(temp);
+}
+#endif
+
 static int f_example_entity_method(gsc_Context *ctx)
 {
 	printf("example_entity_method(%s)\n", gsc_get_string(ctx, 0));
@@ -77,9 +125,6 @@ int main(int argc, char **argv)
 {
 	assert(argc > 1);
 	const char *input_file = argv[1];
-	char *mem = malloc(1024 * 1024 * 128);
-
-	heap = mem;
 	gsc_CreateOptions opts = { .allocate_memory = allocate_memory,
 							   .free_memory = free_memory,
 							   .read_file = read_file,
@@ -90,6 +135,14 @@ int main(int argc, char **argv)
 							   .verbose = 0,
 							   .max_threads = 1024,
 							   .default_self = "level" };
+#ifndef _WIN32
+	cache_directory = getenv("GSC_CACHE");
+	if(cache_directory)
+	{
+		opts.read_cache = read_cache;
+		opts.write_cache = write_cache;
+	}
+#endif
 	gsc_Context *ctx = gsc_create(opts);
 	if(!ctx)
 	{
@@ -115,7 +168,11 @@ int main(int argc, char **argv)
 	void register_script_functions(gsc_Context *ctx);
 	register_script_functions(ctx);
 	
-	int result = gsc_compile(ctx, input_file, 0);
+	int flags = getenv("GSC_LAZY") ? GSC_COMPILE_FLAG_LAZY : GSC_COMPILE_FLAG_NONE;
+	int result = gsc_compile(ctx, input_file, flags);
+	const char *dep;
+	while(result == GSC_OK && (dep = gsc_next_compile_dependency(ctx)))
+		result = gsc_compile(ctx, dep, flags);
 	if(result == GSC_OK)
 	{
 		result = gsc_link(ctx);
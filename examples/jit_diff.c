@@ -0,0 +1,159 @@
+// Runs scripts once in the interpreter and again with the JIT compiling every function, the output has to be the same
+// gsc_jit_diff [script...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <gsc.h>
+
+static char *read_text_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if(!fp)
+		return NULL;
+	long n = 0;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	char *data = calloc(1, n + 1);
+	rewind(fp);
+	fread(data, 1, n, fp);
+	fclose(fp);
+	return data;
+}
+
+static void *allocate_memory(void *ctx, int size)
+{
+	return malloc(size);
+}
+
+static void free_memory(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static const char *read_file(void *ctx, const char *filename, int *status)
+{
+	char temp[256];
+	snprintf(temp, sizeof(temp), "%s.gsc", filename);
+	char *data = read_text_file(temp);
+	if(!data)
+	{
+		*status = GSC_NOT_FOUND;
+		return NULL;
+	}
+	*status = GSC_OK;
+	return data;
+}
+
+static int run(const char *file, int jit, int jit_threshold)
+{
+	gsc_CreateOptions opts = { .allocate_memory = allocate_memory,
+							   .free_memory = free_memory,
+							   .read_file = read_file,
+							   .main_memory_size = 256 * 1024 * 1024,
+							   .string_table_memory_size = 16 * 1024 * 1024,
+							   .temp_memory_size = 32 * 1024 * 1024,
+							   .max_threads = 1 << 16,
+							   .default_self = "level",
+							   .jit = jit,
+							   .jit_threshold = jit_threshold };
+	gsc_Context *ctx = gsc_create(opts);
+	if(!ctx)
+		return GSC_ERROR;
+	gsc_add_tagged_object(ctx, "#level");
+	gsc_set_global(ctx, "level");
+
+	void register_script_functions(gsc_Context * ctx);
+	register_script_functions(ctx);
+
+	int result = gsc_compile(ctx, file, 0);
+	const char *dep;
+	while(result == GSC_OK && (dep = gsc_next_compile_dependency(ctx)))
+		result = gsc_compile(ctx, dep, 0);
+	if(result == GSC_OK)
+		result = gsc_link(ctx);
+	if(result == GSC_OK)
+	{
+		gsc_call(ctx, file, "main", 0);
+		while(GSC_OK != gsc_update(ctx, 1.f / 20.f))
+		{
+		}
+	}
+	gsc_destroy(ctx);
+	return result;
+}
+
+// Everything the script prints, stdout and stderr, from a child process so a crash only fails this script
+static char *capture(const char *file, int jit, int jit_threshold, int *status)
+{
+	FILE *out = tmpfile();
+	if(!out)
+		return NULL;
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		dup2(fileno(out), STDOUT_FILENO);
+		dup2(fileno(out), STDERR_FILENO);
+		int result = run(file, jit, jit_threshold);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(result == GSC_OK ? 0 : 1);
+	}
+	waitpid(pid, status, 0);
+	long n = ftell(out);
+	char *data = calloc(1, n + 1);
+	rewind(out);
+	fread(data, 1, n, out);
+	fclose(out);
+	return data;
+}
+
+static int first_difference(const char *a, const char *b)
+{
+	int line = 1;
+	for(; *a && *a == *b; a++, b++)
+	{
+		if(*a == '\n')
+			line++;
+	}
+	return line;
+}
+
+int main(int argc, char **argv)
+{
+	const char *defaults[] = { "examples/example", "examples/bench" };
+	const char **scripts = argc > 1 ? (const char **)argv + 1 : defaults;
+	int count = argc > 1 ? argc - 1 : sizeof(defaults) / sizeof(defaults[0]);
+
+	// 1 compiles every function before it runs, the default threshold compiles them after quickening
+	int thresholds[] = { 1, 0 };
+	int failed = 0;
+	for(int i = 0; i < count; i++)
+	{
+		int expected_status;
+		char *expected = capture(scripts[i], 0, 0, &expected_status);
+		for(int j = 0; j < sizeof(thresholds) / sizeof(thresholds[0]); j++)
+		{
+			int status;
+			char *output = capture(scripts[i], 1, thresholds[j], &status);
+			if(!expected || !output || status != expected_status || strcmp(expected, output))
+			{
+				printf("DIFF %s, jit threshold %d", scripts[i], thresholds[j]);
+				if(expected && output)
+					printf(", line %d", first_difference(expected, output));
+				printf("\n");
+				failed++;
+			}
+			else
+			{
+				printf("same %s, jit threshold %d\n", scripts[i], thresholds[j]);
+			}
+			free(output);
+		}
+		free(expected);
+	}
+	return failed ? 1 : 0;
+}
@@ -69,10 +69,17 @@ extern "C"
 		int string_table_memory_size;
 		const char *default_self;
 		int max_threads;
-		int thread_stack_size;  // 0 = VM_STACK_SIZE
-		int thread_frame_size;  // 0 = VM_FRAME_SIZE
-		int max_events;         // 0 = VM_MAX_EVENTS
+		int thread_stack_size;  // Limit a thread stack grows to, 0 = VM_STACK_SIZE
+		int thread_frame_size;  // Limit of nested calls on a thread, 0 = VM_FRAME_SIZE
+		int max_events;         // Notifies dispatched per frame, the rest wait for later frames, 0 = VM_DEFAULT_MAX_EVENTS
 		int ref_capacity;       // 0 = GSC_DEFAULT_REF_CAPACITY
+		int gc_budget_us;       // Time spent collecting garbage in each gsc_update, 0 = default, -1 = only in gsc_collect
+		int jit;                // Compile functions that are called often to machine code, x86-64 Linux only
+		int jit_threshold;      // Calls before a function is compiled, 0 = VM_DEFAULT_JIT_THRESHOLD
+		// Compiled files kept between runs, keyed on the source, the globals that are set and the compile flags
+		// read_cache returns what write_cache stored for the file or NULL, it has to stay valid until gsc_destroy (e.g. mmap)
+		const void *(*read_cache)(void *ctx, const char *filename, int *size);
+		void (*write_cache)(void *ctx, const char *filename, const void *data, int size);
 	} gsc_CreateOptions;
 
 	GSC_API gsc_Context *gsc_create(gsc_CreateOptions options);
@@ -83,11 +90,18 @@ extern "C"
 
 	#define GSC_COMPILE_FLAG_NONE (0)
 	#define GSC_COMPILE_FLAG_PRINT_EXPRESSION (1)
+	#define GSC_COMPILE_FLAG_NO_OPTIMIZE (2) // Compile the AST as written, without folding constants or removing dead code
+	#define GSC_COMPILE_FLAG_LAZY (4) // Index the functions and compile each one the first time it's called, errors in a body show up then
 
 	GSC_API int gsc_compile(gsc_Context *ctx, const char *filename, int flags);
+	// Compiles the files and everything they include or reference on threads (0 = one per core), in waves:
+	// the files of a wave see the file-level variables of the waves before it, not the ones of each other
+	// Each thread uses temp_memory_size bytes, the files are added to the context in the same order whatever the timing
+	GSC_API int gsc_compile_all(gsc_Context *ctx, const char **filenames, int count, int flags, int threads);
 	GSC_API const char *gsc_next_compile_dependency(gsc_Context *ctx);
 	GSC_API void *gsc_temp_alloc(gsc_Context *ctx, int size);
 	GSC_API int gsc_update(gsc_Context *ctx, float dt);
+	GSC_API int gsc_collect(gsc_Context *ctx); // Full garbage collection
 	GSC_API int gsc_call(gsc_Context *ctx, const char *file, const char *function, int nargs);
 	GSC_API int gsc_call_method(gsc_Context *ctx, const char *file, const char *function, int nargs);
 	GSC_API void gsc_object_set_debug_info(gsc_Context *ctx,
@@ -126,7 +140,7 @@ extern "C"
 	GSC_API int gsc_push_object(gsc_Context *ctx, void *value);
 	GSC_API void gsc_pop(gsc_Context *ctx, int count);
 
-	GSC_API void *gsc_allocate_object(gsc_Context *ctx);
+	GSC_API void *gsc_allocate_object(gsc_Context *ctx); // Owned by the host, never collected
 
 	// Push specific types onto the stack
 	GSC_API int gsc_add_object(gsc_Context *ctx); // Push an new object
@@ -178,7 +192,30 @@ extern "C"
 	GSC_API void    gsc_unref(gsc_Context *ctx, gsc_Ref ref);
 
 	GSC_API int  gsc_thread_count(gsc_Context *ctx);
-	GSC_API int  gsc_event_count(gsc_Context *ctx);
+	GSC_API int  gsc_event_count(gsc_Context *ctx); // Events waiting for a later frame because max_events was reached
+
+	typedef struct
+	{
+		int dispatched;  // Since the last gsc_update
+		int queued;      // Waiting for a later frame
+		int deferred;    // Total that had to wait so far
+		int peak_queued; // Largest backlog so far
+		int queue_bytes;
+	} gsc_EventStats;
+
+	GSC_API void gsc_event_stats(gsc_Context *ctx, gsc_EventStats *stats);
+
+	typedef struct
+	{
+		const char *name;
+		int item_size;
+		int used;      // Items currently handed out
+		int allocated; // Items the pool holds memory for
+		int chunks;
+	} gsc_PoolStats;
+
+	// Fills up to max_stats entries and returns the number of pools
+	GSC_API int  gsc_pool_stats(gsc_Context *ctx, gsc_PoolStats *stats, int max_stats);
 
 	// This function may break
 	GSC_API void *gsc_get_internal_pointer(gsc_Context *ctx, const char *tag);
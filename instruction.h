@@ -5,6 +5,7 @@
 
 #define OPCODES(X) \
 	X(PUSH)        \
+	X(PUSH_CONST)  \
 	X(POP)         \
 	X(UNDEF)       \
 	X(NOP)         \
@@ -31,7 +32,39 @@
 	X(GLOBAL)      \
 	X(WAITTILL)    \
 	X(NOTIFY)      \
-	X(ENDON)
+	X(ENDON)       \
+	X(LOAD_BOXED)  \
+	X(REF_BOXED)   \
+	X(ADD_INT_INT) \
+	X(SUB_INT_INT) \
+	X(MUL_INT_INT) \
+	X(LT_INT_INT)  \
+	X(LE_INT_INT)  \
+	X(GT_INT_INT)  \
+	X(GE_INT_INT)  \
+	X(EQ_INT_INT)  \
+	X(NE_INT_INT)  \
+	X(ADD_FLOAT_FLOAT) \
+	X(SUB_FLOAT_FLOAT) \
+	X(MUL_FLOAT_FLOAT) \
+	X(LT_FLOAT_FLOAT)  \
+	X(LE_FLOAT_FLOAT)  \
+	X(GT_FLOAT_FLOAT)  \
+	X(GE_FLOAT_FLOAT)  \
+	X(ADD_VEC_VEC) \
+	X(SUB_VEC_VEC) \
+	X(NOT_INT)     \
+	X(NEG_INT)     \
+	X(NEG_FLOAT)   \
+	X(JUMP_TABLE)  \
+	X(SWITCH_HASH) \
+	X(STORE_LOCAL) \
+	X(LOAD2)       \
+	X(LOAD_LOCAL_FIELD) \
+	X(INC_LOCAL)   \
+	X(TEST_JZ)     \
+	X(TEST_JNZ)    \
+	X(CMP_JZ)
  // X(SELF)
 
 typedef enum
@@ -87,42 +120,86 @@ static const char *opcode_names[] = {
 // 	// OP_LABEL
 // } Opcode;
 
-typedef enum
+// Fixed width 64-bit encoding, operand meaning depends on the opcode
+//   a  PUSH literal type, CALL/CALL_PTR flags, GLOBAL as reference, LOAD_FIELD/FIELD_REF key in c,
+//      BINOP/UNARY no longer quickened after a type guard failed, SWITCH_HASH 1 when the keys are string indices
+//   b  argument count for CALL/CALL_PTR/WAITTILL/NOTIFY/ENDON, VECTOR element count, LOAD_FIELD/FIELD_REF field cache
+//   c  PUSH immediate, PUSH_CONST/CALL constant index, LOAD/REF slot, BINOP/UNARY operator, jump offset,
+//      LOAD_FIELD/FIELD_REF lower-case string index of the key, JUMP_TABLE/SWITCH_HASH switch table
+typedef struct Instruction Instruction;
+struct Instruction
 {
-	OPERAND_TYPE_NONE,
-	OPERAND_TYPE_INT,
-	OPERAND_TYPE_FLOAT,
-	OPERAND_TYPE_INDEXED_STRING
-} OperandType;
+	uint8_t opcode;
+	uint8_t a;
+	uint16_t b;
+	int32_t c;
+};
 
-static const char *operand_type_names[] = { "NONE", "INT", "FLOAT", "STRING", NULL };
+enum
+{
+	sizeof_Instruction = sizeof(Instruction)
+};
+#define MAX_INSTRUCTIONS (1 << 17) // 8 bytes * (1 << 17) = 1MB
 
+// Literals that don't fit in a instruction (strings, function references, 64-bit integers, vectors)
 typedef struct
 {
-	OperandType type;
+	int type; // AST_LITERAL_TYPE_*
 	union
 	{
 		int64_t integer;
-		float number;
-		unsigned int string_index;
+		float vector[3];
+		int string_index;
+		struct
+		{
+			int function;
+			int file; // -1 if not specified
+		} function;
 	} value;
-} Operand;
+} Constant;
 
-#define MAX_OPERANDS (4)
-typedef struct Instruction Instruction;
-struct Instruction
+// Case targets of a switch, the discriminant is popped and control continues at the target
+typedef struct
 {
-	int32_t offset;
-	uint8_t opcode;
-	Operand operands[MAX_OPERANDS];
-	int line;
-};
+	int64_t key; // Integer case or string index
+	int target;  // Absolute instruction index, -1 for no case
+} SwitchEntry;
 
-enum
+typedef struct
 {
-	sizeof_Instruction = sizeof(Instruction)
-};
-#define MAX_INSTRUCTIONS (1 << 17) // 80 bytes * (1 << 17) = 10MB
+	int64_t min;        // JUMP_TABLE: key of entries[0]
+	int count;          // JUMP_TABLE: max - min + 1, SWITCH_HASH: power of two, open addressing
+	int default_target; // Default case or the end of the switch
+	SwitchEntry *entries;
+} SwitchTable;
+
+static uint32_t switch_hash(int64_t key)
+{
+	uint64_t h = (uint64_t)key * 0x9e3779b97f4a7c15ull;
+	return (uint32_t)(h >> 32);
+}
+
+static void switch_insert(SwitchTable *t, bool jump_table, int64_t key, int target)
+{
+	SwitchEntry *e;
+	if(jump_table)
+	{
+		e = &t->entries[key - t->min];
+	}
+	else
+	{
+		uint32_t i = switch_hash(key) & (t->count - 1);
+		while(t->entries[i].target != -1 && t->entries[i].key != key)
+			i = (i + 1) & (t->count - 1);
+		e = &t->entries[i];
+	}
+	// The first of duplicate cases wins, like the compare chain
+	if(e->target == -1)
+	{
+		e->key = key;
+		e->target = target;
+	}
+}
 
 enum
 {
@@ -139,16 +216,103 @@ typedef struct
 	HashTrie file_references;
 	int state;
 	const char *source;
+	int flags;
+	HashTrie globals; // Globals that were set when the file was compiled, for its GSC_COMPILE_FLAG_LAZY functions
 } CompiledFile;
 
+// Resolved target of a function constant, filled in by gsc_link or on the first call
+enum
+{
+	CALL_TARGET_UNRESOLVED,
+	CALL_TARGET_SCRIPT,
+	CALL_TARGET_NATIVE
+};
+
+typedef struct
+{
+	const char *file; // Interned file name the call was resolved in
+	int kind;
+	void *target; // CompiledFunction* for CALL_TARGET_SCRIPT, CallbackFunction* (or NULL) otherwise
+} CallTarget;
+
+// Inline cache of a LOAD_FIELD/FIELD_REF instruction, slot of the field for the last few shapes it was used with
+#define FIELD_CACHE_ENTRIES (4)
+
+typedef struct
+{
+	int key; // Field key the entries are for, -1 if unused
+	uint32_t epoch;
+	int count;
+	struct
+	{
+		const void *shape;
+		int slot;
+	} entries[FIELD_CACHE_ENTRIES];
+} FieldCache;
+
+struct VM;
+
 typedef struct
 {
 	const char *name;
 	CompiledFile *file;
 	Instruction *instructions;
 	int instruction_count;
+	Constant *constants;
+	CallTarget *call_targets; // One for each constant
+	FieldCache *field_caches; // Indexed by the b operand of LOAD_FIELD/FIELD_REF
+	int field_cache_count;
+	SwitchTable *switch_tables; // Indexed by the c operand of JUMP_TABLE/SWITCH_HASH
+	int switch_table_count;
+	int constant_count;
+	uint8_t *line_table; // See compiled_function_line
+	int line_table_size;
 	size_t parameter_count;
 	size_t local_count;
+	int *boxed_locals; // Slots that live outside of the register window, see OP_LOAD_BOXED
+	int boxed_local_count;
 	char **variable_names;
 	int line;
+	int max_stack; // Deepest the operand stack gets in this function, see verify_function
+	bool verified;
+	int calls;
+	void *jit; // Machine code once it's been called often enough, see jit.c
+	int (*native)(struct VM *vm); // Runs the frame on top of the current thread instead of the interpreter, from the JIT or gsc_aot
+	bool lazy; // Only indexed, compiled from source_offset and source_line of the file when it's first looked up
+	int source_offset; // -1 if it didn't compile
+	int source_line;
 } CompiledFunction;
+
+// The line table is a list of (instruction delta, line delta) pairs, one for each instruction where the line changes
+// Both are stored as variable length integers, the line delta zigzag encoded
+static int line_table_read_(const uint8_t **p)
+{
+	uint32_t v = 0;
+	for(int shift = 0;; shift += 7)
+	{
+		uint8_t byte = *(*p)++;
+		v |= (uint32_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			break;
+	}
+	return (int)v;
+}
+
+static int compiled_function_line(CompiledFunction *cf, int ip)
+{
+	if(!cf || !cf->line_table)
+		return -1;
+	const uint8_t *p = cf->line_table;
+	const uint8_t *end = p + cf->line_table_size;
+	int pc = 0, line = -1, current = 0;
+	while(p < end)
+	{
+		pc += line_table_read_(&p);
+		int delta = line_table_read_(&p);
+		if(pc > ip)
+			break;
+		current += (delta >> 1) ^ -(delta & 1);
+		line = current;
+	}
+	return line;
+}
@@ -0,0 +1,659 @@
+#include "jit.h"
+#include "ast.h"
+#include "lexer.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(Variable) == 16, "Stubs index the stack with a shift by 4");
+
+// vm, thread and frame of the code, the stub to start at
+typedef int (*JitCode)(VM *vm, Thread *thr, StackFrame *sf, void *entry);
+
+// Header of the mapping, followed by the entry points and the code
+typedef struct JitFunction JitFunction;
+struct JitFunction
+{
+	JitCode code;
+	void **entries; // Stub of each instruction
+	size_t size;	// Of the mapping
+	JitFunction *next;
+};
+
+// Registers the stubs keep their state in, callee saved so vm_native_step leaves them alone
+enum
+{
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+	RBX = 3, // VM
+	RSI = 6,
+	RDI = 7,
+	R12 = 12, // Thread
+	R13 = 13, // StackFrame
+	R14 = 14, // sf->locals
+	R15 = 15  // thr->stack
+};
+
+enum
+{
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+	CC_L = 0xc,
+	CC_GE = 0xd,
+	CC_LE = 0xe,
+	CC_G = 0xf
+};
+
+#define JIT_MAX_STUB_SIZE (256)
+#define TYPE ((int)offsetof(Variable, type))
+
+typedef struct
+{
+	int at; // rel32 to patch
+	int ip; // Instruction it jumps to
+} Fixup;
+
+typedef struct
+{
+	uint8_t *code;
+	int size, capacity;
+	Fixup *fixups;
+	int fixup_count;
+	int epilogue, dispatch, frame;
+} Emitter;
+
+static void byte(Emitter *e, uint8_t b)
+{
+	if(e->size < e->capacity)
+		e->code[e->size] = b;
+	e->size++;
+}
+
+static void bytes(Emitter *e, const uint8_t *b, int n)
+{
+	for(int i = 0; i < n; i++)
+		byte(e, b[i]);
+}
+#define emit(e, ...) bytes(e, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void u32(Emitter *e, uint32_t v)
+{
+	for(int i = 0; i < 4; i++)
+		byte(e, v >> (i * 8));
+}
+
+static void u64(Emitter *e, uint64_t v)
+{
+	for(int i = 0; i < 8; i++)
+		byte(e, v >> (i * 8));
+}
+
+static void patch32(Emitter *e, int at, int32_t v)
+{
+	if(at + 4 <= e->capacity)
+		memcpy(e->code + at, &v, 4);
+}
+
+// [base + disp32] operand, opcode is up to two bytes after an optional prefix
+static void op_mem(Emitter *e, int prefix, bool wide, int op, int op2, int reg, int base, int32_t disp)
+{
+	if(prefix)
+		byte(e, prefix);
+	if(wide || reg >= 8 || base >= 8)
+		byte(e, 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3));
+	byte(e, op);
+	if(op2 >= 0)
+		byte(e, op2);
+	byte(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if((base & 7) == 4)
+		byte(e, 0x24);
+	u32(e, disp);
+}
+
+static void mov_imm64(Emitter *e, int reg, uint64_t v)
+{
+	byte(e, 0x48 | (reg >> 3));
+	byte(e, 0xb8 | (reg & 7));
+	u64(e, v);
+}
+
+static int jcc_forward(Emitter *e, int cc)
+{
+	emit(e, 0x0f, 0x80 | cc);
+	u32(e, 0);
+	return e->size - 4;
+}
+
+static int jmp_forward(Emitter *e)
+{
+	byte(e, 0xe9);
+	u32(e, 0);
+	return e->size - 4;
+}
+
+static void land(Emitter *e, int at)
+{
+	patch32(e, at, e->size - (at + 4));
+}
+
+static void jcc_to(Emitter *e, int cc, int offset)
+{
+	emit(e, 0x0f, 0x80 | cc);
+	u32(e, offset - (e->size + 4));
+}
+
+static void jmp_to(Emitter *e, int offset)
+{
+	byte(e, 0xe9);
+	u32(e, offset - (e->size + 4));
+}
+
+// Jumps to the stub of ip, cc -1 for an unconditional jump
+static void jump_ip(Emitter *e, int cc, int ip)
+{
+	int at = cc == -1 ? jmp_forward(e) : jcc_forward(e, cc);
+	e->fixups[e->fixup_count++] = (Fixup){ .at = at, .ip = ip };
+}
+
+// rax = &thr->stack[thr->sp]
+static void stack_top(Emitter *e)
+{
+	op_mem(e, 0, true, 0x63, -1, RAX, R12, offsetof(Thread, sp));
+	emit(e, 0x48, 0xc1, 0xe0, 0x04); // shl rax, 4
+	emit(e, 0x4c, 0x01, 0xf8);		 // add rax, r15
+}
+
+static void add_sp(Emitter *e, int n)
+{
+	op_mem(e, 0, false, 0x83, -1, n < 0 ? 5 : 0, R12, offsetof(Thread, sp));
+	byte(e, n < 0 ? -n : n);
+}
+
+// Jumps out if the type of [base + disp] isn't type
+static int guard_type(Emitter *e, int base, int32_t disp, int type)
+{
+	op_mem(e, 0, false, 0x83, -1, 7, base, disp + TYPE);
+	byte(e, type);
+	return jcc_forward(e, CC_NE);
+}
+
+// Copies the 16 bytes at [base + disp] on top of the stack
+static void push_copy(Emitter *e, int base, int32_t disp)
+{
+	stack_top(e);
+	op_mem(e, 0, true, 0x8b, -1, RCX, base, disp);
+	op_mem(e, 0, true, 0x8b, -1, RDX, base, disp + 8);
+	op_mem(e, 0, true, 0x89, -1, RCX, RAX, 0);
+	op_mem(e, 0, true, 0x89, -1, RDX, RAX, 8);
+	add_sp(e, 1);
+}
+
+static void push_value(Emitter *e, Variable v)
+{
+	uint64_t half[2];
+	memcpy(half, &v, sizeof(half));
+	stack_top(e);
+	mov_imm64(e, RCX, half[0]);
+	op_mem(e, 0, true, 0x89, -1, RCX, RAX, 0);
+	mov_imm64(e, RCX, half[1]);
+	op_mem(e, 0, true, 0x89, -1, RCX, RAX, 8);
+	add_sp(e, 1);
+}
+
+// Hands the thread to the interpreter, which runs the instruction at ip
+static void exit_to_interpreter(Emitter *e, int ip)
+{
+	op_mem(e, 0, false, 0xc7, -1, 0, R13, offsetof(StackFrame, ip));
+	u32(e, ip);
+	byte(e, 0xb8); // mov eax, imm32
+	u32(e, VM_NATIVE_INTERPRET);
+	jmp_to(e, e->epilogue);
+}
+
+// The frames, locals and stack can all have moved after a call, a native function may have called into the VM
+static void reload_frame(Emitter *e)
+{
+	op_mem(e, 0, true, 0x63, -1, RAX, R12, offsetof(Thread, bp));
+	emit(e, 0x48, 0x69, 0xc0); // imul rax, rax, imm32
+	u32(e, sizeof(StackFrame));
+	op_mem(e, 0, true, 0x03, -1, RAX, R12, offsetof(Thread, frames));
+	emit(e, 0x49, 0x89, 0xc5); // mov r13, rax
+	op_mem(e, 0, true, 0x8b, -1, R14, R13, offsetof(StackFrame, locals));
+	op_mem(e, 0, true, 0x8b, -1, R15, R12, offsetof(Thread, stack));
+}
+
+// Runs the instruction with vm_native_step and carries on wherever it left sf->ip
+static void step(Emitter *e, CompiledFunction *cf, int ip)
+{
+	op_mem(e, 0, false, 0xc7, -1, 0, R13, offsetof(StackFrame, ip));
+	u32(e, ip + 1);
+	emit(e, 0x48, 0x89, 0xdf); // mov rdi, rbx
+	mov_imm64(e, RSI, (uint64_t)(uintptr_t)&cf->instructions[ip]);
+	mov_imm64(e, RAX, (uint64_t)(uintptr_t)vm_native_step);
+	emit(e, 0xff, 0xd0); // call rax
+	emit(e, 0x83, 0xf8, VM_NATIVE_FRAME); // cmp eax, imm8
+	jcc_to(e, CC_E, e->frame);
+	emit(e, 0x85, 0xc0); // test eax, eax
+	jcc_to(e, CC_NE, e->epilogue);
+	reload_frame(e);
+	op_mem(e, 0, false, 0x81, -1, 7, R13, offsetof(StackFrame, ip));
+	u32(e, ip + 1);
+	jcc_to(e, CC_NE, e->dispatch);
+	jump_ip(e, -1, ip + 1);
+}
+
+// Same values PUSH, PUSH_CONST, CONST_0, CONST_1 and UNDEF push in the interpreter
+static bool constant_value(CompiledFunction *cf, Instruction *ins, Variable *v)
+{
+	memset(v, 0, sizeof(*v));
+	v->type = VAR_UNDEFINED;
+	switch(ins->opcode)
+	{
+		case OP_UNDEF: return true;
+		case OP_CONST_0:
+		case OP_CONST_1:
+			v->type = VAR_INTEGER;
+			v->u.ival = ins->opcode == OP_CONST_1;
+			return true;
+		case OP_PUSH:
+			switch(ins->a)
+			{
+				case AST_LITERAL_TYPE_FLOAT:
+					v->type = VAR_FLOAT;
+					memcpy(&v->u.fval, &ins->c, sizeof(v->u.fval));
+					return true;
+				case AST_LITERAL_TYPE_BOOLEAN: v->type = VAR_BOOLEAN; v->u.ival = ins->c; return true;
+				case AST_LITERAL_TYPE_INTEGER: v->type = VAR_INTEGER; v->u.ival = ins->c; return true;
+				case AST_LITERAL_TYPE_UNDEFINED: return true;
+			}
+			return false;
+		case OP_PUSH_CONST:
+		{
+			Constant *k = &cf->constants[ins->c];
+			switch(k->type)
+			{
+				case AST_LITERAL_TYPE_FUNCTION:
+					v->type = VAR_FUNCTION;
+					v->u.funval.function = k->value.function.function;
+					v->u.funval.file = k->value.function.file;
+					return true;
+				case AST_LITERAL_TYPE_STRING:
+				case AST_LITERAL_TYPE_LOCALIZED_STRING:
+					v->type = VAR_INTERNED_STRING;
+					v->u.ival = k->value.string_index;
+					return true;
+				case AST_LITERAL_TYPE_INTEGER: v->type = VAR_INTEGER; v->u.ival = k->value.integer; return true;
+				case AST_LITERAL_TYPE_VECTOR:
+					v->type = VAR_VECTOR;
+					memcpy(v->u.vval, k->value.vector, sizeof(v->u.vval));
+					return true;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+static int compare_cc(int op)
+{
+	switch(op)
+	{
+		case OP_LT_INT_INT: case '<': return CC_L;
+		case OP_LE_INT_INT: case TK_LEQUAL: return CC_LE;
+		case OP_GT_INT_INT: case '>': return CC_G;
+		case OP_GE_INT_INT: case TK_GEQUAL: return CC_GE;
+		case OP_EQ_INT_INT: case TK_EQUAL: return CC_E;
+	}
+	return CC_NE;
+}
+
+// Compares the integers below the top of the stack (rax), the result ends up in edx
+static void compare_ints(Emitter *e, int cc)
+{
+	op_mem(e, 0, true, 0x8b, -1, RCX, RAX, -32);
+	op_mem(e, 0, true, 0x3b, -1, RCX, RAX, -16);
+	emit(e, 0x0f, 0x90 | cc, 0xc2); // setcc dl
+	emit(e, 0x0f, 0xb6, 0xd2);		 // movzx edx, dl
+}
+
+static void emit_instruction(Emitter *e, CompiledFunction *cf, int ip)
+{
+	Instruction *ins = &cf->instructions[ip];
+	int slow[4];
+	int nslow = 0;
+	Variable v;
+	switch(ins->opcode)
+	{
+		// Deoptimized, the interpreter suspends the thread and picks up the machine code again once it resumes
+		case OP_WAIT:
+		case OP_WAITTILL: exit_to_interpreter(e, ip); return;
+
+		case OP_JMP: jump_ip(e, -1, ip + 1 + ins->c); return;
+		case OP_JZ:
+		case OP_JNZ:
+			op_mem(e, 0, false, 0x83, -1, 7, R12, offsetof(Thread, result));
+			byte(e, 0);
+			jump_ip(e, ins->opcode == OP_JZ ? CC_E : CC_NE, ip + 1 + ins->c);
+			jump_ip(e, -1, ip + 1);
+			return;
+
+		// The rest of a superinstruction is left in place, these run as the first instruction of it
+		case OP_LOAD:
+		case OP_LOAD2:
+		case OP_LOAD_LOCAL_FIELD:
+		case OP_REF_BOXED:
+			push_copy(e, R14, ins->c * sizeof(Variable));
+			jump_ip(e, -1, ip + 1);
+			return;
+
+		case OP_LOAD_BOXED:
+			op_mem(e, 0, true, 0x8b, -1, RSI, R14, ins->c * sizeof(Variable));
+			push_copy(e, RSI, 0);
+			jump_ip(e, -1, ip + 1);
+			return;
+
+		case OP_REF:
+		case OP_STORE_LOCAL:
+			stack_top(e);
+			op_mem(e, 0, true, 0x8d, -1, RCX, R14, ins->c * sizeof(Variable)); // lea
+			op_mem(e, 0, true, 0x89, -1, RCX, RAX, 0);
+			op_mem(e, 0, false, 0xc7, -1, 0, RAX, 8);
+			u32(e, 0);
+			op_mem(e, 0, false, 0xc7, -1, 0, RAX, TYPE);
+			u32(e, VAR_REFERENCE);
+			add_sp(e, 1);
+			jump_ip(e, -1, ip + 1);
+			return;
+
+		case OP_UNDEF:
+		case OP_CONST_0:
+		case OP_CONST_1:
+		case OP_PUSH:
+		case OP_PUSH_CONST:
+			if(!constant_value(cf, ins, &v))
+				break;
+			push_value(e, v);
+			jump_ip(e, -1, ip + 1);
+			return;
+
+		case OP_POP:
+			stack_top(e);
+			op_mem(e, 0, false, 0x83, -1, 7, RAX, -16 + TYPE);
+			byte(e, VAR_OBJECT);
+			slow[nslow++] = jcc_forward(e, CC_E);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+			break;
+
+		// Values that need no reference count or write barrier, stored through a reference
+		case OP_STORE:
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_REFERENCE);
+			op_mem(e, 0, false, 0x8b, -1, RCX, RAX, -32 + TYPE);
+			emit(e, 0x83, 0xf9, VAR_VECTOR); // cmp ecx, imm8
+			slow[nslow++] = jcc_forward(e, CC_A);
+			emit(e, 0x83, 0xf9, VAR_STRING);
+			slow[nslow++] = jcc_forward(e, CC_E);
+			op_mem(e, 0, true, 0x8b, -1, RDX, RAX, -16);
+			op_mem(e, 0, true, 0x8b, -1, RCX, RAX, -32);
+			op_mem(e, 0, true, 0x89, -1, RCX, RDX, 0);
+			op_mem(e, 0, true, 0x8b, -1, RCX, RAX, -24);
+			op_mem(e, 0, true, 0x89, -1, RCX, RDX, 8);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+			break;
+
+		case OP_TEST:
+		case OP_TEST_JZ:
+		case OP_TEST_JNZ:
+		{
+			stack_top(e);
+			op_mem(e, 0, false, 0x8b, -1, RCX, RAX, -16 + TYPE);
+			emit(e, 0x83, 0xf9, VAR_INTEGER);
+			int integer = jcc_forward(e, CC_E);
+			emit(e, 0x83, 0xf9, VAR_BOOLEAN);
+			slow[nslow++] = jcc_forward(e, CC_NE);
+			land(e, integer);
+			op_mem(e, 0, false, 0x8b, -1, RCX, RAX, -16);
+			op_mem(e, 0, false, 0x89, -1, RCX, R12, offsetof(Thread, result));
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+		}
+		break;
+
+		case OP_INC_LOCAL:
+		{
+			int disp = ins->c * sizeof(Variable);
+			int op = ins[2].c;
+			slow[nslow++] = guard_type(e, R14, disp, VAR_INTEGER);
+			op_mem(e, 0, true, 0x81, -1, (op == '+' || op == TK_PLUS_ASSIGN) ? 0 : 5, R14, disp);
+			u32(e, ins[1].opcode == OP_CONST_1 ? 1 : ins[1].c);
+			jump_ip(e, -1, ip + 6);
+		}
+		break;
+
+		case OP_ADD_INT_INT:
+		case OP_SUB_INT_INT:
+		case OP_MUL_INT_INT:
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -32, VAR_INTEGER);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_INTEGER);
+			op_mem(e, 0, true, 0x8b, -1, RCX, RAX, -32);
+			if(ins->opcode == OP_MUL_INT_INT)
+				op_mem(e, 0, true, 0x0f, 0xaf, RCX, RAX, -16);
+			else
+				op_mem(e, 0, true, ins->opcode == OP_ADD_INT_INT ? 0x03 : 0x2b, -1, RCX, RAX, -16);
+			op_mem(e, 0, true, 0x89, -1, RCX, RAX, -32);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+			break;
+
+		case OP_LT_INT_INT:
+		case OP_LE_INT_INT:
+		case OP_GT_INT_INT:
+		case OP_GE_INT_INT:
+		case OP_EQ_INT_INT:
+		case OP_NE_INT_INT:
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -32, VAR_INTEGER);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_INTEGER);
+			compare_ints(e, compare_cc(ins->opcode));
+			op_mem(e, 0, true, 0x89, -1, RDX, RAX, -32);
+			op_mem(e, 0, false, 0xc7, -1, 0, RAX, -32 + TYPE);
+			u32(e, VAR_BOOLEAN);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+			break;
+
+		case OP_ADD_FLOAT_FLOAT:
+		case OP_SUB_FLOAT_FLOAT:
+		case OP_MUL_FLOAT_FLOAT:
+		{
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -32, VAR_FLOAT);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_FLOAT);
+			int op = ins->opcode == OP_ADD_FLOAT_FLOAT ? 0x58 : ins->opcode == OP_SUB_FLOAT_FLOAT ? 0x5c : 0x59;
+			op_mem(e, 0xf3, false, 0x0f, 0x10, 0, RAX, -32); // movss xmm0, lhs
+			op_mem(e, 0xf3, false, 0x0f, op, 0, RAX, -16);
+			op_mem(e, 0xf3, false, 0x0f, 0x11, 0, RAX, -32);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+		}
+		break;
+
+		// ucomiss sets the flags like an unsigned compare, unordered operands compare false
+		case OP_LT_FLOAT_FLOAT:
+		case OP_LE_FLOAT_FLOAT:
+		case OP_GT_FLOAT_FLOAT:
+		case OP_GE_FLOAT_FLOAT:
+		{
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -32, VAR_FLOAT);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_FLOAT);
+			bool swap = ins->opcode == OP_LT_FLOAT_FLOAT || ins->opcode == OP_LE_FLOAT_FLOAT;
+			bool equal = ins->opcode == OP_LE_FLOAT_FLOAT || ins->opcode == OP_GE_FLOAT_FLOAT;
+			op_mem(e, 0xf3, false, 0x0f, 0x10, 0, RAX, swap ? -16 : -32);
+			op_mem(e, 0, false, 0x0f, 0x2e, 0, RAX, swap ? -32 : -16);
+			emit(e, 0x0f, 0x90 | (equal ? CC_AE : CC_A), 0xc2);
+			emit(e, 0x0f, 0xb6, 0xd2);
+			op_mem(e, 0, true, 0x89, -1, RDX, RAX, -32);
+			op_mem(e, 0, false, 0xc7, -1, 0, RAX, -32 + TYPE);
+			u32(e, VAR_BOOLEAN);
+			add_sp(e, -1);
+			jump_ip(e, -1, ip + 1);
+		}
+		break;
+
+		case OP_CMP_JZ:
+			stack_top(e);
+			slow[nslow++] = guard_type(e, RAX, -32, VAR_INTEGER);
+			slow[nslow++] = guard_type(e, RAX, -16, VAR_INTEGER);
+			compare_ints(e, compare_cc(ins->c));
+			op_mem(e, 0, false, 0x89, -1, RDX, R12, offsetof(Thread, result));
+			add_sp(e, -2);
+			emit(e, 0x85, 0xd2); // test edx, edx
+			jump_ip(e, CC_E, ip + 3 + ins[2].c);
+			jump_ip(e, -1, ip + 3);
+			break;
+	}
+	for(int i = 0; i < nslow; i++)
+		land(e, slow[i]);
+	step(e, cf, ip);
+}
+
+static void prologue(Emitter *e)
+{
+	emit(e, 0x55, 0x48, 0x89, 0xe5);			   // push rbp; mov rbp, rsp
+	emit(e, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, r12 - r15
+	emit(e, 0x48, 0x83, 0xec, 0x08);			   // Keeps calls aligned to 16 bytes
+	emit(e, 0x48, 0x89, 0xfb);					   // mov rbx, rdi
+	emit(e, 0x49, 0x89, 0xf4);					   // mov r12, rsi
+	emit(e, 0x49, 0x89, 0xd5);					   // mov r13, rdx
+	op_mem(e, 0, true, 0x8b, -1, R14, R13, offsetof(StackFrame, locals));
+	op_mem(e, 0, true, 0x8b, -1, R15, R12, offsetof(Thread, stack));
+	emit(e, 0xff, 0xe1); // jmp rcx
+
+	e->epilogue = e->size;
+	emit(e, 0x48, 0x83, 0xc4, 0x08);
+	emit(e, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3);
+}
+
+bool jit_compile(VM *vm, CompiledFunction *cf)
+{
+	if(!cf->verified || cf->native)
+		return false;
+	int n = cf->instruction_count;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t header = sizeof(JitFunction) + n * sizeof(void *);
+	size_t size = (header + (size_t)n * JIT_MAX_STUB_SIZE + 256 + page - 1) & ~(page - 1);
+	uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+		return false;
+	JitFunction *f = (JitFunction *)base;
+	f->entries = (void **)(f + 1);
+
+	int *stubs = vm->allocator->malloc(vm->allocator->ctx, (n + 1) * sizeof(int));
+	Emitter e = { .code = base + header, .capacity = size - header };
+	e.fixups = vm->allocator->malloc(vm->allocator->ctx, n * 3 * sizeof(Fixup));
+	prologue(&e);
+
+	// Jumps to sf->ip, for control flow only known while running
+	e.dispatch = e.size;
+	op_mem(&e, 0, true, 0x63, -1, RAX, R13, offsetof(StackFrame, ip));
+	mov_imm64(&e, RCX, (uint64_t)(uintptr_t)f->entries);
+	emit(&e, 0xff, 0x24, 0xc1); // jmp [rcx + rax * 8]
+
+	// After a call or return, stays in machine code when the function of the new frame has some
+	// Every function saves the same registers on entry, so the code of one can leave through the epilogue of another
+	e.frame = e.size;
+	reload_frame(&e);
+	op_mem(&e, 0, true, 0x8b, -1, RAX, R13, offsetof(StackFrame, compiled));
+	emit(&e, 0x48, 0x85, 0xc0); // test rax, rax
+	int interpreted = jcc_forward(&e, CC_E);
+	op_mem(&e, 0, true, 0x8b, -1, RAX, RAX, offsetof(CompiledFunction, jit));
+	emit(&e, 0x48, 0x85, 0xc0);
+	int no_code = jcc_forward(&e, CC_E);
+	op_mem(&e, 0, true, 0x8b, -1, RAX, RAX, offsetof(JitFunction, entries));
+	op_mem(&e, 0, true, 0x63, -1, RCX, R13, offsetof(StackFrame, ip));
+	emit(&e, 0xff, 0x24, 0xc8); // jmp [rax + rcx * 8]
+	land(&e, interpreted);
+	land(&e, no_code);
+	byte(&e, 0xb8);
+	u32(&e, VM_NATIVE_FRAME);
+	jmp_to(&e, e.epilogue);
+
+	for(int ip = 0; ip < n; ip++)
+	{
+		stubs[ip] = e.size;
+		emit_instruction(&e, cf, ip);
+	}
+	stubs[n] = e.size; // Only the fall through of the last instruction, which never falls through
+	emit(&e, 0x0f, 0x0b); // ud2
+	bool ok = e.size <= e.capacity;
+	for(int i = 0; ok && i < e.fixup_count; i++)
+		patch32(&e, e.fixups[i].at, stubs[e.fixups[i].ip] - (e.fixups[i].at + 4));
+	for(int ip = 0; ok && ip < n; ip++)
+		f->entries[ip] = e.code + stubs[ip];
+	vm->allocator->free(vm->allocator->ctx, e.fixups);
+	vm->allocator->free(vm->allocator->ctx, stubs);
+
+	// Pages past the code are given back
+	size_t used = (header + e.size + page - 1) & ~(page - 1);
+	f->code = (JitCode)e.code;
+	f->size = used;
+	f->next = vm->jit.functions;
+	if(!ok || mprotect(base, used, PROT_READ | PROT_EXEC))
+	{
+		munmap(base, size);
+		return false;
+	}
+	if(used < size)
+		munmap(base + used, size - used);
+	vm->jit.functions = f;
+	cf->jit = f;
+	cf->native = jit_run;
+	return true;
+}
+
+int jit_run(VM *vm)
+{
+	Thread *thr = vm->thread;
+	StackFrame *sf = &thr->frames[thr->bp];
+	JitFunction *f = sf->compiled->jit;
+	return f->code(vm, thr, sf, f->entries[sf->ip]);
+}
+
+void jit_free(VM *vm)
+{
+	for(JitFunction *it = vm->jit.functions, *next; it; it = next)
+	{
+		next = it->next;
+		munmap(it, it->size);
+	}
+	vm->jit.functions = NULL;
+}
+
+#else
+
+bool jit_compile(VM *vm, CompiledFunction *cf)
+{
+	return false;
+}
+
+int jit_run(VM *vm)
+{
+	return VM_NATIVE_INTERPRET;
+}
+
+void jit_free(VM *vm)
+{
+}
+
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+#include "vm.h"
+
+// Calls before a function is compiled to machine code, 0 in gsc_CreateOptions.jit_threshold
+#define VM_DEFAULT_JIT_THRESHOLD (64)
+
+// Baseline template JIT for x86-64 Linux, each instruction of a verified function becomes a stub of machine code
+// Simple instructions are inlined with a guard on the types they expect, everything else calls vm_native_step
+// Returns false when the function can't be compiled, it keeps running in the interpreter
+bool jit_compile(VM *vm, CompiledFunction *cf);
+
+// CompiledFunction.native of compiled functions
+int jit_run(VM *vm);
+
+void jit_free(VM *vm);
@@ -9,7 +9,13 @@ extern "C"
 #include "ast.h"
 #include "compiler.h"
 #include "library.h"
+#include "jit.h"
+#include "aot.h"
+#include "cache.h"
+#include "parallel.h"
+#include "verify.h"
 #include <setjmp.h>
+#include <limits.h>
 
 #define SMALL_STACK_SIZE (16)
 
@@ -124,7 +130,31 @@ static CompiledFunction *get_function(gsc_Context *state, const char *file, cons
 static CompiledFunction *vm_func_lookup(void *ctx, const char *file, const char *function)
 {
 	gsc_Context *state = (gsc_Context*)ctx;
-	return get_function(state, file, function);
+	CompiledFunction *f = get_function(state, file, function);
+	if(!f || !f->lazy)
+		return f;
+	// A function that didn't compile stays lazy without a source offset, it isn't compiled again
+	if(f->source_offset < 0 || compile_lazy_function(f, &state->perm, state->temp, &state->strtab))
+	{
+		f->source_offset = -1;
+		vm_error(state->vm, "Can't compile '%s::%s'", f->file->name, f->name);
+	}
+	return f;
+}
+
+static void vm_mark_roots(void *ctx)
+{
+	gsc_Context *state = (gsc_Context*)ctx;
+	for(int i = 0; i < state->ref_capacity; ++i)
+	{
+		if(state->ref_slots[i].next_free == -1)
+			vm_gc_mark(state->vm, &state->ref_slots[i].value);
+	}
+	if(state->default_object_proxy)
+	{
+		Variable proxy = { .type = VAR_OBJECT, .u.oval = state->default_object_proxy };
+		vm_gc_mark(state->vm, &proxy);
+	}
 }
 
 /* waittill/endon/waittillmatch are now OP_WAITTILL/OP_ENDON opcodes. */
@@ -146,14 +176,14 @@ GSC_API int gsc_add_tagged_object(gsc_Context *ctx, const char *tag)
 	Object *o = v.u.oval;
 	o->tag = tag;
 	// o->proxy = NULL;
-	o->proxy = ctx->default_object_proxy;
+	vm_object_set_proxy(ctx->vm, o, ctx->default_object_proxy);
 	// o->userdata = NULL;
 	return vm_pushobject(ctx->vm, o);
 }
 
 GSC_API void *gsc_allocate_object(gsc_Context *ctx)
 {
-	return (void*)vm_allocate_object(ctx->vm);
+	return (void*)vm_allocate_pinned_object(ctx->vm);
 }
 
 GSC_API int gsc_add_object(gsc_Context *ctx)
@@ -168,7 +198,7 @@ GSC_API void gsc_object_set_proxy(gsc_Context *ctx, int obj_index, int proxy_ind
 		vm_error(ctx->vm, "'%s' is not a object", variable_type_names[ov->type]);
 	Object *o = ov->u.oval;
 	Variable *pv = vm_stack(ctx->vm, proxy_index);
-	o->proxy = pv->u.oval;
+	vm_object_set_proxy(ctx->vm, o, pv->u.oval);
 }
 
 GSC_API int gsc_object_get_proxy(gsc_Context *ctx, int obj_index)
@@ -250,12 +280,21 @@ static void gsc_init_vm(gsc_Context *ctx, gsc_CreateOptions options)
 {
 	VM *vm = new(&ctx->perm, VM, 1);
 	vm_init(vm, &ctx->allocator, &ctx->strtab, options.default_self, options.max_threads);
+	if(options.thread_stack_size > 0)
+		vm->thread_stack_size = options.thread_stack_size;
+	if(options.thread_frame_size > 0)
+		vm->thread_frame_size = options.thread_frame_size;
+	if(options.max_events > 0)
+		vm->events.max_events = options.max_events;
+	if(options.jit)
+		vm->jit.threshold = options.jit_threshold > 0 ? options.jit_threshold : VM_DEFAULT_JIT_THRESHOLD;
 	vm->flags = VM_FLAG_NONE;
 	if(options.verbose)
 		vm->flags |= VM_FLAG_VERBOSE;
 	vm->jmp = &ctx->jmp_oom;
 	vm->ctx = ctx;
 	vm->func_lookup = vm_func_lookup;
+	vm->mark_roots = vm_mark_roots;
 	ctx->vm = vm;
 }
 
@@ -442,19 +481,38 @@ GSC_API int gsc_link(gsc_Context *state)
 			}
 		}
 	}
+	// Resolve call targets now that every file can see its includes
+	for(HashTrieNode *it = state->files.head; it; it = it->next)
+	{
+		CompiledFile *cf = it->value;
+		if(cf->state != COMPILE_STATE_DONE)
+			continue;
+		for(HashTrieNode *func_it = cf->functions.head; func_it; func_it = func_it->next)
+		{
+			CompiledFunction *f = func_it->value;
+			if(f->file == cf && !f->lazy)
+				vm_link_function(state->vm, f);
+		}
+	}
 	return GSC_OK;
 }
 
+// Files are named without the extension
+static const char *compiled_file_name(const char *filename, char *basename, size_t size)
+{
+	char *sep = strrchr(filename, '.');
+	if(!sep)
+		return filename;
+	snprintf(basename, size, "%.*s", (int)(sep - filename), filename);
+	return basename;
+}
+
 int gsc_compile_source(gsc_Context *state, const char *filename, const char *source, int flags, HashTrie *globals, Arena temp)
 {
 	char basename[256];
-	char *sep = strrchr(filename, '.');
-	if(sep)
-	{
-		snprintf(basename, sizeof(basename), "%.*s", (int)(sep - filename), filename);
-	}
+	const char *name = compiled_file_name(filename, basename, sizeof(basename));
 	CHECK_OOM(state);
-	CompiledFile *cf = compile(state, sep ? basename : filename, source, flags, globals, temp);
+	CompiledFile *cf = compile(state, name, source, flags, globals, temp);
 	switch(cf->state)
 	{
 		case COMPILE_STATE_DONE: return GSC_OK;
@@ -479,7 +537,157 @@ int gsc_compile_source(gsc_Context *state, const char *filename, const char *sou
 	return GSC_OK;
 }
 
-GSC_API int gsc_compile(gsc_Context *state, const char *filename, int flags)
+// strings maps the string indices of an AotFile to the ones of the string table
+static void remap_instructions(Instruction *instructions, int count, const int *strings)
+{
+	for(int i = 0; i < count; i++)
+	{
+		Instruction *ins = &instructions[i];
+		if((ins->opcode == OP_LOAD_FIELD || ins->opcode == OP_FIELD_REF) && ins->a)
+			ins->c = strings[ins->c];
+	}
+}
+
+static void remap_constants(Constant *constants, int count, const int *strings)
+{
+	for(int i = 0; i < count; i++)
+	{
+		Constant *k = &constants[i];
+		switch(k->type)
+		{
+			case AST_LITERAL_TYPE_STRING:
+			case AST_LITERAL_TYPE_LOCALIZED_STRING: k->value.string_index = strings[k->value.string_index]; break;
+			case AST_LITERAL_TYPE_FUNCTION:
+				k->value.function.function = strings[k->value.function.function];
+				if(k->value.function.file != -1)
+					k->value.function.file = strings[k->value.function.file];
+				break;
+		}
+	}
+}
+
+static CompiledFunction *load_precompiled_function(gsc_Context *state, CompiledFile *file, const AotFunction *f, const int *strings)
+{
+	CompiledFunction *cf = new(&state->perm, CompiledFunction, 1);
+	cf->file = file;
+	cf->parameter_count = f->parameter_count;
+	cf->local_count = f->local_count;
+	cf->line = f->line;
+	cf->native = f->native;
+
+	// Instructions are copied, quickening rewrites them
+	cf->instruction_count = f->instruction_count;
+	cf->instructions = new(&state->perm, Instruction, f->instruction_count);
+	memcpy(cf->instructions, f->instructions, sizeof(Instruction) * f->instruction_count);
+	remap_instructions(cf->instructions, cf->instruction_count, strings);
+
+	cf->constant_count = f->constant_count;
+	cf->constants = new(&state->perm, Constant, f->constant_count);
+	memcpy(cf->constants, f->constants, sizeof(Constant) * f->constant_count);
+	remap_constants(cf->constants, cf->constant_count, strings);
+	cf->call_targets = new(&state->perm, CallTarget, f->constant_count);
+
+	// A count out of range is left for verify_function to reject
+	cf->field_cache_count = f->field_cache_count;
+	cf->field_caches = new(&state->perm, FieldCache, f->field_cache_count > 0 ? f->field_cache_count : 0);
+	for(int i = 0; i < cf->field_cache_count; i++)
+		cf->field_caches[i].key = -1;
+
+	// Tables with string keys are hashed again, the indices of the strings are different now
+	cf->switch_table_count = f->switch_table_count;
+	cf->switch_tables = new(&state->perm, SwitchTable, f->switch_table_count);
+	for(int i = 0; i < cf->switch_table_count; i++)
+	{
+		const SwitchTable *src = &f->switch_tables[i];
+		SwitchTable *t = &cf->switch_tables[i];
+		*t = *src;
+		t->entries = new(&state->perm, SwitchEntry, t->count);
+		memcpy(t->entries, src->entries, sizeof(SwitchEntry) * t->count);
+	}
+	for(int i = 0; i < cf->instruction_count; i++)
+	{
+		Instruction *ins = &cf->instructions[i];
+		if(ins->opcode != OP_SWITCH_HASH || !ins->a || ins->c < 0 || ins->c >= cf->switch_table_count)
+			continue;
+		const SwitchTable *src = &f->switch_tables[ins->c];
+		SwitchTable *t = &cf->switch_tables[ins->c];
+		for(int k = 0; k < t->count; k++)
+			t->entries[k].target = -1;
+		for(int k = 0; k < src->count; k++)
+		{
+			if(src->entries[k].target != -1)
+				switch_insert(t, false, strings[src->entries[k].key], src->entries[k].target);
+		}
+	}
+
+	// The rest is only read, it stays where the generated code put it
+	cf->line_table = (uint8_t *)f->line_table;
+	cf->line_table_size = f->line_table_size;
+	cf->boxed_locals = (int *)f->boxed_locals;
+	cf->boxed_local_count = f->boxed_local_count;
+	cf->variable_names = (char **)f->variable_names;
+	return cf;
+}
+
+int load_precompiled(gsc_Context *state, const AotFile *file, Arena temp)
+{
+	CHECK_OOM(state);
+	CompiledFile *cf = find_or_create_compiled_file(state, file->name);
+	if(cf->state != COMPILE_STATE_NOT_STARTED)
+		return cf->state == COMPILE_STATE_DONE ? GSC_OK : GSC_ERROR;
+	Allocator perm_allocator = arena_allocator(&state->perm);
+	int *strings = new(&temp, int, file->string_count);
+	for(int i = 0; i < file->string_count; i++)
+		strings[i] = string_table_intern(&state->strtab, file->strings[i]);
+	for(int i = 0; i < file->include_count; i++)
+	{
+		hash_trie_upsert(&cf->includes, file->includes[i], &perm_allocator, false);
+		find_or_create_compiled_file(state, file->includes[i]);
+	}
+	for(int i = 0; i < file->file_reference_count; i++)
+	{
+		hash_trie_upsert(&cf->file_references, file->file_references[i], &perm_allocator, false);
+		find_or_create_compiled_file(state, file->file_references[i]);
+	}
+	cf->state = COMPILE_STATE_FAILED;
+	for(int i = 0; i < file->function_count; i++)
+	{
+		const AotFunction *f = &file->functions[i];
+		CompiledFunction *compfunc = load_precompiled_function(state, cf, f, strings);
+		char message[256];
+		if(!verify_function(compfunc, temp, message, sizeof(message)))
+		{
+			printf("\n[VERIFY] ERROR: %s in %s::%s\n", message, file->name, f->name);
+			return GSC_ERROR;
+		}
+		HashTrieNode *entry = hash_trie_upsert(&cf->functions, f->name, &perm_allocator, false);
+		entry->value = compfunc;
+		compfunc->name = entry->key;
+	}
+	// File-level variables, run like gsc_compile does
+	for(int i = 0; i < file->global_count; i++)
+	{
+		const AotGlobal *g = &file->globals[i];
+		Instruction *instructions = new(&temp, Instruction, g->instruction_count);
+		Constant *constants = new(&temp, Constant, g->constant_count);
+		memcpy(instructions, g->instructions, sizeof(Instruction) * g->instruction_count);
+		memcpy(constants, g->constants, sizeof(Constant) * g->constant_count);
+		remap_instructions(instructions, g->instruction_count, strings);
+		remap_constants(constants, g->constant_count, strings);
+		for(int j = 0; j < g->instruction_count; j++)
+			vm_execute_instruction(state->vm, &instructions[j], constants);
+		gsc_set_global(state, g->name);
+	}
+	cf->state = COMPILE_STATE_DONE;
+	return GSC_OK;
+}
+
+GSC_API int gsc_load_precompiled(gsc_Context *state, const AotFile *file)
+{
+	return load_precompiled(state, file, state->temp);
+}
+
+int compile_script(gsc_Context *state, const char *filename, int flags, GlobalInitializer on_global, void *userdata)
 {
 	HashTrie ast_globals;
 	hash_trie_init(&ast_globals);
@@ -490,40 +698,242 @@ GSC_API int gsc_compile(gsc_Context *state, const char *filename, int flags)
 	for(ObjectField *it = globals->fields; it; it = it->next)
 	{
 		Allocator allocator = arena_allocator(&temp);
-		hash_trie_upsert(&ast_globals, it->key, &allocator, false)->value = NULL;
+		hash_trie_upsert(&ast_globals, gsc_string(state, it->key), &allocator, false)->value = NULL;
 	}
 	int status = GSC_OK;
 	const char *source = state->options.read_file(state->options.userdata, filename, &status);
 	if(status != GSC_OK)
 		return status;
+
+	// The globals that are set change what the compiler emits, they're part of the key
+	char name[256];
+	uint64_t key = 0;
+	if(state->options.read_cache || state->options.write_cache)
+		key = cache_key(source, flags & ~GSC_COMPILE_FLAG_LAZY, &ast_globals);
+	CHECK_OOM(state);
+	if(state->options.read_cache)
+	{
+		int size = 0;
+		const void *data = state->options.read_cache(state->options.userdata, filename, &size);
+		if(data && cache_load(state, compiled_file_name(filename, name, sizeof(name)), source, data, size, key, temp) == GSC_OK)
+			return GSC_OK;
+	}
+
+	// File-level variables for write_cache, in memory of their own as the AST is still in temp
+	// Files with functions that aren't compiled yet aren't written, they can still be read
+	Arena globals_arena = { 0 };
+	AotGlobal *cache_globals = NULL;
+	int cache_global_count = 0;
+	if(state->options.write_cache && !(flags & GSC_COMPILE_FLAG_LAZY))
+	{
+		globals_arena = arena_split(&temp, (temp.end - temp.beg) / 8);
+		globals_arena.jmp_oom = NULL;
+		cache_globals = new(&globals_arena, AotGlobal, 64);
+	}
+
 	status = gsc_compile_source(state, filename, source, flags, &ast_globals, temp);
 	if(status != GSC_OK)
 		return status;
 	Compiler compiler = { 0 };
 	Instruction instructions[64];
+	Constant constants[64];
 	for(HashTrieNode *it = ast_globals.head; it; it = it->next)
 	{
 		ASTNode *n = it->value;
 		if(!n)
 			continue;
-		int numinstructions = compile_node(instructions, 64, &compiler, temp, n, &state->jmp_oom, &state->strtab, &ast_globals);
+		int numinstructions = compile_node(instructions, 64, constants, 64, &compiler, temp, n, &state->jmp_oom, &state->strtab, &ast_globals);
 		if(compiler.variable_index > 0)
 		{
 			return GSC_ERROR; // TODO: FIXME
 		}
+		if(on_global)
+			on_global(userdata, it->key, instructions, numinstructions, constants, compiler.constant_count);
+		if(cache_globals)
+		{
+			AotGlobal *g = cache_global_count < 64 ? &cache_globals[cache_global_count++] : NULL;
+			Instruction *copy = new(&globals_arena, Instruction, numinstructions);
+			Constant *constants_copy = new(&globals_arena, Constant, compiler.constant_count);
+			char *name_copy = new(&globals_arena, char, strlen(it->key) + 1);
+			if(!g || !copy || !constants_copy || !name_copy)
+			{
+				cache_globals = NULL;
+			}
+			else
+			{
+				memcpy(copy, instructions, sizeof(Instruction) * numinstructions);
+				memcpy(constants_copy, constants, sizeof(Constant) * compiler.constant_count);
+				strcpy(name_copy, it->key);
+				*g = (AotGlobal){ name_copy, copy, numinstructions, constants_copy, compiler.constant_count };
+			}
+		}
 		for(int i = 0; i < numinstructions; i++)
 		{
-			vm_execute_instruction(state->vm, &instructions[i]);
+			vm_execute_instruction(state->vm, &instructions[i], constants);
 		}
 		// Variable result = vm_pop(state->vm);
 		// printf("result: %s\n", variable_type_names[result.type]);
 		gsc_set_global(state, it->key);
 		// printf("%d instructions\n", numinstructions);
 	}
+	CHECK_OOM(state);
+	if(cache_globals)
+		cache_write(state, compiled_file_name(filename, name, sizeof(name)), filename, key, cache_globals, cache_global_count, temp);
 
 	return status;
 }
 
+GSC_API int gsc_compile(gsc_Context *state, const char *filename, int flags)
+{
+	return compile_script(state, filename, flags, NULL, NULL);
+}
+
+// Adds a file compiled by a worker, or read from the cache, to the context
+static int merge_job(gsc_Context *state, CompileJob *job, int flags)
+{
+	CHECK_OOM(state);
+	if(job->status == COMPILE_JOB_CACHED &&
+	   cache_load(state, job->name, job->source, job->data, job->size, job->key, state->temp) == GSC_OK)
+		return GSC_OK;
+	if(job->status == COMPILE_JOB_COMPILED)
+	{
+		// Line tables and variable names are used where the data is
+		char *data = new(&state->perm, char, job->size);
+		memcpy(data, job->data, job->size);
+		if(cache_load(state, job->name, job->source, data, job->size, job->key, state->temp) != GSC_OK)
+		{
+			find_or_create_compiled_file(state, job->name)->state = COMPILE_STATE_FAILED;
+			return GSC_ERROR;
+		}
+		if(state->options.write_cache)
+			state->options.write_cache(state->options.userdata, job->filename, data, job->size);
+		return GSC_OK;
+	}
+	if(job->status == COMPILE_JOB_FAILED)
+	{
+		find_or_create_compiled_file(state, job->name)->state = COMPILE_STATE_FAILED;
+		return GSC_ERROR;
+	}
+	return compile_script(state, job->filename, flags, NULL, NULL);
+}
+
+GSC_API int gsc_compile_all(gsc_Context *state, const char **filenames, int count, int flags, int threads)
+{
+	if(threads <= 0)
+		threads = processor_count();
+	if(threads > MAX_COMPILE_THREADS)
+		threads = MAX_COMPILE_THREADS;
+	// Like the gsc_compile loop, indexing the functions of a file is quick enough without threads
+	if(threads == 1 || (flags & GSC_COMPILE_FLAG_LAZY))
+	{
+		int result = GSC_OK;
+		for(int i = 0; i < count && result == GSC_OK; i++)
+			result = gsc_compile(state, filenames[i], flags);
+		const char *dep;
+		while(result == GSC_OK && (dep = gsc_next_compile_dependency(state)))
+			result = gsc_compile(state, dep, flags);
+		return result;
+	}
+
+	// Each worker gets as much memory as gsc_compile, the calling thread keeps the list of files in its own
+	size_t worker_size = state->options.temp_memory_size;
+	while(threads > 2 && worker_size * (threads + 1) > INT_MAX)
+		threads--;
+	CHECK_OOM(state);
+	char *memory = state->options.allocate_memory(state->options.userdata, (int)(worker_size * (threads + 1)));
+	if(!memory)
+		return GSC_OUT_OF_MEMORY;
+	Arena arena;
+	arena_init(&arena, memory + worker_size * threads, worker_size);
+	arena.jmp_oom = &state->jmp_oom;
+	Allocator allocator = arena_allocator(&arena);
+
+	// The files asked for first, then each wave is what the files before it include or reference
+	int result = GSC_OK;
+	int capacity = 1024;
+	CompileJob *jobs = new(&arena, CompileJob, capacity);
+	int job_count = 0;
+	for(int i = 0; i < count; i++)
+	{
+		char basename[256];
+		CompiledFile *cf = find_or_create_compiled_file(state, compiled_file_name(filenames[i], basename, sizeof(basename)));
+		bool duplicate = false;
+		for(int j = 0; j < job_count; j++)
+			duplicate |= jobs[j].name == cf->name;
+		// The rest are compiled with the dependencies
+		if(!duplicate && cf->state == COMPILE_STATE_NOT_STARTED && job_count < capacity)
+			jobs[job_count++] = (CompileJob){ .filename = filenames[i], .name = cf->name };
+	}
+	while(job_count > 0)
+	{
+		// Files in a wave are compiled with the globals that are set before it
+		Arena wave = arena;
+		Allocator wave_allocator = arena_allocator(&wave);
+		HashTrie ast_globals;
+		hash_trie_init(&ast_globals);
+		int global_count = 0;
+		for(ObjectField *it = state->vm->global_object.u.oval->fields; it; it = it->next, global_count++)
+			hash_trie_upsert(&ast_globals, gsc_string(state, it->key), &wave_allocator, false);
+		const char **globals = new(&wave, const char *, global_count);
+		global_count = 0;
+		for(HashTrieNode *it = ast_globals.head; it; it = it->next)
+			globals[global_count++] = it->key;
+
+		for(int i = 0; i < job_count; i++)
+		{
+			CompileJob *job = &jobs[i];
+			int status = GSC_OK;
+			job->source = state->options.read_file(state->options.userdata, job->filename, &status);
+			if(status != GSC_OK)
+			{
+				job->status = COMPILE_JOB_DONE;
+				find_or_create_compiled_file(state, job->name)->state = COMPILE_STATE_FAILED;
+				if(result == GSC_OK)
+					result = status;
+				continue;
+			}
+			job->key = cache_key(job->source, flags, &ast_globals);
+			job->status = COMPILE_JOB_PENDING;
+			if(state->options.read_cache)
+			{
+				job->data = state->options.read_cache(state->options.userdata, job->filename, &job->size);
+				if(job->data)
+					job->status = COMPILE_JOB_CACHED;
+			}
+		}
+		compile_jobs(jobs, job_count, globals, global_count, flags, threads, memory, worker_size);
+
+		// Same order whatever the threads did
+		for(int i = 0; i < job_count; i++)
+		{
+			if(jobs[i].status == COMPILE_JOB_DONE)
+				continue;
+			int status = merge_job(state, &jobs[i], flags);
+			if(status != GSC_OK && result == GSC_OK)
+				result = status;
+		}
+		CHECK_OOM(state);
+
+		job_count = 0;
+		for(HashTrieNode *it = state->files.head; it && job_count < capacity; it = it->next)
+		{
+			CompiledFile *cf = it->value;
+			if(cf->state == COMPILE_STATE_NOT_STARTED)
+				jobs[job_count++] = (CompileJob){ .filename = it->key, .name = it->key };
+		}
+	}
+	state->options.free_memory(state->options.userdata, memory);
+	return result;
+}
+
+GSC_API int gsc_collect(gsc_Context *ctx)
+{
+	CHECK_ERROR(ctx);
+	CHECK_OOM(ctx);
+	vm_gc_collect(ctx->vm);
+	return GSC_OK;
+}
+
 GSC_API void *gsc_temp_alloc(gsc_Context *ctx, int size)
 {
 	return new(&ctx->vm->c_function_arena, char, size);
@@ -574,7 +984,10 @@ GSC_API int gsc_update(gsc_Context *state, float dt) // TODO: FIXME mode INFINIT
 	// // getchar();
 	CHECK_ERROR(state);
 	CHECK_OOM(state);
-	if(!vm_run_threads(state->vm, dt))
+	bool running = vm_run_threads(state->vm, dt);
+	if(state->options.gc_budget_us >= 0)
+		vm_gc_step(state->vm, state->options.gc_budget_us ? state->options.gc_budget_us : VM_GC_DEFAULT_BUDGET_US);
+	if(!running)
 		return GSC_OK;
 	// static bool once = false;
 	// if(!once)
@@ -743,16 +1156,9 @@ GSC_API void gsc_notify(gsc_Context *ctx, int obj_index, const char *key, int na
 	if(ov->type != VAR_OBJECT)
 		vm_error(vm, "'%s' is not an object", variable_type_names[ov->type]);
 	Object *o = ov->u.oval;
-	Variable args[VM_MAX_EVENT_ARGS];
-	int count = nargs;
-	if(count > VM_MAX_EVENT_ARGS)
-		count = VM_MAX_EVENT_ARGS;
-	/* read pushed args from top of stack (oldest first) */
-	for(int i = 0; i < count; ++i)
-		args[i] = thr->stack[thr->sp - count + i];
-	/* pop them */
-	thr->sp -= count;
-	vm_notify_args(vm, o, key, args, count);
+	/* pushed args are on top of the stack (oldest first) */
+	vm_notify_args(vm, o, key, &thr->stack[thr->sp - nargs], nargs);
+	thr->sp -= nargs;
 }
 
 GSC_API gsc_Ref gsc_ref(gsc_Context *ctx, int stack_index)
@@ -821,12 +1227,27 @@ GSC_API void *gsc_get_internal_pointer(gsc_Context *state, const char *tag)
 
 GSC_API int gsc_thread_count(gsc_Context *ctx)
 {
-	return thread_count(ctx->vm);
+	return thread_count(ctx->vm) + ctx->vm->timers.count + ctx->vm->waits.waiting;
 }
 
 GSC_API int gsc_event_count(gsc_Context *ctx)
 {
-	return ctx->vm->event_count;
+	return ctx->vm->events.count;
+}
+
+GSC_API void gsc_event_stats(gsc_Context *ctx, gsc_EventStats *stats)
+{
+	VM *vm = ctx->vm;
+	stats->dispatched = vm->events.dispatched;
+	stats->queued = vm->events.count;
+	stats->deferred = vm->events.deferred;
+	stats->peak_queued = vm->events.peak;
+	stats->queue_bytes = vm->events.queue.beg - vm->events.base;
+}
+
+GSC_API int gsc_pool_stats(gsc_Context *ctx, gsc_PoolStats *stats, int max_stats)
+{
+	return vm_pool_stats(ctx->vm, stats, max_stats);
 }
 
 #endif
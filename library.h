@@ -46,3 +46,14 @@ struct gsc_Context
 	int          ref_capacity;
 	int          ref_free; /* head of free list, -1 = full */
 };
+
+// Instructions of a file-level variable, run once when the file is compiled
+typedef void (*GlobalInitializer)(void *userdata,
+								  const char *name,
+								  const Instruction *instructions,
+								  int instruction_count,
+								  const Constant *constants,
+								  int constant_count);
+
+// gsc_compile, passing the file-level variables to on_global before they're set (gsc_aot keeps them)
+int compile_script(gsc_Context *state, const char *filename, int flags, GlobalInitializer on_global, void *userdata);
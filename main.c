@@ -5,6 +5,8 @@
 #include "visitor.h"
 // #include "interpreter.h"
 #include "traverse.h"
+#include "optimize.h"
+#include "verify.h"
 #include "compiler.h"
 #include "vm.h"
 #ifndef _WIN32
@@ -40,6 +42,71 @@ static bool node_fn(ASTNode *n, void *ctx)
 	return false;
 }
 
+static void init_compiler(Compiler *compiler,
+						  Arena *scratch,
+						  jmp_buf *jmp,
+						  const char *path,
+						  const char *data,
+						  StringTable *strtab,
+						  int flags,
+						  HashTrie *globals)
+{
+	compiler->globals = globals;
+	compiler->instructions = new(scratch, Instruction, MAX_INSTRUCTIONS);
+	compiler->instruction_count = 0;
+	compiler->lines = new(scratch, int, MAX_INSTRUCTIONS);
+	compiler->constants = new(scratch, Constant, MAX_INSTRUCTIONS);
+	compiler->constant_count = 0;
+	compiler->max_constant_count = MAX_INSTRUCTIONS;
+	compiler->arena = scratch;
+	compiler->strings = strtab;
+	compiler->jmp = jmp;
+	compiler->flags = flags;
+	compiler->source = data;
+	compiler->path = path;
+}
+
+static void init_parser(Parser *parser, Lexer *l, Stream *s, StreamBuffer *sb, jmp_buf *jmp, const char *data, char *string, size_t max_string_length)
+{
+	init_stream_from_buffer(s, sb, (unsigned char*)data, strlen(data) + 1);
+	lexer_init(l, s);
+	l->flags |= LEXER_FLAG_PRINT_SOURCE_ON_ERROR;
+	// l->flags |= LEXER_FLAG_TOKENIZE_WHITESPACE;
+	l->jmp = jmp;
+	parser->verbose = false;
+	// Allocator allocator = arena_allocator(&scratch);
+	// parser->allocator = &allocator;
+	parser->string = string;
+	parser->max_string_length = max_string_length;
+	parser->lexer = l;
+}
+
+// Compiles into compfunc, false if it doesn't verify
+static bool compile_ast_function(Compiler *compiler,
+								 ASTFunction *func,
+								 CompiledFunction *compfunc,
+								 Arena *perm,
+								 Arena scratch,
+								 int flags,
+								 HashTrie *globals)
+{
+	if(!(flags & GSC_COMPILE_FLAG_NO_OPTIMIZE))
+		optimize_function(func, globals);
+	int local_count = 0;
+	compfunc->parameter_count = func->parameter_count;
+	compfunc->instruction_count = compile_function(compiler, perm, scratch, func, &local_count, compfunc);
+	compfunc->local_count = local_count;
+	compfunc->instructions = new(perm, Instruction, compfunc->instruction_count);
+	memcpy(compfunc->instructions, compiler->instructions, sizeof(Instruction) * compfunc->instruction_count);
+	char error[256];
+	if(!verify_function(compfunc, scratch, error, sizeof(error)))
+	{
+		printf("\n[VERIFY] ERROR: %s in %s::%s\n", error, compiler->path, func->name);
+		return false;
+	}
+	return true;
+}
+
 int compile_file(const char *path,
 				 const char *data,
 				 CompiledFile *cf,
@@ -58,15 +125,6 @@ int compile_file(const char *path,
 		// printf("[ERROR] Out of memory!\n");
 		return 1;
 	}
-	Instruction *instructions = new(&scratch, Instruction, MAX_INSTRUCTIONS);
-	Compiler compiler = { 0 };
-	compiler.globals = globals;
-	compiler.instructions = instructions;
-	compiler.instruction_count = 0;
-	compiler.arena = &scratch;
-	compiler.strings = strtab;
-	compiler.jmp = &jmp;
-	compiler.flags = flags;
 	// char path[512];
 	// snprintf(path, sizeof(path), "%s/%s.gsc", base_path, input_file);
 	// for(char *p = path; *p; p++)
@@ -78,30 +136,22 @@ int compile_file(const char *path,
 	// 	printf("Can't read '%s'\n", path);
 	// 	return 1;
 	// }
-	compiler.source = data;
-	compiler.path = path;
+	bool lazy = flags & GSC_COMPILE_FLAG_LAZY;
+	Compiler compiler = { 0 };
+	if(!lazy)
+		init_compiler(&compiler, &scratch, &jmp, path, data, strtab, flags, globals);
 
 	char string[16384];
 	Stream s = { 0 };
 	StreamBuffer sb = { 0 };
-	init_stream_from_buffer(&s, &sb, (unsigned char*)data, strlen(data) + 1);
-	
 	Lexer l = { 0 };
-	lexer_init(&l, &s);
-	l.flags |= LEXER_FLAG_PRINT_SOURCE_ON_ERROR;
-	// l.flags |= LEXER_FLAG_TOKENIZE_WHITESPACE;
-	l.jmp = &jmp;
 	Parser parser = { 0 };
-	parser.verbose = false;
-	// Allocator allocator = arena_allocator(&scratch);
-	// parser.allocator = &allocator;
-	parser.string = string;
-	parser.max_string_length = sizeof(string);
-	parser.lexer = &l;
+	init_parser(&parser, &l, &s, &sb, &jmp, data, string, sizeof(string));
 	parser.perm = perm;
 	parser.temp = &scratch;
 	parser.file_references = &cf->file_references;
 	parser.includes = &cf->includes;
+	parser.skip_function_bodies = lazy;
 
 	HashTrie ast_functions;
 	hash_trie_init(&ast_functions);
@@ -109,18 +159,33 @@ int compile_file(const char *path,
 	lexer_step(parser.lexer, &parser.token);
 	parse(&parser, path, &ast_functions, globals);
 
+	// The functions are compiled later against the globals that are set now, file-level ones included
+	cf->flags = flags;
+	if(lazy)
+	{
+		for(HashTrieNode *it = globals->head; it; it = it->next)
+			hash_trie_upsert(&cf->globals, it->key, &perm_allocator, false);
+	}
+
 	for(HashTrieNode *it = ast_functions.head; it; it = it->next)
 	{
 		ASTFunction *func = it->value;
-		traverse((ASTNode*)func, node_fn, &parser);
-		int local_count = 0;
 		CompiledFunction *compfunc = new(perm, CompiledFunction, 1);
 		compfunc->file = cf;
-		compfunc->parameter_count = func->parameter_count;
-		compfunc->instruction_count = compile_function(&compiler, perm, scratch, func, &local_count, compfunc);
-		compfunc->local_count = local_count;
-		compfunc->instructions = new(perm, Instruction, compfunc->instruction_count);
-		memcpy(compfunc->instructions, instructions, sizeof(Instruction) * compfunc->instruction_count);
+		if(lazy)
+		{
+			ASTNode *n = (ASTNode *)func;
+			compfunc->parameter_count = func->parameter_count;
+			compfunc->lazy = true;
+			compfunc->source_offset = n->offset;
+			compfunc->source_line = n->line;
+		}
+		else
+		{
+			traverse((ASTNode*)func, node_fn, &parser);
+			if(!compile_ast_function(&compiler, func, compfunc, perm, scratch, flags, globals))
+				return 1;
+		}
 		HashTrieNode *entry = hash_trie_upsert(&cf->functions, func->name, &perm_allocator, false);
 		entry->value = compfunc;
 		compfunc->name = entry->key;
@@ -135,6 +200,36 @@ int compile_file(const char *path,
 	return 0;
 }
 
+int compile_lazy_function(CompiledFunction *f, Arena *perm, Arena scratch, StringTable *strtab)
+{
+	CompiledFile *cf = f->file;
+	jmp_buf jmp;
+	if(setjmp(jmp))
+		return 1;
+	Compiler compiler = { 0 };
+	init_compiler(&compiler, &scratch, &jmp, cf->name, cf->source, strtab, cf->flags, &cf->globals);
+
+	// Picks up the lexer where the parameters of the function start
+	char string[16384];
+	Stream s = { 0 };
+	StreamBuffer sb = { 0 };
+	Lexer l = { 0 };
+	Parser parser = { 0 };
+	init_parser(&parser, &l, &s, &sb, &jmp, cf->source, string, sizeof(string));
+	parser.perm = perm;
+	parser.temp = &scratch;
+	parser.file_references = &cf->file_references;
+	parser.includes = &cf->includes;
+	s.seek(&s, f->source_offset, STREAM_SEEK_BEG);
+	l.line = f->source_line;
+	lexer_step(parser.lexer, &parser.token);
+	ASTFunction *func = parse_function(&parser, f->name);
+	if(!compile_ast_function(&compiler, func, f, perm, scratch, cf->flags, &cf->globals))
+		return 1;
+	f->lazy = false;
+	return 0;
+}
+
 // void compile()
 // {
 // 	// Compile all functions
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <string.h>
 
 // https://stackoverflow.com/questions/28460987/c-get-type-alignment-portably
 #if __STDC_VERSION__ >= 201112L
@@ -21,20 +22,57 @@
 
 typedef struct ObjectPool ObjectPool;
 
+// Fixed size items handed out from a free list, memory is requested from the allocator in chunks
 struct ObjectPool
 {
-	int struct_size;
-	int size;
-	int capacity;
+	int struct_size; // Stride between items, at least the size of a pointer
+	int alignment;
+	int size; // Items carved out of chunks so far
+	int capacity; // 0 for no limit
+	int used; // Items currently handed out
+	int chunk_size; // Items per chunk
+	int chunk_count;
 	Allocator *allocator;
 	void *free_list;
-	void *initial_memory;
+	void *chunks; // Each chunk starts with a pointer to the previous one
 };
 
 #ifndef align_up
 	#define align_up(addr, align) (((addr) + ((align) - 1)) & ~((align) - 1))
 #endif
 
+#define OBJECT_POOL_MIN_CHUNK_SIZE (64)
+
+static bool object_pool_grow(ObjectPool *pool)
+{
+	int n = pool->chunk_size;
+	if(pool->capacity > 0 && pool->size + n > pool->capacity)
+		n = pool->capacity - pool->size;
+	if(n <= 0)
+		return false;
+	size_t N = sizeof(void *) + pool->alignment - 1 + (size_t)n * pool->struct_size;
+	char *chunk = pool->allocator->malloc(pool->allocator->ctx, N);
+	if(!chunk)
+		return false;
+	// The allocator does not guarantee any alignment for the chunk itself
+	memcpy(chunk, &pool->chunks, sizeof(void *));
+	pool->chunks = chunk;
+	pool->chunk_count++;
+	pool->size += n;
+
+	char *first = (char *)align_up((uintptr_t)(chunk + sizeof(void *)), pool->alignment);
+	char *ptr = first;
+	for(int i = 0; i < n - 1; ++i)
+	{
+		*(void **)ptr = ptr + pool->struct_size;
+		ptr += pool->struct_size;
+	}
+	*(void **)ptr = pool->free_list;
+	pool->free_list = first;
+	return true;
+}
+
+// capacity -1 limits the pool to initial_size items, 0 lets it grow until the allocator runs out
 static bool object_pool_init(ObjectPool *pool,
 							 int struct_size,
 							 size_t alignment,
@@ -42,72 +80,58 @@ static bool object_pool_init(ObjectPool *pool,
 							 int capacity,
 							 Allocator *allocator)
 {
-	pool->struct_size = struct_size;
-	pool->size = initial_size;
+	if(alignment < alignof(void *))
+		alignment = alignof(void *);
+	pool->alignment = alignment;
+	pool->struct_size = align_up(struct_size < sizeof(void *) ? sizeof(void *) : struct_size, alignment);
+	pool->size = 0;
 	pool->capacity = capacity == -1 ? initial_size : capacity;
+	pool->used = 0;
+	pool->chunk_size = initial_size > OBJECT_POOL_MIN_CHUNK_SIZE ? initial_size : OBJECT_POOL_MIN_CHUNK_SIZE;
+	pool->chunk_count = 0;
 	pool->allocator = allocator;
 	pool->free_list = NULL;
-	pool->initial_memory = NULL;
+	pool->chunks = NULL;
 
 	if(initial_size > 0)
-	{
-		size_t N = initial_size * struct_size + alignment - 1;
-		pool->initial_memory = allocator->malloc(allocator->ctx, N);
-		if(!pool->initial_memory)
-			return false;
-
-		char *ptr = (char *)align_up((uintptr_t)pool->initial_memory, alignment);
-
-		pool->free_list = ptr;
-
-		for(size_t i = 0; i < initial_size - 1; ++i)
-		{
-			*(void **)ptr = ptr + struct_size;
-			ptr += struct_size;
-		}
-		*(void **)ptr = NULL;
-	}
+		return object_pool_grow(pool);
 	return true;
 }
 
 static void object_pool_destroy(ObjectPool *pool)
 {
-	if(pool->initial_memory)
+	for(void *it = pool->chunks; it;)
 	{
-		pool->allocator->free(pool->allocator->ctx, pool->initial_memory);
+		void *prev;
+		memcpy(&prev, it, sizeof(void *));
+		pool->allocator->free(pool->allocator->ctx, it);
+		it = prev;
 	}
+	pool->chunks = NULL;
+	pool->free_list = NULL;
 }
+
 #define object_pool_allocate(pool, type) object_pool_allocate_(pool, sizeof(type))
 static void *object_pool_allocate_(ObjectPool *pool, size_t size)
 {
-	#if 1
 	if(size > pool->struct_size)
 	{
-		printf("size %d > struct size %d", size, pool->struct_size);
-		// getchar();
+		printf("size %d > struct size %d", (int)size, pool->struct_size);
 		abort();
 	}
-	if(!pool->free_list)
-	{
-		if(pool->capacity == 0 || pool->size < pool->capacity)
-		{
-			++pool->size;
-			return pool->allocator->malloc(pool->allocator->ctx, pool->struct_size);
-		}
+	if(!pool->free_list && !object_pool_grow(pool))
 		return NULL;
-	}
 	void *ptr = pool->free_list;
 	pool->free_list = *(void **)ptr;
+	++pool->used;
 	return ptr;
-	#else
-	return pool->allocator->malloc(pool->allocator->ctx, pool->struct_size);
-	#endif
 }
 
 static void object_pool_deallocate(ObjectPool *pool, void *ptr)
 {
 	*(void **)ptr = pool->free_list;
 	pool->free_list = ptr;
+	--pool->used;
 }
 
 #define DEFINE_OBJECT_POOL(NAME, TYPE)                                              \
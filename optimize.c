@@ -0,0 +1,570 @@
+#include "optimize.h"
+#include "visitor.h"
+#include "lexer.h"
+
+// Folded values follow binop() and unary() in the VM, so a script behaves the same with GSC_COMPILE_FLAG_NO_OPTIMIZE
+// Anything that can fail at runtime (division by zero, unsupported operators, testing a float) is left for the VM
+
+static void fold(ASTVisitor *v, ASTNode *n)
+{
+	if(n)
+		visit_node(v, n);
+}
+
+// Overwrites the node with another one, the statement list it's in stays the same
+static void replace(ASTNode *n, ASTNode *with)
+{
+	ASTNode *next = n->next;
+	*n = *with;
+	n->next = next;
+}
+
+static ASTLiteral *literal(ASTNode *n)
+{
+	return n && n->type == AST_LITERAL ? &n->ast_literal_data : NULL;
+}
+
+static void set_literal(ASTNode *n, int type)
+{
+	n->type = AST_LITERAL;
+	n->ast_literal_data.type = type;
+}
+
+static void set_integer(ASTNode *n, int64_t value)
+{
+	set_literal(n, AST_LITERAL_TYPE_INTEGER);
+	n->ast_literal_data.value.integer = value;
+}
+
+static void set_boolean(ASTNode *n, bool value)
+{
+	set_literal(n, AST_LITERAL_TYPE_BOOLEAN);
+	n->ast_literal_data.value.boolean = value;
+}
+
+static void set_float(ASTNode *n, float value)
+{
+	set_literal(n, AST_LITERAL_TYPE_FLOAT);
+	n->ast_literal_data.value.number = value;
+}
+
+static void set_vector(ASTNode *n, float *value)
+{
+	set_literal(n, AST_LITERAL_TYPE_VECTOR);
+	for(int i = 0; i < 3; ++i)
+		n->ast_literal_data.value.vector[i] = value[i];
+}
+
+// Integers and booleans, the only values OP_TEST accepts
+static bool integer(ASTNode *n, int64_t *value)
+{
+	ASTLiteral *lit = literal(n);
+	if(!lit)
+		return false;
+	switch(lit->type)
+	{
+		case AST_LITERAL_TYPE_INTEGER: *value = lit->value.integer; return true;
+		case AST_LITERAL_TYPE_BOOLEAN: *value = lit->value.boolean; return true;
+	}
+	return false;
+}
+
+static bool number(ASTNode *n, float *value)
+{
+	ASTLiteral *lit = literal(n);
+	if(!lit)
+		return false;
+	switch(lit->type)
+	{
+		case AST_LITERAL_TYPE_INTEGER: *value = (float)lit->value.integer; return true;
+		case AST_LITERAL_TYPE_FLOAT: *value = lit->value.number; return true;
+	}
+	return false;
+}
+
+static bool vector(ASTNode *n, float *value)
+{
+	ASTLiteral *lit = literal(n);
+	if(lit && lit->type == AST_LITERAL_TYPE_VECTOR)
+	{
+		for(int i = 0; i < 3; ++i)
+			value[i] = lit->value.vector[i];
+		return true;
+	}
+	if(!number(n, &value[0]))
+		return false;
+	value[1] = value[2] = value[0];
+	return true;
+}
+
+static bool fold_integer(ASTNode *n, int op, int64_t a, int64_t b)
+{
+	// Wraps around like the VM does on overflow
+	uint64_t ua = a, ub = b;
+	switch(op)
+	{
+		case '+': set_integer(n, (int64_t)(ua + ub)); break;
+		case '-': set_integer(n, (int64_t)(ua - ub)); break;
+		case '*': set_integer(n, (int64_t)(ua * ub)); break;
+		case '/':
+		case '%':
+			if(b == 0 || (a == INT64_MIN && b == -1))
+				return false;
+			set_integer(n, op == '/' ? a / b : a % b);
+			break;
+		case '|': set_integer(n, a | b); break;
+		case '&': set_integer(n, a & b); break;
+		case '^': set_integer(n, a ^ b); break;
+		case TK_LSHIFT:
+		case TK_RSHIFT:
+			if(b < 0 || b > 63)
+				return false;
+			set_integer(n, op == TK_LSHIFT ? (int64_t)(ua << b) : a >> b);
+			break;
+		case '<': set_boolean(n, a < b); break;
+		case '>': set_boolean(n, a > b); break;
+		case TK_LEQUAL: set_boolean(n, a <= b); break;
+		case TK_GEQUAL: set_boolean(n, a >= b); break;
+		case TK_EQUAL: set_boolean(n, a == b); break;
+		case TK_NEQUAL: set_boolean(n, a != b); break;
+		default: return false;
+	}
+	return true;
+}
+
+static bool fold_float(ASTNode *n, int op, float a, float b)
+{
+	switch(op)
+	{
+		case '+': set_float(n, a + b); break;
+		case '-': set_float(n, a - b); break;
+		case '*': set_float(n, a * b); break;
+		case '/':
+			if(b == 0.f)
+				return false;
+			set_float(n, a / b);
+			break;
+		case '<': set_boolean(n, a < b); break;
+		case '>': set_boolean(n, a > b); break;
+		case TK_LEQUAL: set_boolean(n, a <= b); break;
+		case TK_GEQUAL: set_boolean(n, a >= b); break;
+		case TK_EQUAL: set_boolean(n, a == b); break;
+		case TK_NEQUAL: set_boolean(n, a != b); break;
+		default: return false;
+	}
+	return true;
+}
+
+static bool fold_vector(ASTNode *n, int op, float *a, float *b)
+{
+	float c[3];
+	for(int i = 0; i < 3; ++i)
+	{
+		switch(op)
+		{
+			case '+': c[i] = a[i] + b[i]; break;
+			case '-': c[i] = a[i] - b[i]; break;
+			case '*': c[i] = a[i] * b[i]; break;
+			default: return false;
+		}
+	}
+	set_vector(n, c);
+	return true;
+}
+
+static void fold_ASTBinaryExpr(ASTVisitor *v, ASTNode *n, ASTBinaryExpr *e)
+{
+	fold(v, e->lhs);
+	fold(v, e->rhs);
+	int op = e->op;
+	int64_t a, b;
+	if(op == TK_LOGICAL_AND || op == TK_LOGICAL_OR)
+	{
+		// Short circuiting leaves a plain integer, otherwise the result is a boolean
+		if(!integer(e->lhs, &a))
+			return;
+		if(op == TK_LOGICAL_AND ? !a : a)
+			set_integer(n, op == TK_LOGICAL_OR);
+		else if(integer(e->rhs, &b))
+			set_boolean(n, b != 0);
+		return;
+	}
+	ASTLiteral *lhs = literal(e->lhs);
+	ASTLiteral *rhs = literal(e->rhs);
+	if(!lhs || !rhs)
+		return;
+	if(lhs->type == AST_LITERAL_TYPE_VECTOR || rhs->type == AST_LITERAL_TYPE_VECTOR)
+	{
+		float x[3], y[3];
+		if(vector(e->lhs, x) && vector(e->rhs, y))
+			fold_vector(n, op, x, y);
+	}
+	else if(lhs->type == AST_LITERAL_TYPE_FLOAT || rhs->type == AST_LITERAL_TYPE_FLOAT)
+	{
+		float x, y;
+		if(number(e->lhs, &x) && number(e->rhs, &y))
+			fold_float(n, op, x, y);
+	}
+	else if(integer(e->lhs, &a) && integer(e->rhs, &b))
+	{
+		// Two booleans don't promote to an integer, the VM only compares them
+		if(lhs->type == AST_LITERAL_TYPE_INTEGER || rhs->type == AST_LITERAL_TYPE_INTEGER)
+			fold_integer(n, op, a, b);
+		else if(op == TK_EQUAL)
+			set_boolean(n, a == b);
+	}
+}
+
+static void fold_ASTUnaryExpr(ASTVisitor *v, ASTNode *n, ASTUnaryExpr *e)
+{
+	fold(v, e->argument);
+	ASTLiteral *arg = literal(e->argument);
+	if(!arg)
+		return;
+	ASTLiteral lit = *arg;
+	switch(e->op)
+	{
+		case '!':
+			if(lit.type == AST_LITERAL_TYPE_INTEGER)
+				set_integer(n, !lit.value.integer);
+			else if(lit.type == AST_LITERAL_TYPE_BOOLEAN)
+				set_boolean(n, !lit.value.boolean);
+			else if(lit.type == AST_LITERAL_TYPE_UNDEFINED)
+				set_boolean(n, true);
+			break;
+		case '~':
+			if(lit.type == AST_LITERAL_TYPE_INTEGER)
+				set_integer(n, ~lit.value.integer);
+			break;
+		case '-':
+			if(lit.type == AST_LITERAL_TYPE_INTEGER)
+				set_integer(n, (int64_t)(0 - (uint64_t)lit.value.integer));
+			else if(lit.type == AST_LITERAL_TYPE_FLOAT)
+				set_float(n, -lit.value.number);
+			else if(lit.type == AST_LITERAL_TYPE_VECTOR)
+			{
+				float c[3];
+				for(int i = 0; i < 3; ++i)
+					c[i] = -lit.value.vector[i];
+				set_vector(n, c);
+			}
+			break;
+	}
+}
+
+static void fold_ASTGroupExpr(ASTVisitor *v, ASTNode *n, ASTGroupExpr *e)
+{
+	fold(v, e->expression);
+	if(literal(e->expression))
+		replace(n, e->expression);
+}
+
+static void fold_ASTVectorExpr(ASTVisitor *v, ASTNode *n, ASTVectorExpr *e)
+{
+	float c[3];
+	for(size_t i = 0; i < e->numelements; ++i)
+		fold(v, e->elements[i]);
+	if(e->numelements != 3)
+		return;
+	for(int i = 0; i < 3; ++i)
+	{
+		if(!number(e->elements[i], &c[i]))
+			return;
+	}
+	set_vector(n, c);
+}
+
+static void fold_ASTAssignmentExpr(ASTVisitor *v, ASTNode *n, ASTAssignmentExpr *e)
+{
+	fold(v, e->lhs);
+	fold(v, e->rhs);
+}
+
+static void fold_ASTMemberExpr(ASTVisitor *v, ASTNode *n, ASTMemberExpr *e)
+{
+	fold(v, e->object);
+	if(e->op == '[')
+		fold(v, e->prop);
+}
+
+static void fold_ASTCallExpr(ASTVisitor *v, ASTNode *n, ASTCallExpr *e)
+{
+	fold(v, e->object);
+	if(e->callee->type != AST_IDENTIFIER)
+		fold(v, e->callee);
+	for(size_t i = 0; i < e->numarguments; ++i)
+		fold(v, e->arguments[i]);
+}
+
+static void fold_statements(ASTVisitor *v, ASTNode *head)
+{
+	for(ASTNode *it = head; it; it = it->next)
+	{
+		fold(v, it);
+		// Nothing after these in the same list can run
+		if(it->type == AST_RETURN_STMT || it->type == AST_BREAK_STMT || it->type == AST_CONTINUE_STMT)
+			it->next = NULL;
+	}
+}
+
+static void fold_ASTBlockStmt(ASTVisitor *v, ASTNode *n, ASTBlockStmt *e)
+{
+	fold_statements(v, (ASTNode *)e->body);
+}
+
+static void fold_ASTExprStmt(ASTVisitor *v, ASTNode *n, ASTExprStmt *e)
+{
+	fold(v, e->expression);
+}
+
+static void fold_ASTReturnStmt(ASTVisitor *v, ASTNode *n, ASTReturnStmt *e)
+{
+	fold(v, e->argument);
+}
+
+static void fold_ASTWaitStmt(ASTVisitor *v, ASTNode *n, ASTWaitStmt *e)
+{
+	fold(v, e->duration);
+}
+
+static void fold_ASTIfStmt(ASTVisitor *v, ASTNode *n, ASTIfStmt *e)
+{
+	fold(v, e->test);
+	fold(v, e->consequent);
+	fold(v, e->alternative);
+	int64_t test;
+	if(!integer(e->test, &test))
+		return;
+	ASTNode *taken = test ? e->consequent : e->alternative;
+	if(taken)
+		replace(n, taken);
+	else
+		n->type = AST_EMPTY_STMT;
+}
+
+static void fold_ASTWhileStmt(ASTVisitor *v, ASTNode *n, ASTWhileStmt *e)
+{
+	fold(v, e->test);
+	fold(v, e->body);
+	int64_t test;
+	if(integer(e->test, &test) && !test)
+		n->type = AST_EMPTY_STMT;
+}
+
+static void fold_ASTForStmt(ASTVisitor *v, ASTNode *n, ASTForStmt *e)
+{
+	fold(v, e->init);
+	fold(v, e->test);
+	fold(v, e->update);
+	fold(v, e->body);
+	int64_t test;
+	if(!integer(e->test, &test) || test)
+		return;
+	ASTNode *init = e->init;
+	if(init)
+	{
+		n->type = AST_EXPR_STMT;
+		n->ast_expr_stmt_data.expression = init;
+	}
+	else
+	{
+		n->type = AST_EMPTY_STMT;
+	}
+}
+
+static void fold_ASTSwitchStmt(ASTVisitor *v, ASTNode *n, ASTSwitchStmt *e)
+{
+	fold(v, e->discriminant);
+	for(ASTNode *it = (ASTNode *)e->cases; it; it = it->next)
+	{
+		fold(v, it->ast_switch_case_data.test);
+		fold_statements(v, it->ast_switch_case_data.consequent);
+	}
+}
+
+static void fold_nothing(ASTVisitor *v, ASTNode *n, const char *type)
+{
+}
+
+typedef struct
+{
+	const char *name;
+	ASTNode *value;
+	int writes;
+	bool escapes; // Used as something other than a value, e.g. waittill arguments or the object of a field
+	bool replace;
+} Propagation;
+
+static void references(Propagation *p, ASTNode *n, bool read)
+{
+	if(!n)
+		return;
+	switch(n->type)
+	{
+		case AST_IDENTIFIER:
+			if(stricmp(n->ast_identifier_data.name, p->name))
+				break;
+			if(!read)
+				p->escapes = true;
+			else if(p->replace)
+				replace(n, p->value);
+			break;
+		case AST_GROUP_EXPR: references(p, n->ast_group_expr_data.expression, true); break;
+		case AST_BINARY_EXPR:
+			references(p, n->ast_binary_expr_data.lhs, true);
+			references(p, n->ast_binary_expr_data.rhs, true);
+			break;
+		case AST_UNARY_EXPR:
+		{
+			ASTUnaryExpr *e = &n->ast_unary_expr_data;
+			if(e->op != TK_INCREMENT && e->op != TK_DECREMENT)
+				references(p, e->argument, true);
+			else if(e->argument->type == AST_IDENTIFIER && !stricmp(e->argument->ast_identifier_data.name, p->name))
+				p->writes++;
+			else
+				references(p, e->argument, false);
+		}
+		break;
+		case AST_ASSIGNMENT_EXPR:
+		{
+			ASTAssignmentExpr *e = &n->ast_assignment_expr_data;
+			if(e->lhs->type == AST_IDENTIFIER && !stricmp(e->lhs->ast_identifier_data.name, p->name))
+				p->writes++;
+			else
+				references(p, e->lhs, false);
+			references(p, e->rhs, true);
+		}
+		break;
+		case AST_MEMBER_EXPR:
+			references(p, n->ast_member_expr_data.object, false);
+			if(n->ast_member_expr_data.op == '[')
+				references(p, n->ast_member_expr_data.prop, true);
+			break;
+		case AST_CALL_EXPR:
+		{
+			ASTCallExpr *e = &n->ast_call_expr_data;
+			// Function names aren't variables, waittill stores into its arguments
+			bool waittill = false;
+			if(e->callee->type == AST_IDENTIFIER)
+				waittill = !stricmp(e->callee->ast_identifier_data.name, "waittill") ||
+						   !stricmp(e->callee->ast_identifier_data.name, "waittillmatch");
+			else
+				references(p, e->callee, false);
+			references(p, e->object, false);
+			for(size_t i = 0; i < e->numarguments; ++i)
+				references(p, e->arguments[i], !waittill);
+		}
+		break;
+		case AST_VECTOR_EXPR:
+			for(size_t i = 0; i < n->ast_vector_expr_data.numelements; ++i)
+				references(p, n->ast_vector_expr_data.elements[i], true);
+			break;
+		case AST_FUNCTION_POINTER_EXPR: references(p, n->ast_function_pointer_expr_data.expression, false); break;
+		case AST_CONDITIONAL_EXPR:
+			references(p, n->ast_conditional_expr_data.condition, false);
+			references(p, n->ast_conditional_expr_data.consequent, false);
+			references(p, n->ast_conditional_expr_data.alternative, false);
+			break;
+		case AST_STRUCT_EXPR:
+			for(size_t i = 0; i < n->ast_struct_expr_data.numelements; ++i)
+				references(p, n->ast_struct_expr_data.elements[i], false);
+			break;
+		case AST_ARRAY_EXPR:
+			for(size_t i = 0; i < n->ast_array_expr_data.numelements; ++i)
+				references(p, n->ast_array_expr_data.elements[i], false);
+			break;
+
+		case AST_BLOCK_STMT:
+			for(ASTNode *it = (ASTNode *)n->ast_block_stmt_data.body; it; it = it->next)
+				references(p, it, false);
+			break;
+		case AST_EXPR_STMT: references(p, n->ast_expr_stmt_data.expression, true); break;
+		case AST_RETURN_STMT: references(p, n->ast_return_stmt_data.argument, true); break;
+		case AST_WAIT_STMT: references(p, n->ast_wait_stmt_data.duration, true); break;
+		case AST_IF_STMT:
+			references(p, n->ast_if_stmt_data.test, true);
+			references(p, n->ast_if_stmt_data.consequent, false);
+			references(p, n->ast_if_stmt_data.alternative, false);
+			break;
+		case AST_WHILE_STMT:
+			references(p, n->ast_while_stmt_data.test, true);
+			references(p, n->ast_while_stmt_data.body, false);
+			break;
+		case AST_DO_WHILE_STMT:
+			references(p, n->ast_do_while_stmt_data.test, true);
+			references(p, n->ast_do_while_stmt_data.body, false);
+			break;
+		case AST_FOR_STMT:
+			references(p, n->ast_for_stmt_data.init, true);
+			references(p, n->ast_for_stmt_data.test, true);
+			references(p, n->ast_for_stmt_data.update, true);
+			references(p, n->ast_for_stmt_data.body, false);
+			break;
+		case AST_SWITCH_STMT:
+			references(p, n->ast_switch_stmt_data.discriminant, true);
+			for(ASTNode *it = (ASTNode *)n->ast_switch_stmt_data.cases; it; it = it->next)
+			{
+				references(p, it->ast_switch_case_data.test, true);
+				for(ASTNode *stmt = it->ast_switch_case_data.consequent; stmt; stmt = stmt->next)
+					references(p, stmt, false);
+			}
+			break;
+	}
+}
+
+// A top level `x = <literal>;` runs before every statement after it, if nothing else writes x
+// then the literal can replace x in those statements
+static void propagate(ASTNode *body, ASTNode *stmt, HashTrie *globals)
+{
+	if(stmt->type != AST_EXPR_STMT || stmt->ast_expr_stmt_data.expression->type != AST_ASSIGNMENT_EXPR)
+		return;
+	ASTAssignmentExpr *e = &stmt->ast_expr_stmt_data.expression->ast_assignment_expr_data;
+	if(e->op != '=' || e->lhs->type != AST_IDENTIFIER || !literal(e->rhs))
+		return;
+	const char *name = e->lhs->ast_identifier_data.name;
+	if(globals && hash_trie_upsert(globals, name, NULL, false))
+		return;
+	Propagation p = { .name = name, .value = e->rhs };
+	references(&p, body, false);
+	if(p.writes != 1 || p.escapes)
+		return;
+	p.replace = true;
+	for(ASTNode *it = stmt->next; it; it = it->next)
+		references(&p, it, false);
+}
+
+void optimize_function(ASTFunction *n, HashTrie *globals)
+{
+	ASTVisitor v = { 0 };
+	v.visit_ast_binary_expr = fold_ASTBinaryExpr;
+	v.visit_ast_unary_expr = fold_ASTUnaryExpr;
+	v.visit_ast_group_expr = fold_ASTGroupExpr;
+	v.visit_ast_vector_expr = fold_ASTVectorExpr;
+	v.visit_ast_assignment_expr = fold_ASTAssignmentExpr;
+	v.visit_ast_member_expr = fold_ASTMemberExpr;
+	v.visit_ast_call_expr = fold_ASTCallExpr;
+	v.visit_ast_block_stmt = fold_ASTBlockStmt;
+	v.visit_ast_expr_stmt = fold_ASTExprStmt;
+	v.visit_ast_return_stmt = fold_ASTReturnStmt;
+	v.visit_ast_wait_stmt = fold_ASTWaitStmt;
+	v.visit_ast_if_stmt = fold_ASTIfStmt;
+	v.visit_ast_while_stmt = fold_ASTWhileStmt;
+	v.visit_ast_for_stmt = fold_ASTForStmt;
+	v.visit_ast_switch_stmt = fold_ASTSwitchStmt;
+	v.visit_fallback = fold_nothing;
+
+	ASTNode *body = n->body;
+	if(!body || body->type != AST_BLOCK_STMT)
+	{
+		fold(&v, body);
+		return;
+	}
+	// Statements are folded in order so a propagated literal is folded into the ones after it
+	for(ASTNode *it = (ASTNode *)body->ast_block_stmt_data.body; it; it = it->next)
+	{
+		fold(&v, it);
+		if(it->type == AST_RETURN_STMT || it->type == AST_BREAK_STMT || it->type == AST_CONTINUE_STMT)
+			it->next = NULL;
+		propagate(body, it, globals);
+	}
+}
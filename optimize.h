@@ -0,0 +1,6 @@
+#pragma once
+#include "ast.h"
+
+// Folds constant expressions, removes branches that can't run and replaces locals that only ever hold a literal
+// Rewrites the nodes in place, globals are never propagated
+void optimize_function(ASTFunction *n, HashTrie *globals);
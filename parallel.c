@@ -0,0 +1,207 @@
+#include "parallel.h"
+#include "compiler.h"
+#include "cache.h"
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+	#include <pthread.h>
+	#include <unistd.h>
+	#define PARALLEL_PTHREADS
+#endif
+
+typedef struct
+{
+	CompileJob *jobs;
+	int count;
+	long next;
+	const char *const *globals;
+	int global_count;
+	int flags;
+} Wave;
+
+// Compiled files stay in results until they're added to the context, everything else is reused for each file
+typedef struct
+{
+	Wave *wave;
+	Arena results;
+	char *memory;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE thread;
+#elif defined(PARALLEL_PTHREADS)
+	pthread_t thread;
+#endif
+} Worker;
+
+int processor_count(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#elif defined(PARALLEL_PTHREADS)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+static int next_job(Wave *wave)
+{
+#if defined(_WIN32)
+	return (int)InterlockedIncrement(&wave->next) - 1;
+#else
+	return (int)__atomic_fetch_add(&wave->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void compile_job(Worker *w, CompileJob *job)
+{
+	Wave *wave = w->wave;
+	Arena results = w->results;
+	jmp_buf jmp;
+	if(setjmp(jmp))
+	{
+		job->status = COMPILE_JOB_RETRY;
+		return;
+	}
+	// Strings and compiled functions of this file only, what gets kept is serialized
+	Arena memory;
+	arena_init(&memory, w->memory, w->size);
+	memory.jmp_oom = &jmp;
+	Arena strtab_arena = arena_split(&memory, w->size / 8);
+	Arena perm = arena_split(&memory, w->size / 4);
+	Arena scratch = memory;
+	results.jmp_oom = &jmp;
+
+	StringTable strtab;
+	string_table_init(&strtab, strtab_arena);
+	HashTrie globals;
+	hash_trie_init(&globals);
+	Allocator allocator = arena_allocator(&scratch);
+	for(int i = 0; i < wave->global_count; i++)
+		hash_trie_upsert(&globals, wave->globals[i], &allocator, false)->value = NULL;
+
+	CompiledFile cf = { .name = job->name, .state = COMPILE_STATE_DONE };
+	hash_trie_init(&cf.functions);
+	hash_trie_init(&cf.includes);
+	hash_trie_init(&cf.file_references);
+	if(compile_file(job->name, job->source, &cf, &perm, scratch, &strtab, wave->flags, &globals))
+	{
+		job->status = COMPILE_JOB_FAILED;
+		return;
+	}
+
+	// File-level variables, like gsc_compile but they're run when the file is added
+	int global_count = 0;
+	for(HashTrieNode *it = globals.head; it; it = it->next)
+		global_count += it->value != NULL;
+	AotGlobal *file_globals = new(&perm, AotGlobal, global_count);
+	Compiler compiler = { 0 };
+	Instruction instructions[64];
+	Constant constants[64];
+	int n = 0;
+	for(HashTrieNode *it = globals.head; it; it = it->next)
+	{
+		if(!it->value)
+			continue;
+		int count = compile_node(instructions, 64, constants, 64, &compiler, scratch, it->value, &jmp, &strtab, &globals);
+		if(compiler.variable_index > 0)
+			longjmp(jmp, 1);
+		AotGlobal *g = &file_globals[n++];
+		g->name = it->key;
+		g->instruction_count = count;
+		g->instructions = new(&perm, Instruction, count);
+		memcpy((Instruction *)g->instructions, instructions, sizeof(Instruction) * count);
+		g->constant_count = compiler.constant_count;
+		g->constants = new(&perm, Constant, compiler.constant_count);
+		memcpy((Constant *)g->constants, constants, sizeof(Constant) * compiler.constant_count);
+	}
+
+	char *data;
+	job->size = cache_serialize(&strtab, &cf, job->key, file_globals, n, &results, &data);
+	job->data = data;
+	job->status = COMPILE_JOB_COMPILED;
+	results.jmp_oom = NULL;
+	w->results = results;
+}
+
+static void run_worker(Worker *w)
+{
+	Wave *wave = w->wave;
+	for(int i; (i = next_job(wave)) < wave->count;)
+	{
+		if(wave->jobs[i].status == COMPILE_JOB_PENDING)
+			compile_job(w, &wave->jobs[i]);
+	}
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_thread(LPVOID arg)
+{
+	run_worker(arg);
+	return 0;
+}
+#elif defined(PARALLEL_PTHREADS)
+static void *worker_thread(void *arg)
+{
+	run_worker(arg);
+	return NULL;
+}
+#endif
+
+void compile_jobs(CompileJob *jobs,
+				  int count,
+				  const char *const *globals,
+				  int global_count,
+				  int flags,
+				  int threads,
+				  char *memory,
+				  size_t worker_size)
+{
+	Wave wave = { .jobs = jobs, .count = count, .globals = globals, .global_count = global_count, .flags = flags };
+	Worker workers[MAX_COMPILE_THREADS];
+	if(threads > MAX_COMPILE_THREADS)
+		threads = MAX_COMPILE_THREADS;
+	if(threads > count)
+		threads = count;
+	// A quarter of each worker's memory keeps the compiled files of this wave
+	for(int i = 0; i < threads; i++)
+	{
+		Worker *w = &workers[i];
+		w->wave = &wave;
+		char *base = memory + worker_size * i;
+		arena_init(&w->results, base, worker_size / 4);
+		w->memory = base + worker_size / 4;
+		w->size = worker_size - worker_size / 4;
+	}
+	// The calling thread is a worker too
+	int started = 0;
+	for(int i = 1; i < threads; i++, started++)
+	{
+#if defined(_WIN32)
+		workers[i].thread = CreateThread(NULL, 0, worker_thread, &workers[i], 0, NULL);
+		if(!workers[i].thread)
+			break;
+#elif defined(PARALLEL_PTHREADS)
+		if(pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+			break;
+#else
+		break;
+#endif
+	}
+	if(threads > 0)
+		run_worker(&workers[0]);
+	for(int i = 1; i <= started; i++)
+	{
+#if defined(_WIN32)
+		WaitForSingleObject(workers[i].thread, INFINITE);
+		CloseHandle(workers[i].thread);
+#elif defined(PARALLEL_PTHREADS)
+		pthread_join(workers[i].thread, NULL);
+#endif
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "library.h"
+
+// Files of gsc_compile_all, compiled on worker threads into the format of cache.c and added to the context in order
+enum
+{
+	COMPILE_JOB_PENDING,
+	COMPILE_JOB_CACHED,	  // data is from read_cache
+	COMPILE_JOB_COMPILED, // data is the compiled file
+	COMPILE_JOB_FAILED,	  // Didn't compile, the errors are printed
+	COMPILE_JOB_RETRY,	  // Out of worker memory, compiled like gsc_compile instead
+	COMPILE_JOB_DONE
+};
+
+typedef struct
+{
+	const char *filename; // As passed to read_file
+	const char *name;	  // Name of the compiled file
+	const char *source;
+	uint64_t key; // See cache_key
+	int status;
+	const void *data;
+	int size;
+} CompileJob;
+
+#define MAX_COMPILE_THREADS (64)
+
+int processor_count(void);
+
+// Compiles the pending jobs, globals are the names that are set. Each worker gets worker_size bytes of memory
+void compile_jobs(CompileJob *jobs,
+				  int count,
+				  const char *const *globals,
+				  int global_count,
+				  int flags,
+				  int threads,
+				  char *memory,
+				  size_t worker_size);
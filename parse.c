@@ -260,6 +260,65 @@ static ASTNode *body(Parser *parser)
 	return statement(parser);
 }
 
+// Only keeps the files that are referenced, the body is parsed again when the function is compiled
+static void skip_function_body(Parser *parser)
+{
+	Allocator allocator = arena_allocator(parser->perm);
+	advance(parser, '{');
+	for(int depth = 1; depth > 0; lexer_step(parser->lexer, &parser->token))
+	{
+		switch(parser->token.type)
+		{
+			case 0: lexer_error(parser->lexer, "Expected '}' at the end of the function"); break;
+			case '{': depth++; break;
+			case '}': depth--; break;
+			case TK_FILE_REFERENCE:
+				lexer_token_read_string(parser->lexer, &parser->token, parser->string, parser->max_string_length);
+				for(char *p = parser->string; *p; p++)
+					if(*p == '\\')
+						*p = '/';
+				hash_trie_upsert(parser->file_references, parser->string, &allocator, false);
+				break;
+		}
+	}
+}
+
+ASTFunction *parse_function(Parser *parser, const char *name)
+{
+	NODE(Function, func);
+	snprintf(func->name, sizeof(func->name), "%s", name);
+	// lexer_token_read_string(parser->lexer, &parser->token, func->name, sizeof(func->name));
+	advance(parser, '(');
+	ASTNode **parms = &func->parameters;
+	func->parameter_count = 0;
+	if(parser->token.type != ')')
+	{
+		while(1)
+		{
+			NODE(Identifier, parm);
+			lexer_token_read_string(parser->lexer, &parser->token, parm->name, sizeof(parm->name));
+			*parms = (ASTNode *)parm;
+			parms = &((ASTNode *)parm)->next;
+			++func->parameter_count;
+			advance(parser, TK_IDENTIFIER);
+			if(parser->token.type != ',')
+				break;
+			advance(parser, ',');
+		}
+	}
+	advance(parser, ')');
+	if(parser->skip_function_bodies)
+	{
+		skip_function_body(parser);
+		return func;
+	}
+	// lexer_step(parser->lexer, &parser->token);
+	advance(parser, '{');
+	func->body = block(parser);
+	// visit_node(&visitor, func->body);
+	return func;
+}
+
 void parse(Parser *parser, const char *path, HashTrie *functions, HashTrie *global_variables)
 {
 	// while(lexer_step(parser->lexer, &parser->token))
@@ -319,33 +378,7 @@ void parse(Parser *parser, const char *path, HashTrie *functions, HashTrie *glob
 				// TODO: compile here for each ASTFunction then throw away the AST to reduce temporary peak memory usage
 				if(parser->token.type == '(')
 				{
-					NODE(Function, func);
-					snprintf(func->name, sizeof(func->name), "%s", parser->string);
-					// lexer_token_read_string(parser->lexer, &parser->token, func->name, sizeof(func->name));
-					advance(parser, '(');
-					ASTNode **parms = &func->parameters;
-					func->parameter_count = 0;
-					if(parser->token.type != ')')
-					{
-						while(1)
-						{
-							NODE(Identifier, parm);
-							lexer_token_read_string(parser->lexer, &parser->token, parm->name, sizeof(parm->name));
-							*parms = (ASTNode *)parm;
-							parms = &((ASTNode *)parm)->next;
-							++func->parameter_count;
-							advance(parser, TK_IDENTIFIER);
-							if(parser->token.type != ',')
-								break;
-							advance(parser, ',');
-						}
-					}
-					advance(parser, ')');
-					// lexer_step(parser->lexer, &parser->token);
-					advance(parser, '{');
-					func->body = block(parser);
-					// visit_node(&visitor, func->body);
-
+					ASTFunction *func = parse_function(parser, parser->string);
 					Allocator allocator = arena_allocator(parser->temp);
 					HashTrieNode *entry = hash_trie_upsert(functions, func->name, &allocator, false);
 					if(entry->value)
@@ -18,6 +18,7 @@ typedef struct
 	Arena *perm;
 	Arena *temp;
 	bool generate_debug_info;
+	bool skip_function_bodies; // Only the names and parameters, see GSC_COMPILE_FLAG_LAZY
 } Parser;
 
 typedef struct ASTNode ASTNode;
@@ -79,3 +80,5 @@ static void advance_if_(Parser *parser, TokenType type, const char *file, int li
 ASTNode *parse_expression(Parser *parser, int precedence);
 ASTNode *expression(Parser *parser);
 void parse(Parser *parser, const char *path, HashTrie *functions, HashTrie *globals);
+// Function definition from the '(' after its name, the node has the offset and line of the '('
+ASTFunction *parse_function(Parser *parser, const char *name);
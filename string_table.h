@@ -12,7 +12,7 @@ struct StringTableEntry
 {
 	StringTableEntry *child[1 << STRING_TABLE_ARY];
 	int offset;
-	// int length;
+	int length;
 	// int index;
 };
 
@@ -70,6 +70,24 @@ static const char *string_table_get(StringTable *table, int index)
 	// return table->strings + index;
 }
 
+static int string_table_length(StringTable *table, int index)
+{
+	return table->entries[index].length;
+}
+
+// Index of a string that was interned before, -1 otherwise
+static int string_table_find(StringTable *table, const char *string)
+{
+	StringTableEntry *m = table->head;
+	for(uint64_t h = string_table_hash_(string); m; h <<= STRING_TABLE_ARY)
+	{
+		if(!strcmp(table->strings + m->offset, string))
+			return m - table->entries;
+		m = m->child[h >> (64 - STRING_TABLE_ARY)];
+	}
+	return -1;
+}
+
 static int string_table_intern(StringTable *table, const char *string)
 {
 	StringTableEntry **m = &table->head;
@@ -90,6 +108,7 @@ static int string_table_intern(StringTable *table, const char *string)
 	StringTableEntry *entry = &table->entries[table->index++];
 	// StringTableEntry *entry = new(&table->end, StringTableEntry, 1);
 	entry->offset = duplicate - table->strings;
+	entry->length = n - 1;
 	// entry->index = table->index++;
 	*m = entry;
 	// return entry->offset;
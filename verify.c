@@ -0,0 +1,329 @@
+#include "verify.h"
+#include "ast.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+typedef struct
+{
+	CompiledFunction *cf;
+	char *error;
+	size_t size;
+} Verifier;
+
+static bool fail(Verifier *v, int ip, const char *fmt, ...)
+{
+	char message[256];
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(message, sizeof(message), fmt, va);
+	va_end(va);
+	snprintf(v->error, v->size, "%s at %d (%s)", message, ip, opcode_names[v->cf->instructions[ip].opcode]);
+	return false;
+}
+
+// Quickened and fused instructions are checked as the instruction they were compiled as
+static int base_opcode(int opcode)
+{
+	switch(opcode)
+	{
+		case OP_ADD_INT_INT:
+		case OP_SUB_INT_INT:
+		case OP_MUL_INT_INT:
+		case OP_LT_INT_INT:
+		case OP_LE_INT_INT:
+		case OP_GT_INT_INT:
+		case OP_GE_INT_INT:
+		case OP_EQ_INT_INT:
+		case OP_NE_INT_INT:
+		case OP_ADD_FLOAT_FLOAT:
+		case OP_SUB_FLOAT_FLOAT:
+		case OP_MUL_FLOAT_FLOAT:
+		case OP_LT_FLOAT_FLOAT:
+		case OP_LE_FLOAT_FLOAT:
+		case OP_GT_FLOAT_FLOAT:
+		case OP_GE_FLOAT_FLOAT:
+		case OP_ADD_VEC_VEC:
+		case OP_SUB_VEC_VEC:
+		case OP_CMP_JZ: return OP_BINOP;
+		case OP_NOT_INT:
+		case OP_NEG_INT:
+		case OP_NEG_FLOAT: return OP_UNARY;
+		case OP_STORE_LOCAL: return OP_REF;
+		case OP_LOAD2:
+		case OP_LOAD_LOCAL_FIELD:
+		case OP_INC_LOCAL: return OP_LOAD;
+		case OP_TEST_JZ:
+		case OP_TEST_JNZ: return OP_TEST;
+	}
+	return opcode;
+}
+
+static bool is_opcode(Instruction *ins, int opcode)
+{
+	return base_opcode(ins->opcode) == opcode;
+}
+
+// The superinstruction handlers read the rest of their sequence without looking at the opcodes
+static bool check_superinstruction(Verifier *v, int ip)
+{
+	Instruction *ins = &v->cf->instructions[ip];
+	int n = v->cf->instruction_count - ip;
+	bool ok = true;
+	switch(ins->opcode)
+	{
+		case OP_STORE_LOCAL: ok = n >= 3 && is_opcode(&ins[1], OP_STORE) && is_opcode(&ins[2], OP_POP); break;
+		case OP_LOAD2: ok = n >= 2 && is_opcode(&ins[1], OP_LOAD); break;
+		case OP_LOAD_LOCAL_FIELD: ok = n >= 2 && is_opcode(&ins[1], OP_LOAD_FIELD); break;
+		case OP_TEST_JZ: ok = n >= 2 && ins[1].opcode == OP_JZ; break;
+		case OP_TEST_JNZ: ok = n >= 2 && ins[1].opcode == OP_JNZ; break;
+		case OP_CMP_JZ: ok = n >= 3 && is_opcode(&ins[1], OP_TEST) && ins[2].opcode == OP_JZ; break;
+		case OP_INC_LOCAL:
+			ok = n >= 6 && (ins[1].opcode == OP_CONST_1 || (ins[1].opcode == OP_PUSH && ins[1].a == AST_LITERAL_TYPE_INTEGER))
+				 && is_opcode(&ins[2], OP_BINOP) && is_opcode(&ins[3], OP_REF) && ins[3].c == ins->c
+				 && is_opcode(&ins[4], OP_STORE) && is_opcode(&ins[5], OP_POP);
+			break;
+	}
+	return ok || fail(v, ip, "Superinstruction doesn't match the instructions after it");
+}
+
+static bool check_jump(Verifier *v, int ip, int target)
+{
+	if(target < 0 || target >= v->cf->instruction_count)
+		return fail(v, ip, "Jump target %d out of range", target);
+	return true;
+}
+
+static bool check_operands(Verifier *v, int ip)
+{
+	CompiledFunction *cf = v->cf;
+	Instruction *ins = &cf->instructions[ip];
+	if(ins->opcode <= OP_INVALID || ins->opcode >= OP_MAX)
+		return fail(v, ip, "Invalid opcode %d", ins->opcode);
+	if(!check_superinstruction(v, ip))
+		return false;
+	switch(base_opcode(ins->opcode))
+	{
+		case OP_LOAD:
+		case OP_REF:
+		case OP_LOAD_BOXED:
+		case OP_REF_BOXED:
+			if(ins->c < 0 || ins->c >= (int)cf->local_count)
+				return fail(v, ip, "Local %d out of range", ins->c);
+			break;
+		case OP_PUSH:
+			switch(ins->a)
+			{
+				case AST_LITERAL_TYPE_FLOAT:
+				case AST_LITERAL_TYPE_BOOLEAN:
+				case AST_LITERAL_TYPE_INTEGER:
+				case AST_LITERAL_TYPE_UNDEFINED: break;
+				default: return fail(v, ip, "Unsupported literal type %d", ins->a);
+			}
+			break;
+		case OP_PUSH_CONST:
+		case OP_CALL:
+		{
+			if(ins->c < 0 || ins->c >= cf->constant_count)
+				return fail(v, ip, "Constant %d out of range", ins->c);
+			int type = cf->constants[ins->c].type;
+			if(ins->opcode == OP_CALL && type != AST_LITERAL_TYPE_FUNCTION)
+				return fail(v, ip, "Constant %d is not a function", ins->c);
+			if(type != AST_LITERAL_TYPE_FUNCTION && type != AST_LITERAL_TYPE_STRING && type != AST_LITERAL_TYPE_LOCALIZED_STRING
+			   && type != AST_LITERAL_TYPE_INTEGER && type != AST_LITERAL_TYPE_VECTOR)
+				return fail(v, ip, "Unsupported constant type %d", type);
+		}
+		break;
+		case OP_LOAD_FIELD:
+		case OP_FIELD_REF:
+			if(ins->b >= cf->field_cache_count)
+				return fail(v, ip, "Field cache %d out of range", ins->b);
+			break;
+		case OP_VECTOR:
+			if(ins->b != 3)
+				return fail(v, ip, "Vector must have 3 components");
+			break;
+		case OP_JMP:
+		case OP_JZ:
+		case OP_JNZ: return check_jump(v, ip, ip + 1 + ins->c);
+		case OP_JUMP_TABLE:
+		case OP_SWITCH_HASH:
+		{
+			if(ins->c < 0 || ins->c >= cf->switch_table_count)
+				return fail(v, ip, "Switch table %d out of range", ins->c);
+			SwitchTable *t = &cf->switch_tables[ins->c];
+			if(!check_jump(v, ip, t->default_target))
+				return false;
+			for(int i = 0; i < t->count; i++)
+			{
+				if(t->entries[i].target != -1 && !check_jump(v, ip, t->entries[i].target))
+					return false;
+			}
+		}
+		break;
+	}
+	return true;
+}
+
+// Values an instruction takes off the stack and puts back, the same on every path through it
+static void stack_effect(Instruction *ins, int *pops, int *pushes)
+{
+	*pops = 0;
+	*pushes = 0;
+	switch(base_opcode(ins->opcode))
+	{
+		case OP_POP:
+		case OP_PRINT_EXPR:
+		case OP_TEST:
+		case OP_WAIT:
+		case OP_JUMP_TABLE:
+		case OP_SWITCH_HASH: *pops = 1; break;
+		case OP_UNDEF:
+		case OP_GLOBAL:
+		case OP_LOAD:
+		case OP_LOAD_BOXED:
+		case OP_REF:
+		case OP_REF_BOXED:
+		case OP_CONST_0:
+		case OP_CONST_1:
+		case OP_PUSH:
+		case OP_PUSH_CONST:
+		case OP_TABLE: *pushes = 1; break;
+		case OP_LOAD_FIELD:
+		case OP_FIELD_REF: // A proxy setter pushes the object and function instead of a reference, STORE takes both
+			*pops = ins->a ? 1 : 2;
+			*pushes = 1;
+			break;
+		case OP_STORE:
+		case OP_BINOP:
+			*pops = 2;
+			*pushes = 1;
+			break;
+		case OP_UNARY:
+			*pops = 1;
+			*pushes = 1;
+			break;
+		case OP_VECTOR:
+			*pops = ins->b;
+			*pushes = 1;
+			break;
+		case OP_WAITTILL: // Object, event name and the references
+		case OP_NOTIFY:
+			*pops = ins->b + 1;
+			*pushes = 1;
+			break;
+		case OP_ENDON:
+			*pops = 2;
+			*pushes = 1;
+			break;
+		case OP_CALL: // Arguments, self and the argument count
+			*pops = ins->b + 2;
+			*pushes = 1;
+			break;
+		case OP_CALL_PTR:
+			*pops = ins->b + 3;
+			*pushes = 1;
+			break;
+		case OP_RET: *pops = 1; break;
+	}
+}
+
+static int successors(CompiledFunction *cf, int ip, int *out, int max)
+{
+	Instruction *ins = &cf->instructions[ip];
+	int n = 0;
+	switch(ins->opcode)
+	{
+		case OP_RET: break;
+		case OP_JMP: out[n++] = ip + 1 + ins->c; break;
+		case OP_JZ:
+		case OP_JNZ:
+			out[n++] = ip + 1;
+			out[n++] = ip + 1 + ins->c;
+			break;
+		case OP_JUMP_TABLE:
+		case OP_SWITCH_HASH:
+		{
+			SwitchTable *t = &cf->switch_tables[ins->c];
+			out[n++] = t->default_target;
+			for(int i = 0; i < t->count && n < max; i++)
+			{
+				if(t->entries[i].target != -1)
+					out[n++] = t->entries[i].target;
+			}
+		}
+		break;
+		default: out[n++] = ip + 1; break;
+	}
+	return n;
+}
+
+bool verify_function(CompiledFunction *cf, Arena temp, char *error, size_t size)
+{
+	Verifier v = { .cf = cf, .error = error, .size = size };
+	int n = cf->instruction_count;
+	cf->verified = false;
+	if(n <= 0)
+	{
+		snprintf(error, size, "No instructions");
+		return false;
+	}
+	// The cache of a LOAD_FIELD/FIELD_REF is its b operand, see check_operands
+	if(cf->field_cache_count < 0 || cf->field_cache_count > UINT16_MAX)
+	{
+		snprintf(error, size, "Field cache count %d out of range", cf->field_cache_count);
+		return false;
+	}
+	for(int ip = 0; ip < n; ip++)
+	{
+		if(!check_operands(&v, ip))
+			return false;
+	}
+	int max_targets = 2;
+	for(int i = 0; i < cf->switch_table_count; i++)
+	{
+		if(cf->switch_tables[i].count + 1 > max_targets)
+			max_targets = cf->switch_tables[i].count + 1;
+	}
+	int *targets = new(&temp, int, max_targets);
+
+	// Depth of the stack before each instruction, -1 until a path reaches it
+	int *depth = new(&temp, int, n);
+	int *worklist = new(&temp, int, n);
+	for(int ip = 0; ip < n; ip++)
+		depth[ip] = -1;
+	int count = 0;
+	int max_depth = 0;
+	depth[0] = 0;
+	worklist[count++] = 0;
+	while(count > 0)
+	{
+		int ip = worklist[--count];
+		Instruction *ins = &cf->instructions[ip];
+		int pops, pushes;
+		stack_effect(ins, &pops, &pushes);
+		if(depth[ip] < pops)
+			return fail(&v, ip, "Stack underflow, %d values needed, %d on the stack", pops, depth[ip]);
+		if(ins->opcode == OP_RET && depth[ip] != 1)
+			return fail(&v, ip, "Return with %d values on the stack", depth[ip]);
+		int after = depth[ip] - pops + pushes;
+		if(after > max_depth)
+			max_depth = after;
+		int k = successors(cf, ip, targets, max_targets);
+		for(int i = 0; i < k; i++)
+		{
+			int next = targets[i];
+			if(next >= n)
+				return fail(&v, ip, "Runs past the last instruction");
+			if(depth[next] == -1)
+			{
+				depth[next] = after;
+				worklist[count++] = next;
+			}
+			else if(depth[next] != after)
+				return fail(&v, ip, "Reaches %d with %d values on the stack, another path has %d", next, after, depth[next]);
+		}
+	}
+	cf->max_stack = max_depth;
+	cf->verified = true;
+	return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "instruction.h"
+#include "arena.h"
+
+// Checks the operands, jump targets and stack use of a function once, the VM runs it without checking them again
+// Sets cf->max_stack and cf->verified, on failure describes the first problem in error
+bool verify_function(CompiledFunction *cf, Arena temp, char *error, size_t size);
@@ -4,32 +4,20 @@
 #include "ast.h"
 #include <signal.h>
 #include <time.h>
+#include <limits.h>
 #include <inttypes.h>
 #include "util.h"
+#include "jit.h"
 
 #ifndef MAX
 	#define MAX(A, B) ((A) > (B) ? (A) : (B))
 #endif
-// enum
-// {
-// 	UNION_OBJECT_SIZE =
-// 		MAX(1, MAX(1, MAX(sizeof_ObjectField, MAX(sizeof_Variable, sizeof_Object))))
-// 	// sizeof_Unit =
-// 	// 	MAX(sizeof_Thread, MAX(sizeof_StackFrame, MAX(sizeof_ObjectField, MAX(sizeof_Variable, sizeof_Object))))
-// };
-typedef struct
-{
-	// char data[UNION_OBJECT_SIZE];
-	char data[72]; // 64 so we can allocate small strings too
-	// increased to 72 for Object
-} UnionObject;
-
 DEFINE_OBJECT_POOL(thread, Thread)
-DEFINE_OBJECT_POOL(stack_frame, StackFrame)
-DEFINE_OBJECT_POOL(uo, UnionObject)
-// DEFINE_OBJECT_POOL(object_field, ObjectField)
-// DEFINE_OBJECT_POOL(variable, Variable)
-// DEFINE_OBJECT_POOL(object, Object)
+DEFINE_OBJECT_POOL(object_field, ObjectField)
+DEFINE_OBJECT_POOL(variable, Variable)
+DEFINE_OBJECT_POOL(object, Object)
+DEFINE_OBJECT_POOL(event_wait, VMEventWait)
+DEFINE_OBJECT_POOL(shape, Shape)
 
 static void info(VM *vm, const char *fmt, ...)
 {
@@ -50,6 +38,12 @@ static Object *object_for_var(Variable *v)
 	return v->u.oval;
 }
 
+// Boxed locals hold a reference to their value, nothing else stores a reference in a local
+static Variable *unbox_local(Variable *v)
+{
+	return v->type == VAR_REFERENCE ? v->u.refval : v;
+}
+
 StackFrame *stack_frame(VM *vm, Thread *t)
 {
 	if(t->bp < 0)
@@ -57,20 +51,6 @@ StackFrame *stack_frame(VM *vm, Thread *t)
 	return &t->frames[t->bp];
 }
 
-static void free_object(VM *vm, Object *o)
-{
-	for(ObjectField *it = o->fields; it;)
-	{
-		ObjectField *field = it;
-		it = it->next;
-		object_pool_deallocate(&vm->pool.uo, field);
-	}
-	o->tail = NULL;
-	o->refcount = 0;
-	o->field_count = 0;
-	o->fields = NULL;
-}
-
 static void strtolower(char *str)
 {
 	for(char *p = str; *p; ++p)
@@ -87,17 +67,44 @@ int vm_string_index(VM *vm, const char *s)
 	return string_table_intern(vm->strings, s);
 }
 
+int vm_field_key(VM *vm, const char *s)
+{
+	char buf[256];
+	size_t n = strlen(s) + 1;
+	char *lower = n <= sizeof(buf) ? buf : malloc(n);
+	if(!lower)
+		vm_error(vm, "Out of memory for field key");
+	for(size_t i = 0; i < n; ++i)
+		lower[i] = tolower(s[i]);
+	int key = vm_string_index(vm, lower);
+	if(lower != buf)
+		free(lower);
+	return key;
+}
+
 static bool variable_is_string(Variable *v)
 {
 	return v->type == VAR_STRING || v->type == VAR_INTERNED_STRING;// || v->type == VAR_LOCALIZED_STRING;
 }
 
+VariableString allocate_variable_string(VM *vm, int length, int capacity);
+
 static const char *variable_string(VM *vm, Variable *v)
 {
 	switch(v->type)
 	{
 		default: vm_error(vm, "Not a string");
-		case VAR_STRING: return (const char *)v->u.sval.data;
+		case VAR_STRING:
+		{
+			// A longer string was appended in place, this one needs its own \0
+			if(v->u.sval.data[v->u.sval.length])
+			{
+				VariableString vs = allocate_variable_string(vm, v->u.sval.length, v->u.sval.length);
+				memcpy(vs.data, v->u.sval.data, vs.length);
+				v->u.sval = vs;
+			}
+			return (const char *)v->u.sval.data;
+		}
 		case VAR_INTERNED_STRING: return string(vm, v->u.ival);
 	}
 	return NULL;
@@ -111,24 +118,189 @@ Variable vm_intern_string_variable(VM *vm, const char *str)
 	return v;
 }
 
-VariableString allocate_variable_string(VM *vm, int len) // len is including \0
+static VariableStringHeader *variable_string_header(char *data)
+{
+	return (VariableStringHeader *)data - 1;
+}
+
+static int string_class(int size)
+{
+	for(int i = 0; i < VM_STRING_CLASS_COUNT; ++i)
+	{
+		if(size <= vm_string_class_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+// Room for at least capacity characters, pooled strings get the rest of their size class
+VariableString allocate_variable_string(VM *vm, int length, int capacity)
 {
-	// if(len == -1)
-	// 	len = strlen(str) + 1;
-	char *ptr = NULL;
-	if(len <= 64)
+	int size = sizeof(VariableStringHeader) + capacity + 1;
+	int k = string_class(size);
+	VariableStringHeader *hdr = NULL;
+	if(k != -1)
+	{
+		size = vm_string_class_sizes[k];
+		hdr = object_pool_allocate_(&vm->pool.strings[k], size);
+		if(!hdr)
+			vm_error(vm, "No strings left");
+	}
+	else
 	{
-		ptr = (char *)object_pool_allocate(&vm->pool.uo, char);
-		if(!ptr)
+		hdr = malloc(size);
+		if(!hdr)
 			vm_error(vm, "No strings left");
 	}
+	hdr->size = size;
+	hdr->used = length;
+	hdr->gc_mark = vm->gc.state == VM_GC_MARK ? VM_GC_BLACK : VM_GC_WHITE;
+	hdr->gc_next = vm->gc.strings;
+	vm->gc.strings = hdr;
+	vm->gc.allocated++;
+	char *data = (char *)(hdr + 1);
+	data[length] = 0;
+	return (VariableString) { .data = data, .length = length };
+}
+
+static int string_capacity(VariableStringHeader *hdr)
+{
+	return hdr->size - (int)sizeof(VariableStringHeader) - 1;
+}
+
+static void free_variable_string(VM *vm, VariableStringHeader *hdr)
+{
+	int k = string_class(hdr->size);
+	if(k != -1)
+		object_pool_deallocate(&vm->pool.strings[k], hdr);
+	else
+		free(hdr);
+}
+
+static int block_class(int size)
+{
+	for(int i = 0; i < VM_BLOCK_CLASS_COUNT; ++i)
+	{
+		if(size <= vm_block_class_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+static void *allocate_block(VM *vm, int size)
+{
+	int k = block_class(size);
+	void *block = k != -1 ? object_pool_allocate_(&vm->pool.blocks[k], size) : malloc(size);
+	if(!block)
+		vm_error(vm, "Out of memory for thread stacks");
+	return block;
+}
+
+static void free_block(VM *vm, void *block, int size)
+{
+	int k = block_class(size);
+	if(k != -1)
+		object_pool_deallocate(&vm->pool.blocks[k], block);
 	else
+		free(block);
+}
+
+// Moves the first count items of a thread stack to a block that holds at least n items, up to max
+// The new capacity is at least double the old one and fills up the size class
+static void *grow_block(VM *vm, void *block, int item_size, int count, int *capacity, int n, int max)
+{
+	int cap = *capacity * 2;
+	if(cap < n)
+		cap = n;
+	int k = block_class(cap * item_size);
+	if(k != -1)
+		cap = vm_block_class_sizes[k] / item_size;
+	if(cap > max)
+		cap = max;
+	void *p = allocate_block(vm, cap * item_size);
+	if(block)
+	{
+		memcpy(p, block, count * item_size);
+		free_block(vm, block, *capacity * item_size);
+	}
+	*capacity = cap;
+	return p;
+}
+
+// Initial sizes, most threads are short wait or waittill loops that never grow
+#define VM_THREAD_INITIAL_STACK_SIZE (8)
+#define VM_THREAD_INITIAL_FRAME_SIZE (2)
+#define VM_THREAD_INITIAL_LOCAL_STACK_SIZE (8)
+
+// Only the bookkeeping is cleared, stack slots are written before they are read
+static void init_thread(VM *vm, Thread *t)
+{
+	*t = (Thread) { .state = VM_THREAD_INACTIVE, .timer_index = -1 };
+	t->stack = grow_block(vm, NULL, sizeof(Variable), 0, &t->stack_capacity, VM_THREAD_INITIAL_STACK_SIZE, vm->thread_stack_size);
+	t->frames = grow_block(vm, NULL, sizeof(StackFrame), 0, &t->frame_capacity, VM_THREAD_INITIAL_FRAME_SIZE, vm->thread_frame_size);
+	t->locals = grow_block(vm, NULL, sizeof(Variable), 0, &t->local_capacity, VM_THREAD_INITIAL_LOCAL_STACK_SIZE, VM_LOCAL_STACK_SIZE);
+	memset(&t->frames[0], 0, sizeof(StackFrame));
+}
+
+static Thread *allocate_thread(VM *vm)
+{
+	Thread *t = object_pool_allocate(&vm->pool.threads, Thread);
+	if(!t)
+		vm_error(vm, "No threads left");
+	init_thread(vm, t);
+	t->state = VM_THREAD_ACTIVE;
+	return t;
+}
+
+static void free_thread_storage(VM *vm, Thread *t)
+{
+	free_block(vm, t->stack, t->stack_capacity * sizeof(Variable));
+	free_block(vm, t->frames, t->frame_capacity * sizeof(StackFrame));
+	free_block(vm, t->locals, t->local_capacity * sizeof(Variable));
+}
+
+static void free_thread(VM *vm, Thread *t)
+{
+	free_thread_storage(vm, t);
+	object_pool_deallocate(&vm->pool.threads, t);
+}
+
+static void grow_stack(VM *vm, Thread *t, int n)
+{
+	if(n > vm->thread_stack_size)
+		vm_error(vm, "Stack overflow (%d)", vm->thread_stack_size);
+	t->stack = grow_block(vm, t->stack, sizeof(Variable), t->sp, &t->stack_capacity, n, vm->thread_stack_size);
+}
+
+static void grow_frames(VM *vm, Thread *t)
+{
+	if(t->frame_capacity >= vm->thread_frame_size)
+		vm_error(vm, "Too many nested calls (%d)", vm->thread_frame_size);
+	t->frames = grow_block(vm, t->frames, sizeof(StackFrame), t->bp, &t->frame_capacity, t->bp + 1, vm->thread_frame_size);
+}
+
+// Frames point into the local stack, they're moved along with it
+static void grow_locals(VM *vm, Thread *t, int n)
+{
+	if(n > VM_LOCAL_STACK_SIZE)
+		vm_error(vm, "Local variable stack overflow");
+	Variable *prev = t->locals;
+	int count = 0;
+	if(t->bp > 0)
 	{
-		// vm_error(vm, "No malloc!");
-		ptr = (char *)malloc(len); // TODO: FIXME
+		StackFrame *caller = &t->frames[t->bp - 1];
+		count = (caller->locals - prev) + caller->local_count;
 	}
-	// memcpy(ptr, str, len);
-	return (VariableString) { .data = ptr, .length = len };
+	t->locals = grow_block(vm, prev, sizeof(Variable), count, &t->local_capacity, n, VM_LOCAL_STACK_SIZE);
+	for(int i = 0; i < t->bp; ++i)
+		t->frames[i].locals = t->locals + (t->frames[i].locals - prev);
+}
+
+static int frame_line(StackFrame *f)
+{
+	if(!f->instructions || f->ip <= 0 || f->ip > f->instruction_count)
+		return -1;
+	return compiled_function_line(f->compiled, f->ip - 1);
 }
 
 static void print_callstack(Thread *thr)
@@ -152,8 +324,7 @@ static void print_callstack(Thread *thr)
 		{
 			StackFrame *f = &thr->frames[i];
 			int line = -1;
-			if(f->instructions && f->ip > 0 && f->ip <= f->instruction_count)
-				line = f->instructions[f->ip - 1].line;
+			line = frame_line(f);
 			printf("\t-> %s::%s line %d\n",
 				f->file ? f->file : "?",
 				f->function ? f->function : "?",
@@ -218,27 +389,38 @@ int get_thread_info_(VM *vm, ThreadDebugInfo_ *info, int i)
 	return 1;
 }
 
+static void print_thread_info(VM *vm, Thread *t, int i)
+{
+	StackFrame *sf = stack_frame(vm, t);
+	printf("%d: %s %s::%s", i, vm_thread_state_names[t->state], sf->file, sf->function);
+	if(t->state == VM_THREAD_WAITING_EVENT)
+	{
+		printf(" (event=%s)", string(vm, t->waittill.name));
+	}
+	printf("\n");
+	print_stackframe(t);
+	print_callstack(t);
+}
+
 void vm_print_thread_info(VM *vm)
 {
-	if(vm->thread_read_idx == vm->thread_write_idx)
+	size_t n = thread_count(vm);
+	size_t total = n + vm->timers.count + vm->waits.waiting;
+	if(total == 0)
 		return; // No threads
 	printf("[THREADS]\n");
-	size_t n = thread_count(vm);
-	printf("%d %s\n", n, n > 1 ? "threads" : "thread");
+	printf("%d %s\n", total, total > 1 ? "threads" : "thread");
 	printf("=========================================\n");
-	for(size_t i = 0; i < n; i++)
+	int i = 0;
+	for(; i < n + vm->timers.count; i++)
+		print_thread_info(vm, i < n ? vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads] : vm->timers.heap[i - n], i);
+	for(int j = 0; j < vm->waits.bucket_count; ++j)
 	{
-		Thread *t = vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads];
-    	StackFrame *sf = stack_frame(vm, t);
-		printf("%d: %s %s::%s", i, vm_thread_state_names[t->state], sf->file, sf->function);
-		if(t->state == VM_THREAD_WAITING_EVENT)
+		for(VMEventWait *it = vm->waits.buckets[j]; it; it = it->next)
 		{
-			printf(" (event=%s)", string(vm, t->waittill.name));
+			if(it->kind == VM_EVENT_WAITTILL)
+				print_thread_info(vm, it->thread, i++);
 		}
-		printf("\n");
-		print_stackframe(t);
-		print_callstack(t);
-		// printf("\t- %d: %s\n", i, vm_thread_state_names[t->state]);
 	}
 }
 
@@ -253,11 +435,19 @@ static void print_variable(VM *vm, const char *key, Variable *value, int indent)
 static void print_object(VM *vm, const char *key, Variable *v, int indent)
 {
 	Object *o = object_for_var(v);
+	for(int i = 0; i < o->array_count; ++i)
+	{
+		char index[32];
+		snprintf(index, sizeof(index), "%d", i);
+		print_variable(vm, index, &o->array[i], indent);
+		if(o->array[i].type == VAR_OBJECT)
+			print_object(vm, index, &o->array[i], indent + 1);
+	}
 	for(ObjectField *it = o->fields; it; it = it->next)
 	{
-		print_variable(vm, it->key, it->value, indent);
+		print_variable(vm, string(vm, it->key), it->value, indent);
 		if(it->value->type == VAR_OBJECT)
-			print_object(vm, it->key, it->value, indent + 1);
+			print_object(vm, string(vm, it->key), it->value, indent + 1);
 	}
 }
 
@@ -331,7 +521,7 @@ void vm_error(VM *vm, const char *fmt, ...)
 	va_end(va);
 
 	bool in_script = sf && sf->file && sf->instructions;
-	int err_line = current ? current->line : -1;
+	int err_line = current ? frame_line(sf) : -1;
 
 	fprintf(stderr, "\n\033[1;31merror\033[0m: %s\n", message);
 
@@ -363,8 +553,7 @@ void vm_error(VM *vm, const char *fmt, ...)
 			StackFrame *f = &thr->frames[i];
 			if(!f->file) continue;
 			int line = -1;
-			if(f->instructions && f->ip > 0 && f->ip <= f->instruction_count)
-				line = f->instructions[f->ip - 1].line;
+			line = frame_line(f);
 			fprintf(stderr, "  %s \033[1m%s\033[0m::%s",
 				(i == thr->bp) ? "at" : "by",
 				f->file, f->function ? f->function : "?");
@@ -382,11 +571,10 @@ void vm_error(VM *vm, const char *fmt, ...)
 		fprintf(stderr, "\n\033[1mlocals:\033[0m\n");
 		for(int i = 0; i < show; i++)
 		{
-			if(!sf->locals[i]) continue;
 			const char *name = (sf->variable_names && i < (int)sf->local_count)
 				? sf->variable_names[i] : NULL;
 			char buf[256];
-			vm_stringify(vm, sf->locals[i], buf, sizeof(buf));
+			vm_stringify(vm, unbox_local(&sf->locals[i]), buf, sizeof(buf));
 			fprintf(stderr, "  \033[33m%s\033[0m = %s\n",
 				name ? name : "?", buf);
 		}
@@ -418,8 +606,7 @@ static void vm_stacktrace(VM *vm)
 	{
 		StackFrame *f = &thr->frames[i];
 		int line = -1;
-		if(f->instructions && f->ip > 0 && f->ip <= f->instruction_count)
-			line = f->instructions[f->ip - 1].line;
+		line = frame_line(f);
 		fprintf(stderr, "  %s \033[1m%s\033[0m::%s",
 			(i == thr->bp) ? "at" : "by",
 			f->file ? f->file : "?",
@@ -429,16 +616,19 @@ static void vm_stacktrace(VM *vm)
 	}
 }
 
-static Variable *local(VM *vm, size_t index)
+static Variable *frame_local(VM *vm, StackFrame *sf, size_t index)
 {
-    Thread *thr = vm->thread;
-    StackFrame *sf = stack_frame(vm, thr);
 	if(index >= sf->local_count)
 	{
 		vm_error(vm, "Invalid local index %d/%d", (int)index, (int)sf->local_count);
 		return NULL;
 	}
-	return sf->locals[index];
+	return &sf->locals[index];
+}
+
+static Variable *local(VM *vm, size_t index)
+{
+	return unbox_local(frame_local(vm, stack_frame(vm, vm->thread), index));
 }
 
 static void print_locals(VM *vm)
@@ -456,11 +646,16 @@ static void print_locals(VM *vm)
 		if(lv->type == VAR_OBJECT)
 		{
 			Object *o = object_for_var(lv);
-			printf("%d fields\n", o->field_count);
+			printf("%d fields\n", o->field_count + o->array_count);
+			for(int i = 0; i < o->array_count; ++i)
+			{
+				char buf[32];
+				printf("\t\t%d: %s\n", i, vm_stringify(vm, &o->array[i], buf, sizeof(buf)));
+			}
 			for(ObjectField *it = o->fields; it; it = it->next)
 			{
 				char buf[32];
-				printf("\t\t'%s': %s\n", it->key, vm_stringify(vm, it->value, buf, sizeof(buf)));
+				printf("\t\t'%s': %s\n", string(vm, it->key), vm_stringify(vm, it->value, buf, sizeof(buf)));
 			}
 		}
 	}
@@ -509,38 +704,6 @@ static void decref(VM *vm, Variable *v)
 void vm_incref(VM *vm, Variable *v) { incref(vm, v); }
 void vm_decref(VM *vm, Variable *v) { decref(vm, v); }
 
-static void free_var(VM *vm, Variable *v)
-{
-	switch(v->type)
-	{
-		case VAR_STRING:
-		{
-			if(v->u.sval.length <= 64)
-			{
-				object_pool_deallocate(&vm->pool.uo, v->u.sval.data);
-			} else
-			{
-				vm_error(vm, "No free!");
-				free(v->u.sval.data);
-			}
-			v->u.sval.length = 0;
-		}
-		break;
-
-		case VAR_OBJECT:
-		{
-			Object *o = object_for_var(v);
-			for(ObjectField *it = o->fields; it; it = it->next)
-			{
-				Variable *value = it->value;
-				free_var(vm, value);
-			}
-			free_object(vm, o);
-		}
-		break;
-	}
-}
-
 // static Variable *variable(VM *vm)
 // {
 // 	Variable *var = alloc_var(vm);
@@ -563,9 +726,23 @@ static Variable ref(VM *vm, Variable *referee)
 	return v;
 }
 
-Object *vm_allocate_object(VM *vm)
+// Only looked up when needed, keeps the dispatch loop from having to track it for every instruction
+static gsc_DebugInfo current_debug_info(VM *vm)
+{
+	gsc_DebugInfo di = { 0 };
+	Thread *thr = vm->thread;
+	if(!thr || thr->bp < 0)
+		return di;
+	StackFrame *sf = &thr->frames[thr->bp];
+	di.file = sf->file;
+	di.function = sf->function;
+	di.line = frame_line(sf);
+	return di;
+}
+
+static Object *allocate_object(VM *vm, Object **list)
 {
-	Object *o = object_pool_allocate(&vm->pool.uo, Object);
+	Object *o = object_pool_allocate(&vm->pool.objects, Object);
 	if(!o)
 		vm_error(vm, "No objects left");
 	o->fields = NULL;
@@ -573,10 +750,332 @@ Object *vm_allocate_object(VM *vm)
 	o->refcount = 0;
 	o->field_count = 0;
 	o->proxy = NULL;
-	o->debug_info = vm->debug_info;
+	o->flags = 0;
+	o->shape = NULL;
+	o->slots = NULL;
+	o->array = NULL;
+	o->array_count = 0;
+	o->array_capacity = 0;
+	o->debug_info = current_debug_info(vm);
+	// Allocated during marking means it survives this cycle
+	o->gc_mark = vm->gc.state == VM_GC_MARK ? VM_GC_BLACK : VM_GC_WHITE;
+	o->gc_next = *list;
+	*list = o;
+	vm->gc.allocated++;
+	return o;
+}
+
+Object *vm_allocate_object(VM *vm)
+{
+	return allocate_object(vm, &vm->gc.objects);
+}
+
+// For objects the host keeps a pointer to, these are roots and never freed
+Object *vm_allocate_pinned_object(VM *vm)
+{
+	Object *o = allocate_object(vm, &vm->gc.pinned);
+	o->refcount = VM_REFCOUNT_NO_FREE;
 	return o;
 }
 
+// Incremental mark and sweep collector
+// Steps only run between frames, when every live value is reachable from a root (thread stacks and locals, queued events,
+// globals, pinned objects and whatever the host marks through mark_roots). Marking is interleaved with the
+// scripts, stores into the heap shade the stored value (gc_barrier) and the roots are scanned again before sweeping.
+// References keep the variable they point to marked but not the object owning it.
+
+static void gc_shade_object(VM *vm, Object *o)
+{
+	if(!o || o->gc_mark != VM_GC_WHITE)
+		return;
+	o->gc_mark = VM_GC_GRAY;
+	if(vm->gc.gray_count < VM_GC_GRAY_STACK_SIZE)
+		vm->gc.gray[vm->gc.gray_count++] = o;
+	else
+		vm->gc.gray_overflow = true;
+}
+
+static void gc_mark_variable(VM *vm, Variable *v)
+{
+	switch(v->type)
+	{
+		case VAR_OBJECT: gc_shade_object(vm, v->u.oval); break;
+		case VAR_STRING: variable_string_header(v->u.sval.data)->gc_mark = VM_GC_BLACK; break;
+		case VAR_REFERENCE:
+			if(v->u.refval && v->u.refval->type != VAR_REFERENCE)
+				gc_mark_variable(vm, v->u.refval);
+		break;
+	}
+}
+
+void vm_gc_mark(VM *vm, Variable *v)
+{
+	if(vm->gc.state == VM_GC_MARK)
+		gc_mark_variable(vm, v);
+}
+
+static void gc_barrier(VM *vm, Variable *v)
+{
+	if(vm->gc.state == VM_GC_MARK)
+		gc_mark_variable(vm, v);
+}
+
+static int gc_scan_object(VM *vm, Object *o)
+{
+	o->gc_mark = VM_GC_BLACK;
+	gc_shade_object(vm, o->proxy);
+	for(ObjectField *it = o->fields; it; it = it->next)
+		gc_mark_variable(vm, it->value);
+	for(int i = 0; i < o->array_count; ++i)
+		gc_mark_variable(vm, &o->array[i]);
+	return 1 + o->field_count + o->array_count;
+}
+
+static void gc_mark_thread(VM *vm, Thread *t)
+{
+	for(int i = 0; i < t->sp; ++i)
+		gc_mark_variable(vm, &t->stack[i]);
+	for(int i = 0; i <= t->bp; ++i)
+	{
+		StackFrame *f = &t->frames[i];
+		for(int j = 0; j < f->local_count; ++j)
+			gc_mark_variable(vm, &f->locals[j]);
+	}
+	if(t->state == VM_THREAD_WAITING_EVENT)
+		gc_shade_object(vm, t->waittill.object);
+	// Keeps the address from being reused by another object the thread would then end on
+	for(VMEventWait *it = t->endon; it; it = it->thread_next)
+		gc_shade_object(vm, it->object);
+}
+
+static void gc_mark_roots(VM *vm)
+{
+	gc_mark_variable(vm, &vm->global_object);
+	for(Object *o = vm->gc.pinned; o; o = o->gc_next)
+		gc_shade_object(vm, o);
+	gc_mark_thread(vm, &vm->temp_thread);
+	if(vm->thread != &vm->temp_thread)
+		gc_mark_thread(vm, vm->thread);
+	int n = thread_count(vm);
+	for(int i = 0; i < n; ++i)
+		gc_mark_thread(vm, vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads]);
+	for(int i = 0; i < vm->timers.count; ++i)
+		gc_mark_thread(vm, vm->timers.heap[i]);
+	for(int i = 0; i < vm->waits.bucket_count; ++i)
+	{
+		for(VMEventWait *it = vm->waits.buckets[i]; it; it = it->next)
+		{
+			if(it->kind == VM_EVENT_WAITTILL)
+				gc_mark_thread(vm, it->thread);
+		}
+	}
+	char *it = vm->events.base;
+	for(int i = 0; i < vm->events.count; ++i)
+	{
+		VMEvent *ev = (VMEvent *)it;
+		gc_shade_object(vm, ev->object);
+		for(int k = 0; k < ev->numargs; ++k)
+			gc_mark_variable(vm, &ev->arguments[k]);
+		it += vm_event_size(ev->numargs);
+	}
+	if(vm->mark_roots)
+		vm->mark_roots(vm->ctx);
+}
+
+// Returns the amount of work done, stops early once there is nothing left to mark
+static int gc_propagate(VM *vm, int limit)
+{
+	int work = 0;
+	while(work < limit)
+	{
+		if(vm->gc.gray_count > 0)
+		{
+			Object *o = vm->gc.gray[--vm->gc.gray_count];
+			if(o->gc_mark == VM_GC_GRAY)
+				work += gc_scan_object(vm, o);
+			continue;
+		}
+		if(!vm->gc.gray_overflow)
+			break;
+		// Gray stack ran out of space, pick the gray objects up from the lists instead
+		vm->gc.gray_overflow = false;
+		for(Object *o = vm->gc.objects; o; o = o->gc_next)
+		{
+			if(o->gc_mark == VM_GC_GRAY)
+				work += gc_scan_object(vm, o);
+		}
+		for(Object *o = vm->gc.pinned; o; o = o->gc_next)
+		{
+			if(o->gc_mark == VM_GC_GRAY)
+				work += gc_scan_object(vm, o);
+		}
+	}
+	return work;
+}
+
+static void free_slots(VM *vm, Object *o);
+
+static int gc_free_object(VM *vm, Object *o)
+{
+	int work = 1 + o->array_count;
+	free_slots(vm, o);
+	if(o->array)
+		free_block(vm, o->array, o->array_capacity * sizeof(Variable));
+	for(ObjectField *it = o->fields; it;)
+	{
+		ObjectField *field = it;
+		it = it->next;
+		object_pool_deallocate(&vm->pool.variables, field->value);
+		object_pool_deallocate(&vm->pool.object_fields, field);
+		++work;
+	}
+	object_pool_deallocate(&vm->pool.objects, o);
+	return work;
+}
+
+static int gc_sweep(VM *vm, int limit)
+{
+	int work = 0;
+	while(work < limit && vm->gc.sweep_objects)
+	{
+		Object *o = vm->gc.sweep_objects;
+		vm->gc.sweep_objects = o->gc_next;
+		if(o->gc_mark == VM_GC_WHITE)
+		{
+			work += gc_free_object(vm, o);
+			vm->gc.freed++;
+			continue;
+		}
+		o->gc_mark = VM_GC_WHITE;
+		o->gc_next = vm->gc.objects;
+		vm->gc.objects = o;
+		vm->gc.survivors += 1 + o->field_count + o->array_count;
+		++work;
+	}
+	while(work < limit && vm->gc.sweep_strings)
+	{
+		VariableStringHeader *hdr = vm->gc.sweep_strings;
+		vm->gc.sweep_strings = hdr->gc_next;
+		++work;
+		if(hdr->gc_mark == VM_GC_WHITE)
+		{
+			free_variable_string(vm, hdr);
+			vm->gc.freed++;
+			continue;
+		}
+		hdr->gc_mark = VM_GC_WHITE;
+		hdr->gc_next = vm->gc.strings;
+		vm->gc.strings = hdr;
+		vm->gc.survivors++;
+	}
+	return work;
+}
+
+static void gc_begin_cycle(VM *vm)
+{
+	vm->gc.state = VM_GC_MARK;
+	vm->gc.allocated = 0;
+	vm->gc.survivors = 0;
+	gc_mark_roots(vm);
+}
+
+// Roots are scanned once more since they're not behind the write barrier, after that everything still white is garbage
+static void gc_finish_mark(VM *vm)
+{
+	gc_mark_roots(vm);
+	gc_propagate(vm, INT_MAX);
+	for(Object *o = vm->gc.pinned; o; o = o->gc_next)
+		o->gc_mark = VM_GC_WHITE;
+	// New allocations go onto fresh lists while the old ones are swept
+	vm->gc.sweep_objects = vm->gc.objects;
+	vm->gc.sweep_strings = vm->gc.strings;
+	vm->gc.objects = NULL;
+	vm->gc.strings = NULL;
+	vm->gc.state = VM_GC_SWEEP;
+}
+
+static double gc_time_us(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+#define VM_GC_STEP_WORK (256)
+
+// Does collection work for at most budget_us microseconds (or until the cycle is done if negative)
+// A new cycle is only started once enough has been allocated, returns whether a cycle is in progress
+bool vm_gc_step(VM *vm, int budget_us)
+{
+	if(vm->gc.state == VM_GC_IDLE)
+	{
+		if(vm->gc.allocated < vm->gc.threshold)
+			return false;
+		gc_begin_cycle(vm);
+	}
+	bool unbounded = budget_us < 0;
+	double start = gc_time_us();
+	while(vm->gc.state != VM_GC_IDLE)
+	{
+		if(vm->gc.state == VM_GC_MARK)
+		{
+			if(gc_propagate(vm, VM_GC_STEP_WORK) < VM_GC_STEP_WORK)
+				gc_finish_mark(vm);
+		}
+		else if(gc_sweep(vm, VM_GC_STEP_WORK) < VM_GC_STEP_WORK)
+		{
+			vm->gc.state = VM_GC_IDLE;
+			vm->gc.threshold = MAX(VM_GC_MIN_THRESHOLD, vm->gc.survivors);
+			vm->gc.cycles++;
+		}
+		if(!unbounded && gc_time_us() - start >= budget_us)
+			break;
+	}
+	return vm->gc.state != VM_GC_IDLE;
+}
+
+// Full collection, finishes the cycle in progress first since it may keep garbage allocated while marking alive
+void vm_gc_collect(VM *vm)
+{
+	vm_gc_step(vm, -1);
+	gc_begin_cycle(vm);
+	vm_gc_step(vm, -1);
+}
+
+static void pool_stats(gsc_PoolStats *stats, const char *name, ObjectPool *pool)
+{
+	stats->name = name;
+	stats->item_size = pool->struct_size;
+	stats->used = pool->used;
+	stats->allocated = pool->size;
+	stats->chunks = pool->chunk_count;
+}
+
+int vm_pool_stats(VM *vm, gsc_PoolStats *stats, int max_stats)
+{
+	static const char *string_pool_names[] = { "strings32", "strings64", "strings128", "strings256" };
+	struct
+	{
+		const char *name;
+		ObjectPool *pool;
+	} pools[] = {
+		{ "threads", &vm->pool.threads },
+		{ "event_waits", &vm->pool.event_waits },
+		{ "variables", &vm->pool.variables },
+		{ "object_fields", &vm->pool.object_fields },
+		{ "objects", &vm->pool.objects },
+		{ "shapes", &vm->pool.shapes },
+		{ string_pool_names[0], &vm->pool.strings[0] },
+		{ string_pool_names[1], &vm->pool.strings[1] },
+		{ string_pool_names[2], &vm->pool.strings[2] },
+		{ string_pool_names[3], &vm->pool.strings[3] },
+	};
+	int n = sizeof(pools) / sizeof(pools[0]);
+	for(int i = 0; i < n && i < max_stats; ++i)
+		pool_stats(&stats[i], pools[i].name, pools[i].pool);
+	return n;
+}
+
 Variable vm_create_object(VM *vm)
 {
 	Variable v = { .type = VAR_OBJECT };
@@ -599,11 +1098,10 @@ Variable vm_create_object(VM *vm)
 
 static void push_thread(VM *vm, Thread *thr, Variable v)
 {
-    StackFrame *sf = stack_frame(vm, thr);
 	if(thr->sp < 0)
 		vm_error(vm, "stack ptr < 0");
-	if(thr->sp >= COUNT_OF(thr->stack))
-		vm_error(vm, "stack ptr > max");
+	if(thr->sp >= thr->stack_capacity)
+		grow_stack(vm, thr, thr->sp + 1);
     thr->stack[thr->sp++] = v;
 }
 
@@ -622,7 +1120,7 @@ static Variable pop_thread(VM *vm, Thread *thr)
 {
 	if(thr->sp <= 0)
 		vm_error(vm, "stack ptr < 0");
-	if(thr->sp > COUNT_OF(thr->stack))
+	if(thr->sp > thr->stack_capacity)
 		vm_error(vm, "stack ptr > max");
     Variable *top = &thr->stack[--thr->sp];
     // Variable ret = *top;
@@ -659,29 +1157,9 @@ static Variable *pop_ref(VM *vm)
 // 	return v;
 // }
 
-static void pop_string(VM *vm, char *str, size_t n)
+static int64_t pop_int(VM *vm)
 {
     Thread *thr = vm->thread;
-    StackFrame *sf = stack_frame(vm, thr);
-    Variable *top = &thr->stack[--thr->sp];
-	switch(top->type)
-	{
-		// TODO: directly use a hash and memcmp for integer/other type of keys
-
-		case VAR_BOOLEAN:
-		case VAR_INTEGER: snprintf(str, n, "%" PRId64, top->u.ival); break;
-		case VAR_FLOAT: snprintf(str, n, "%f", top->u.fval); break;
-		case VAR_INTERNED_STRING:
-		case VAR_STRING: snprintf(str, n, "%s", variable_string(vm, top)); break;
-		default: vm_error(vm, "'%s' is not a string", variable_type_names[top->type]); break;
-	}
-	decref(vm, top);
-}
-
-static int64_t pop_int(VM *vm)
-{
-    Thread *thr = vm->thread;
-    StackFrame *sf = stack_frame(vm, thr);
     Variable *top = &thr->stack[--thr->sp];
     if(top->type != VAR_INTEGER && top->type != VAR_BOOLEAN)
 		vm_error(vm, "'%s' is not a integer", variable_type_names[top->type]);
@@ -690,94 +1168,157 @@ static int64_t pop_int(VM *vm)
     return i;
 }
 
-static void validate_operand_type(VM *vm, Operand *op, OperandType expected_type, const char *type_name)
+// Non-negative integer a string spells without sign or leading zeros, -1 otherwise
+static int64_t string_index_value(const char *s)
 {
-    if(op->type != expected_type)
+	if(!*s || (s[0] == '0' && s[1]))
+		return -1;
+	int64_t n = 0;
+	for(; *s; ++s)
 	{
-		StackFrame *sf = stack_frame(vm, vm->thread);
-		Instruction *ins = (sf->ip > 0) ? &sf->instructions[sf->ip - 1] : NULL;
-        vm_error(vm, "Operand '%s' is not a %s (opcode=%s)",
-			operand_type_names[op->type], type_name,
-			ins ? opcode_names[ins->opcode] : "?");
+		if(*s < '0' || *s > '9')
+			return -1;
+		n = n * 10 + (*s - '0');
+		if(n >= INT_MAX)
+			return -1;
 	}
+	return n;
 }
 
-static int64_t read_int(VM *vm, Instruction *ins, size_t idx)
-{
-    Operand *op = &ins->operands[idx];
-    validate_operand_type(vm, op, OPERAND_TYPE_INT, "integer");
-    return op->value.integer;
-}
-
-static int read_string_index(VM *vm, Instruction *ins, size_t idx)
+// Interned strings are folded once, after that it's a lookup
+static int folded_entry(VM *vm, int idx)
 {
-    Operand *op = &ins->operands[idx];
-    validate_operand_type(vm, op, OPERAND_TYPE_INDEXED_STRING, "string");
-    return op->value.string_index;
-}
-
-static const char* read_string(VM *vm, Instruction *ins, size_t idx)
-{
-    Operand *op = &ins->operands[idx];
-    validate_operand_type(vm, op, OPERAND_TYPE_INDEXED_STRING, "string");
-    return string_table_get(vm->strings, op->value.string_index);
+	if(idx < vm->keys.capacity && vm->keys.folded[idx])
+		return vm->keys.folded[idx];
+	const char *s = string(vm, idx);
+	int64_t n = string_index_value(s);
+	int entry = n >= 0 ? (int)-(n + 1) : vm_field_key(vm, s) + 1;
+	if(idx >= vm->keys.capacity)
+	{
+		int count = vm->keys.capacity;
+		vm->keys.folded = grow_block(vm, vm->keys.folded, sizeof(int), count, &vm->keys.capacity, idx + 1, INT_MAX);
+		memset(vm->keys.folded + count, 0, (vm->keys.capacity - count) * sizeof(int));
+	}
+	vm->keys.folded[idx] = entry;
+	return entry;
 }
 
-static float read_float(VM *vm, Instruction *ins, size_t idx)
+static int folded_key(VM *vm, int idx)
 {
-    Operand *op = &ins->operands[idx];
-    validate_operand_type(vm, op, OPERAND_TYPE_FLOAT, "float");
-    return op->value.number;
+	int entry = folded_entry(vm, idx);
+	return entry > 0 ? entry - 1 : idx; // Digits have no case
 }
 
-static bool check_operand(Instruction *ins, size_t idx, OperandType type)
+// Integers and strings that spell one, e.g. "3" from C, index the array part of objects
+static bool pop_index(VM *vm, int64_t *index)
 {
-    return ins->operands[idx].type == type;
+	Thread *thr = vm->thread;
+	Variable *top = &thr->stack[thr->sp - 1];
+	switch(top->type)
+	{
+		case VAR_BOOLEAN:
+		case VAR_INTEGER: *index = top->u.ival; break;
+		case VAR_INTERNED_STRING:
+		{
+			int entry = folded_entry(vm, top->u.ival);
+			if(entry > 0)
+				return false;
+			*index = -(int64_t)entry - 1;
+		}
+		break;
+		case VAR_STRING:
+		{
+			*index = string_index_value(variable_string(vm, top));
+			if(*index < 0)
+				return false;
+		}
+		break;
+		default: return false;
+	}
+	decref(vm, top);
+	thr->sp--;
+	return true;
 }
 
-static void print_operand(VM *vm, Operand *operand, FILE *fp)
+// Keys that aren't known when compiling, e.g. a[i]
+static int pop_field_key(VM *vm)
 {
-	if(operand->type == OPERAND_TYPE_NONE)
-	{
-		return;
-	}
-	switch(operand->type)
+	Thread *thr = vm->thread;
+	Variable *top = &thr->stack[--thr->sp];
+	char str[64];
+	int key = 0;
+	switch(top->type)
 	{
-		case OPERAND_TYPE_INDEXED_STRING: fprintf(fp, "%s ", string(vm, operand->value.string_index)); break;
-		case OPERAND_TYPE_INT: fprintf(fp, "%d ", operand->value.integer); break;
-		case OPERAND_TYPE_FLOAT: fprintf(fp, "%f ", operand->value.number); break;
+		case VAR_BOOLEAN:
+		case VAR_INTEGER:
+			snprintf(str, sizeof(str), "%" PRId64, top->u.ival);
+			key = vm_string_index(vm, str);
+			break;
+		case VAR_FLOAT:
+			snprintf(str, sizeof(str), "%f", top->u.fval);
+			key = vm_string_index(vm, str);
+			break;
+		case VAR_INTERNED_STRING: key = folded_key(vm, top->u.ival); break;
+		case VAR_STRING: key = vm_field_key(vm, variable_string(vm, top)); break;
+		default: vm_error(vm, "'%s' is not a string", variable_type_names[top->type]); break;
 	}
-	// fprintf(fp, "%s ", operand_type_names[instr->operands[i].type]);
+	decref(vm, top);
+	return key;
 }
 
 static void print_instruction(VM *vm, Instruction *instr, FILE *fp)
 {
+	StackFrame *sf = stack_frame(vm, vm->thread);
 	fprintf(fp, "%s ", opcode_names[instr->opcode]);
 	switch(instr->opcode)
 	{
 		case OP_PUSH:
 		{
-			static const char *_[] = {
-
-				"STRING", "INTEGER", "BOOLEAN", "FLOAT", "FUNCTION", "LOCALIZED_STRING", "UNDEFINED", NULL
-			};
-			fprintf(fp, "%s ", _[instr->operands[0].value.integer]);
-			if(instr->operands[0].value.integer == AST_LITERAL_TYPE_STRING)
+			switch(instr->a)
 			{
-				fprintf(fp, "%s", string(vm, instr->operands[1].value.string_index));
+				case AST_LITERAL_TYPE_FLOAT:
+				{
+					float f;
+					memcpy(&f, &instr->c, sizeof(f));
+					fprintf(fp, "FLOAT %f", f);
+				}
+				break;
+				case AST_LITERAL_TYPE_BOOLEAN: fprintf(fp, "BOOLEAN %d", instr->c); break;
+				case AST_LITERAL_TYPE_INTEGER: fprintf(fp, "INTEGER %d", instr->c); break;
+				case AST_LITERAL_TYPE_UNDEFINED: fprintf(fp, "UNDEFINED"); break;
 			}
-			else
+		}
+		break;
+		case OP_PUSH_CONST:
+		case OP_CALL:
+		{
+			Constant *k = &sf->constants[instr->c];
+			switch(k->type)
 			{
-				print_operand(vm, &instr->operands[1], fp);
+				case AST_LITERAL_TYPE_FUNCTION:
+					if(k->value.function.file != -1)
+						fprintf(fp, "%s::", string(vm, k->value.function.file));
+					fprintf(fp, "%s ", string(vm, k->value.function.function));
+					break;
+				case AST_LITERAL_TYPE_INTEGER: fprintf(fp, "%" PRId64 " ", k->value.integer); break;
+				case AST_LITERAL_TYPE_VECTOR: fprintf(fp, "(%g, %g, %g) ", k->value.vector[0], k->value.vector[1], k->value.vector[2]); break;
+				default: fprintf(fp, "%s ", string(vm, k->value.string_index)); break;
 			}
+			if(instr->opcode == OP_CALL)
+				fprintf(fp, "%d %d", instr->b, instr->a);
+		}
+		break;
+		case OP_LOAD_FIELD:
+		case OP_FIELD_REF:
+		{
+			if(instr->a)
+				fprintf(fp, "%s ", string(vm, instr->c));
+			fprintf(fp, "%d", instr->b);
 		}
 		break;
 		default:
 		{
-			for(size_t i = 0; i < MAX_OPERANDS; ++i)
-			{
-				print_operand(vm, &instr->operands[i], fp);
-			}
+			fprintf(fp, "%d %d %d", instr->a, instr->b, instr->c);
 		}
 		break;
 	}
@@ -941,6 +1482,18 @@ static Variable unary(VM *vm, Variable *arg, int op)
 		}
 		break;
 
+		case VAR_VECTOR:
+		{
+			if(op == '-')
+			{
+				for(int i = 0; i < 3; ++i)
+					result.u.vval[i] = -arg->u.vval[i];
+			}
+			else
+				err = true;
+		}
+		break;
+
 		case VAR_STRING:
 		case VAR_INTERNED_STRING:
 		{
@@ -969,6 +1522,81 @@ static Variable unary(VM *vm, Variable *arg, int op)
 
 // #define VM_ERROR_ON_DIVIDE_BY_ZERO
 
+// Only the bytes the type uses are compared, the rest of the cell may be anything
+static bool same_value(Variable *a, Variable *b)
+{
+	if(a->type != b->type)
+		return false;
+	switch(a->type)
+	{
+		case VAR_UNDEFINED: return true;
+		case VAR_FLOAT: return a->u.fval == b->u.fval;
+		case VAR_VECTOR: return !memcmp(a->u.vval, b->u.vval, sizeof(a->u.vval));
+		case VAR_STRING: return a->u.sval.data == b->u.sval.data && a->u.sval.length == b->u.sval.length;
+		case VAR_FUNCTION:
+			if(a->u.funval.is_native != b->u.funval.is_native)
+				return false;
+			if(a->u.funval.is_native)
+				return a->u.funval.native_function == b->u.funval.native_function;
+			return a->u.funval.file == b->u.funval.file && a->u.funval.function == b->u.funval.function;
+	}
+	return a->u.ival == b->u.ival;
+}
+
+// Characters of an operand of a string operator, other types are written to buf
+static const char *string_operand(VM *vm, Variable *v, char *buf, size_t n, int *length)
+{
+	switch(v->type)
+	{
+		case VAR_STRING: *length = v->u.sval.length; return v->u.sval.data;
+		case VAR_INTERNED_STRING: *length = string_table_length(vm->strings, v->u.ival); return string(vm, v->u.ival);
+	}
+	const char *s = vm_stringify(vm, v, buf, n);
+	*length = strlen(s);
+	return s;
+}
+
+// Strings never change, so the characters of the left one are extended in place if nothing was appended to it yet
+// The strings sharing them see the same prefix, only their \0 is gone, see variable_string
+static Variable concat_strings(VM *vm, Variable *lhs, Variable *rhs)
+{
+	char buf[2][256];
+	int a_length, b_length;
+	const char *a = string_operand(vm, lhs, buf[0], sizeof(buf[0]), &a_length);
+	const char *b = string_operand(vm, rhs, buf[1], sizeof(buf[1]), &b_length);
+	Variable result = { .type = VAR_STRING };
+	if(lhs->type == VAR_STRING)
+	{
+		VariableStringHeader *hdr = variable_string_header(lhs->u.sval.data);
+		if(hdr->used == a_length && string_capacity(hdr) - a_length >= b_length)
+		{
+			char *data = lhs->u.sval.data;
+			memcpy(data + a_length, b, b_length);
+			hdr->used += b_length;
+			data[hdr->used] = 0;
+			result.u.sval = (VariableString) { .data = data, .length = hdr->used };
+			return result;
+		}
+	}
+	// A string that is appended to is likely being built up, leave room for more
+	int n = a_length + b_length;
+	result.u.sval = allocate_variable_string(vm, n, lhs->type == VAR_STRING ? n * 2 : n);
+	memcpy(result.u.sval.data, a, a_length);
+	memcpy(result.u.sval.data + a_length, b, b_length);
+	return result;
+}
+
+static bool strings_equal(VM *vm, Variable *lhs, Variable *rhs)
+{
+	if(lhs->type == VAR_INTERNED_STRING && rhs->type == VAR_INTERNED_STRING)
+		return lhs->u.ival == rhs->u.ival;
+	char buf[2][256];
+	int a_length, b_length;
+	const char *a = string_operand(vm, lhs, buf[0], sizeof(buf[0]), &a_length);
+	const char *b = string_operand(vm, rhs, buf[1], sizeof(buf[1]), &b_length);
+	return a_length == b_length && !memcmp(a, b, a_length);
+}
+
 static Variable binop(VM *vm, Variable *lhs, Variable *rhs, int op)
 {
 	char temp[64];
@@ -982,11 +1610,11 @@ static Variable binop(VM *vm, Variable *lhs, Variable *rhs, int op)
 			{
 				case TK_EQUAL:
 					result.type = VAR_BOOLEAN;
-					result.u.ival = lhs->type == rhs->type && !memcmp(&lhs->u, &rhs->u, sizeof(lhs->u));
+					result.u.ival = same_value(lhs, rhs);
 					break;
 				case TK_NEQUAL:
 					result.type = VAR_BOOLEAN;
-					result.u.ival = !(lhs->type == rhs->type && !memcmp(&lhs->u, &rhs->u, sizeof(lhs->u)));
+					result.u.ival = !same_value(lhs, rhs);
 					break;
 				default:
 				{
@@ -1224,31 +1852,21 @@ static Variable binop(VM *vm, Variable *lhs, Variable *rhs, int op)
 		case VAR_INTERNED_STRING:
 		case VAR_STRING:
 		{
-			// TODO: FIXME
-			static char a_buf[4096];
-			static char b_buf[4096];
-			const char *a = vm_stringify(vm, lhs, a_buf, sizeof(a_buf));
-			const char *b = vm_stringify(vm, rhs, b_buf, sizeof(b_buf));
 			switch(op)
 			{
 				case TK_PLUS_ASSIGN:
 				case '+':
 				{
-					size_t n = strlen(a) + strlen(b) + 1;
-					VariableString vs = allocate_variable_string(vm, n);
-					// char *str = malloc(n);
-					snprintf(vs.data, n, "%s%s", a, b);
-					result.type = VAR_STRING;
-					result.u.sval = vs;
+					result = concat_strings(vm, lhs, rhs);
 				}
 				break;
 				case TK_EQUAL:
 					result.type = VAR_BOOLEAN;
-					result.u.ival = 0 == strcmp(a, b);
+					result.u.ival = strings_equal(vm, lhs, rhs);
 					break;
 				case TK_NEQUAL:
 					result.type = VAR_BOOLEAN;
-					result.u.ival = 0 != strcmp(a, b);
+					result.u.ival = !strings_equal(vm, lhs, rhs);
 					break;
 				default:
 				{
@@ -1289,18 +1907,93 @@ Thread *remove_thread(VM *vm)
 	return t;
 }
 
-gsc_Function object_get_function(VM *vm, Object *object, const char *function)
+static bool timer_before(Thread *a, Thread *b)
+{
+	if(a->wake_time != b->wake_time)
+		return a->wake_time < b->wake_time;
+	return (int32_t)(a->wake_sequence - b->wake_sequence) < 0;
+}
+
+// Threads know their slot so endon can take them out of the heap
+static void timer_set(VM *vm, int i, Thread *t)
+{
+	vm->timers.heap[i] = t;
+	t->timer_index = i;
+}
+
+static void timer_sift_down(VM *vm, int i)
+{
+	Thread **heap = vm->timers.heap;
+	int n = vm->timers.count;
+	for(;;)
+	{
+		int smallest = i;
+		int l = 2 * i + 1, r = l + 1;
+		if(l < n && timer_before(heap[l], heap[smallest]))
+			smallest = l;
+		if(r < n && timer_before(heap[r], heap[smallest]))
+			smallest = r;
+		if(smallest == i)
+			break;
+		Thread *tmp = heap[i];
+		timer_set(vm, i, heap[smallest]);
+		timer_set(vm, smallest, tmp);
+		i = smallest;
+	}
+}
+
+static void timer_sift_up(VM *vm, int i, Thread *t)
+{
+	Thread **heap = vm->timers.heap;
+	while(i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if(!timer_before(t, heap[parent]))
+			break;
+		timer_set(vm, i, heap[parent]);
+		i = parent;
+	}
+	timer_set(vm, i, t);
+}
+
+static void timer_insert(VM *vm, Thread *t)
+{
+	if(vm->timers.count >= vm->max_threads)
+		vm_error(vm, "Maximum amount of threads reached");
+	t->wake_sequence = vm->timers.sequence++;
+	timer_sift_up(vm, vm->timers.count++, t);
+}
+
+static void timer_remove(VM *vm, Thread *t)
+{
+	int i = t->timer_index;
+	Thread *last = vm->timers.heap[--vm->timers.count];
+	t->timer_index = -1;
+	if(last == t)
+		return;
+	timer_sift_up(vm, i, last);
+	timer_sift_down(vm, last->timer_index);
+}
+
+static Thread *timer_pop(VM *vm)
+{
+	Thread *t = vm->timers.heap[0];
+	timer_remove(vm, t);
+	return t;
+}
+
+gsc_Function object_get_function(VM *vm, Object *object, int function)
 {
 	ObjectField *entry = vm_object_upsert(NULL, object, function);
 	if(!entry)
 		return NULL;
 	Variable *val = entry->value;
 	if(val->type != VAR_FUNCTION)
-		vm_error(vm, "'%s' is not a function", function);
+		vm_error(vm, "'%s' is not a function", string(vm, function));
 	return val->u.funval.native_function;
 }
 
-gsc_Function object_find_callable(VM *vm, Object *object, const char *callable, const char *function)
+gsc_Function object_find_callable(VM *vm, Object *object, int callable, int function)
 {
 	Object *proxy = object->proxy;
 	while(proxy)
@@ -1310,7 +2003,8 @@ gsc_Function object_find_callable(VM *vm, Object *object, const char *callable,
 		{
 			Variable *call = entry->value;
 			if(call->type != VAR_OBJECT)
-				vm_error(vm, "%s is not an object", callable);
+				vm_error(vm, "%s is not an object", string(vm, callable));
+			call->u.oval->flags |= VM_OBJECT_FLAG_PROXY; // Adding a function to it changes the lookup
 			gsc_Function f = object_get_function(vm, call->u.oval, function);
 			if(f)
 				return f;
@@ -1320,7 +2014,8 @@ gsc_Function object_find_callable(VM *vm, Object *object, const char *callable,
 	return NULL;
 }
 
-static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
+// Returns the field if it was a plain load
+static ObjectField *op_load_field_object_(VM *vm, Variable obj, int key)
 {
 	if(obj.type == VAR_UNDEFINED)
 	{
@@ -1337,9 +2032,9 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 		{
 			vm_error(vm, "object is null");
 		}
-		if(!strcmp(prop, "size"))
+		if(key == vm->keys.size)
 		{
-			push(vm, integer(vm, o->field_count));
+			push(vm, integer(vm, o->field_count + o->array_count));
 			// Variable *v = variable(vm);
 			// v->type = VAR_INTEGER;
 			// v->u.ival = o->fields.length;
@@ -1350,7 +2045,7 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 			bool handled = false;
 			if(o->proxy)
 			{
-				gsc_Function func = object_find_callable(vm, o, "__get", prop);
+				gsc_Function func = object_find_callable(vm, o, vm->keys.get, key);
 				if(func)
 				{
 					push(vm, obj);
@@ -1370,7 +2065,7 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 			}
 			if(!handled)
 			{
-				ObjectField *entry = vm_object_upsert(NULL, o, prop);
+				ObjectField *entry = vm_object_upsert(NULL, o, key);
 				if(!entry)
 				{
 					push(vm, undef);
@@ -1379,78 +2074,465 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 				{
 					push(vm, *entry->value);
 				}
+				return entry;
 			}
 		}
 	}
+	return NULL;
 }
 
-static bool call_function(VM *vm, Thread*, const char *file, const char *function, int function_string_index, size_t nargs, bool, int);
-#define ASSERT_STACK(X)                                                              \
-	do                                                                               \
-	{                                                                                \
-		if(thr->sp != sp + (X))                                                      \
-			vm_error(vm, "Stack cookie failed for '%s'! Expected %d, got %d", opcode_names[ins->opcode], sp + (X), thr->sp); \
+static bool call_function(VM *vm, Thread*, const char *file, const char *function, size_t nargs, bool, int);
+static bool call_target(VM *vm, Thread *, CallTarget *, const char *file, const char *function, size_t nargs, bool, int);
+static void leave_function(VM *vm, StackFrame *sf);
+static VMEventWait *register_event_wait(VM *vm, Thread *t, Object *object, int name, int kind);
+static VMEvent *new_event(VM *vm, Object *object, int name, int numargs);
+static void post_event(VM *vm, VMEvent *ev);
+static int event_name(VM *vm, const char *key);
+static Variable *object_index(VM *vm, Object *o, int64_t n, bool create);
+static FieldCache *field_cache(StackFrame *sf, Instruction *ins);
+static ObjectField *field_cache_lookup(VM *vm, FieldCache *fc, Object *o, int key);
+static void field_cache_update(VM *vm, FieldCache *fc, Object *o, int key, ObjectField *field);
+// verify_function already checked the locals, stack depth and room on the stack of every instruction
+// Build with VM_CHECKED to check them again while running
+#ifdef VM_CHECKED
+	#define ASSERT_STACK(X)                                                              \
+		do                                                                               \
+		{                                                                                \
+			if(thr->sp != sp + (X))                                                      \
+				vm_error(vm, "Stack cookie failed for '%s'! Expected %d, got %d", opcode_names[ins->opcode], sp + (X), thr->sp); \
+		} while(0)
+	#define VM_PUSH(V) push(vm, V)
+	#define VM_POP() pop(vm)
+	#define VM_LOCAL(INDEX) frame_local(vm, sf, INDEX)
+#else
+	#define ASSERT_STACK(X)
+	#define VM_PUSH(V)                      \
+		do                                  \
+		{                                   \
+			Variable pushed_ = (V);         \
+			thr->stack[thr->sp++] = pushed_; \
+		} while(0)
+	#define VM_POP() (thr->stack[--thr->sp])
+	#define VM_LOCAL(INDEX) (&sf->locals[INDEX])
+#endif
+
+// GCC/Clang "labels as values" give every opcode its own indirect branch, the switch is kept as a portable fallback
+#if(defined(__GNUC__) || defined(__clang__)) && !defined(VM_NO_COMPUTED_GOTO)
+	#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_PROFILE
+	// Pairs only count instructions that follow each other in the function, which are the ones that can be fused
+	#define VM_PROFILE_INSTRUCTION()                                                \
+		do                                                                          \
+		{                                                                           \
+			++vm->profile.instructions;                                             \
+			++vm->profile.opcodes[ins->opcode];                                     \
+			if(vm->profile.last + 1 == ins)                                         \
+				++vm->profile.pairs[vm->profile.last->opcode][ins->opcode];         \
+			vm->profile.last = ins;                                                 \
+		} while(0)
+#else
+	#define VM_PROFILE_INSTRUCTION()
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+	#define VM_CASE(NAME) case OP_##NAME: op_##NAME
+	#define VM_DISPATCH() goto *dispatch_table[ins->opcode]
+#else
+	#define VM_CASE(NAME) case OP_##NAME: op_##NAME
+	#define VM_DISPATCH() goto dispatch
+#endif
+
+// BINOP and UNARY are rewritten the first time they run to the variant for the types they saw
+// If the types change later the variant sets the instruction back to the generic one for good
+static int quicken_binop(Variable *lhs, Variable *rhs, int op)
+{
+	if(lhs->type != rhs->type)
+		return OP_BINOP;
+	switch(lhs->type)
+	{
+		case VAR_INTEGER:
+			switch(op)
+			{
+				case TK_PLUS_ASSIGN:
+				case '+': return OP_ADD_INT_INT;
+				case TK_MINUS_ASSIGN:
+				case '-': return OP_SUB_INT_INT;
+				case TK_MUL_ASSIGN:
+				case '*': return OP_MUL_INT_INT;
+				case '<': return OP_LT_INT_INT;
+				case TK_LEQUAL: return OP_LE_INT_INT;
+				case '>': return OP_GT_INT_INT;
+				case TK_GEQUAL: return OP_GE_INT_INT;
+				case TK_EQUAL: return OP_EQ_INT_INT;
+				case TK_NEQUAL: return OP_NE_INT_INT;
+			}
+			break;
+		case VAR_FLOAT:
+			switch(op)
+			{
+				case TK_PLUS_ASSIGN:
+				case '+': return OP_ADD_FLOAT_FLOAT;
+				case TK_MINUS_ASSIGN:
+				case '-': return OP_SUB_FLOAT_FLOAT;
+				case TK_MUL_ASSIGN:
+				case '*': return OP_MUL_FLOAT_FLOAT;
+				case '<': return OP_LT_FLOAT_FLOAT;
+				case TK_LEQUAL: return OP_LE_FLOAT_FLOAT;
+				case '>': return OP_GT_FLOAT_FLOAT;
+				case TK_GEQUAL: return OP_GE_FLOAT_FLOAT;
+			}
+			break;
+		case VAR_VECTOR:
+			switch(op)
+			{
+				case TK_PLUS_ASSIGN:
+				case '+': return OP_ADD_VEC_VEC;
+				case TK_MINUS_ASSIGN:
+				case '-': return OP_SUB_VEC_VEC;
+			}
+			break;
+	}
+	return OP_BINOP;
+}
+
+static int quicken_unary(Variable *arg, int op)
+{
+	switch(arg->type)
+	{
+		case VAR_BOOLEAN:
+		case VAR_INTEGER:
+			if(op == '!')
+				return OP_NOT_INT;
+			if(op == '-' && arg->type == VAR_INTEGER)
+				return OP_NEG_INT;
+			break;
+		case VAR_FLOAT:
+			if(op == '-')
+				return OP_NEG_FLOAT;
+			break;
+	}
+	return OP_UNARY;
+}
+
+static int switch_find(SwitchTable *t, bool jump_table, int64_t key)
+{
+	if(jump_table)
+	{
+		if(key < t->min || (uint64_t)key - t->min >= (uint64_t)t->count)
+			return -1;
+		return t->entries[key - t->min].target;
+	}
+	for(uint32_t i = switch_hash(key) & (t->count - 1);; i = (i + 1) & (t->count - 1))
+	{
+		SwitchEntry *e = &t->entries[i];
+		if(e->target == -1 || e->key == key)
+			return e->target;
+	}
+}
+
+// Values of another type than the cases can still be equal to one, e.g. 1 and "1", these are compared like ==
+static int switch_scan(VM *vm, SwitchTable *t, bool strings, Variable *v)
+{
+	for(int i = 0; i < t->count; ++i)
+	{
+		SwitchEntry *e = &t->entries[i];
+		if(e->target == -1)
+			continue;
+		Variable key = { .type = strings ? VAR_INTERNED_STRING : VAR_INTEGER };
+		key.u.ival = e->key;
+		Variable eq = binop(vm, v, &key, TK_EQUAL);
+		if(eq.u.ival)
+			return e->target;
+	}
+	return -1;
+}
+
+static int switch_target(VM *vm, SwitchTable *t, bool jump_table, bool strings, Variable *v)
+{
+	switch(v->type)
+	{
+		case VAR_INTERNED_STRING:
+			if(!strings)
+				break;
+			return switch_find(t, jump_table, v->u.ival);
+		case VAR_STRING:
+		{
+			if(!strings)
+				break;
+			int key = string_table_find(vm->strings, variable_string(vm, v));
+			return key == -1 ? -1 : switch_find(t, jump_table, key);
+		}
+		case VAR_INTEGER:
+		case VAR_BOOLEAN:
+			if(strings)
+				break;
+			return switch_find(t, jump_table, v->u.ival);
+		case VAR_FLOAT:
+		{
+			if(strings)
+				break;
+			float f = v->u.fval;
+			if(!(f >= -9e18f && f <= 9e18f) || (float)(int64_t)f != f)
+				return -1;
+			return switch_find(t, jump_table, (int64_t)f);
+		}
+	}
+	return switch_scan(vm, t, strings, v);
+}
+
+#define VM_BINOP_CASE(NAME, TYPE, RESULT_TYPE, RESULT, OPERAND, OPERATOR) \
+	VM_CASE(NAME):                                                       \
+	{                                                                    \
+		Variable *rhs = &thr->stack[thr->sp - 1];                        \
+		Variable *lhs = rhs - 1;                                         \
+		if(lhs->type != TYPE || rhs->type != TYPE)                       \
+			goto binop_generic;                                          \
+		lhs->u.RESULT = lhs->u.OPERAND OPERATOR rhs->u.OPERAND;          \
+		lhs->type = RESULT_TYPE;                                         \
+		thr->sp--;                                                       \
+	}                                                                    \
+	VM_NEXT();
+
+#define VM_VECTOR_CASE(NAME, OPERATOR)                              \
+	VM_CASE(NAME):                                                 \
+	{                                                              \
+		Variable *rhs = &thr->stack[thr->sp - 1];                  \
+		Variable *lhs = rhs - 1;                                   \
+		if(lhs->type != VAR_VECTOR || rhs->type != VAR_VECTOR)     \
+			goto binop_generic;                                    \
+		for(int i = 0; i < 3; ++i)                                 \
+			lhs->u.vval[i] = lhs->u.vval[i] OPERATOR rhs->u.vval[i]; \
+		thr->sp--;                                                 \
+	}                                                              \
+	VM_NEXT();
+
+// Superinstructions only replace the opcode of the first instruction of the sequence they stand for
+// The others stay in place, jumps can still land on them and a superinstruction can go back to running them one by one
+#define VM_FUSED_NEXT(NAME)                \
+	do                                     \
+	{                                      \
+		ins = &sf->instructions[sf->ip++]; \
+		sp = thr->sp;                      \
+		goto op_##NAME;                    \
 	} while(0)
 
-// To "computed goto" or not to "computed goto" portability wise...
-// GCC feature "labels as values"
-bool vm_execute_instruction(VM *vm, Instruction *ins)
+#define VM_COMPARE(RESULT, OP, A, B)          \
+	switch(OP)                                \
+	{                                         \
+		case '<': RESULT = A < B; break;      \
+		case '>': RESULT = A > B; break;      \
+		case TK_LEQUAL: RESULT = A <= B; break; \
+		case TK_GEQUAL: RESULT = A >= B; break; \
+		case TK_EQUAL: RESULT = A == B; break; \
+		default: RESULT = A != B; break;      \
+	}
+
+// Fetches the next instruction of the current frame, unless we're only executing a single instruction
+#define VM_NEXT()                              \
+	do                                         \
+	{                                          \
+		if(single_step)                        \
+			return true;                       \
+		ins = &sf->instructions[sf->ip++];     \
+		sp = thr->sp;                          \
+		VM_PROFILE_INSTRUCTION();              \
+		VM_DISPATCH();                         \
+	} while(0)
+
+// Frames of functions with native code continue in it
+#define VM_ENTER_NATIVE()                                        \
+	do                                                           \
+	{                                                            \
+		if(!single_step && sf->compiled && sf->compiled->native) \
+			goto native;                                         \
+	} while(0)
+
+// Runs the current thread starting at ins, stays in this function until the thread yields, returns or errors
+// When single_step is set only ins is executed
+static bool vm_execute(VM *vm, Instruction *ins, bool single_step)
 {
+#ifdef VM_COMPUTED_GOTO
+	#define OPCODE_LABEL(NAME) &&op_##NAME,
+	static const void *dispatch_table[] = { &&op_INVALID, OPCODES(OPCODE_LABEL) };
+#endif
     Thread *thr = vm->thread;
 	StackFrame *sf = stack_frame(vm, thr);
-	vm->debug_info.line = ins->line;
-	vm->debug_info.file = sf->file;
-	if(vm->flags & VM_FLAG_VERBOSE)
+	int sp = thr->sp;
+	if(!single_step && sf->compiled && sf->compiled->native)
 	{
-    	print_instruction(vm, ins, stdout);
+		sf->ip--;
+		goto native;
 	}
-	int sp = thr->sp;
+	VM_PROFILE_INSTRUCTION();
+#ifndef VM_COMPUTED_GOTO
+dispatch:
+#endif
     switch(ins->opcode)
     {
-		case OP_POP:
+		VM_CASE(NOP):
+		VM_NEXT();
+
+		VM_CASE(POP):
 		{
-            Variable v = pop(vm);
+            Variable v = VM_POP();
             decref(vm, &v);
 			ASSERT_STACK(-1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_PRINT_EXPR:
+		VM_CASE(PRINT_EXPR):
 		{
 			char buf[1024];
-            Variable v = pop(vm);
+            Variable v = VM_POP();
 			const char *str = vm_stringify(vm, &v, buf, sizeof(buf));
 			process_escape_sequences(str, stdout);
 			putchar('\n');
             decref(vm, &v);
 			ASSERT_STACK(-1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_JMP:
+		VM_CASE(JMP):
 		{
-            int rel = read_int(vm, ins, 0);
+            int rel = ins->c;
 			sf->ip += rel;
 			ASSERT_STACK(0);
+			// Loops count towards compiling the function like calls do, it carries on in machine code from the loop head
+			if(rel < 0 && vm->jit.threshold > 0 && sf->compiled && !sf->compiled->native &&
+			   ++sf->compiled->calls == vm->jit.threshold && jit_compile(vm, sf->compiled))
+				VM_ENTER_NATIVE();
 		}
-		break;
+		VM_NEXT();
 
-		case OP_UNDEF:
+		VM_CASE(UNDEF):
 		{
-			push(vm, undef);
+			VM_PUSH(undef);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_JZ:
+		// REF; STORE; POP
+		VM_CASE(STORE_LOCAL):
 		{
-            int rel = read_int(vm, ins, 0);
+			Variable *dst = VM_LOCAL(ins->c);
+			Variable src = VM_POP();
+			gc_barrier(vm, &src);
+			*dst = src;
+			sf->ip += 2;
+			ASSERT_STACK(-1);
+		}
+		VM_NEXT();
+
+		// LOAD; LOAD
+		VM_CASE(LOAD2):
+		{
+			VM_PUSH(*VM_LOCAL(ins->c));
+			VM_PUSH(*VM_LOCAL(ins[1].c));
+			sf->ip++;
+			ASSERT_STACK(2);
+		}
+		VM_NEXT();
+
+		// LOAD; LOAD_FIELD
+		VM_CASE(LOAD_LOCAL_FIELD):
+		{
+			VM_PUSH(*VM_LOCAL(ins->c));
+		}
+		VM_FUSED_NEXT(LOAD_FIELD);
+
+		// LOAD; CONST_1 or PUSH integer; BINOP + or -; REF; STORE; POP on the same local
+		VM_CASE(INC_LOCAL):
+		{
+			Variable *lv = VM_LOCAL(ins->c);
+			if(lv->type != VAR_INTEGER)
+				goto op_LOAD;
+			int64_t step = ins[1].opcode == OP_CONST_1 ? 1 : ins[1].c;
+			int op = ins[2].c;
+			lv->u.ival = (op == '+' || op == TK_PLUS_ASSIGN) ? lv->u.ival + step : lv->u.ival - step;
+			sf->ip += 5;
+			ASSERT_STACK(0);
+		}
+		VM_NEXT();
+
+		// TEST; JZ
+		VM_CASE(TEST_JZ):
+		{
+			thr->result = pop_int(vm);
+			sf->ip++;
+			if(thr->result == 0)
+				sf->ip += ins[1].c;
+			ASSERT_STACK(-1);
+		}
+		VM_NEXT();
+
+		// TEST; JNZ
+		VM_CASE(TEST_JNZ):
+		{
+			thr->result = pop_int(vm);
+			sf->ip++;
+			if(thr->result != 0)
+				sf->ip += ins[1].c;
+			ASSERT_STACK(-1);
+		}
+		VM_NEXT();
+
+		// BINOP comparison; TEST; JZ
+		VM_CASE(CMP_JZ):
+		{
+			Variable *rhs = &thr->stack[thr->sp - 1];
+			Variable *lhs = rhs - 1;
+			int result;
+			if(lhs->type == VAR_INTEGER && rhs->type == VAR_INTEGER)
+			{
+				VM_COMPARE(result, ins->c, lhs->u.ival, rhs->u.ival);
+			}
+			else if(lhs->type == VAR_FLOAT && rhs->type == VAR_FLOAT)
+			{
+				VM_COMPARE(result, ins->c, lhs->u.fval, rhs->u.fval);
+			}
+			else
+			{
+				// Leaves the result for the TEST and JZ that follow
+				Variable b = VM_POP();
+				Variable a = VM_POP();
+				VM_PUSH(binop(vm, &a, &b, ins->c));
+				ASSERT_STACK(-1);
+				VM_NEXT();
+			}
+			thr->sp -= 2;
+			thr->result = result;
+			sf->ip += 2;
+			if(!result)
+				sf->ip += ins[2].c;
+			ASSERT_STACK(-2);
+		}
+		VM_NEXT();
+
+		VM_CASE(JUMP_TABLE):
+		VM_CASE(SWITCH_HASH):
+		{
+			if(!sf->compiled)
+				vm_error(vm, "No switch tables outside of a compiled function");
+			SwitchTable *t = &sf->compiled->switch_tables[ins->c];
+			Variable v = VM_POP();
+			int target = switch_target(vm, t, ins->opcode == OP_JUMP_TABLE, ins->a, &v);
+			decref(vm, &v);
+			sf->ip = target == -1 ? t->default_target : target;
+			ASSERT_STACK(-1);
+		}
+		VM_NEXT();
+
+		VM_CASE(JZ):
+		{
+            int rel = ins->c;
 			if(thr->result == 0)
 			{
 				sf->ip += rel;
 			}
 			ASSERT_STACK(0);
 		}
-		break;
+		VM_NEXT();
 		
 		// case OP_SELF:
 		// {
@@ -1463,18 +2545,18 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 		// }
 		// break;
 		
-		case OP_GLOBAL:
+		VM_CASE(GLOBAL):
 		{
 			Variable *glob = &vm->global_object;
 			if(glob->type != VAR_OBJECT)
 				vm_error(vm, "Error! Corrupted global object");
-			bool as_ref = read_int(vm, ins, 0) > 0;
+			bool as_ref = ins->a > 0;
 			if(as_ref)
-				push(vm, ref(vm, glob));
+				VM_PUSH(ref(vm, glob));
 			else
-				push(vm, *glob);
+				VM_PUSH(*glob);
 		}
-		break;
+		VM_NEXT();
 
 		// case OP_GLOB:
 		// {
@@ -1492,17 +2574,31 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 		// }
 		// break;
 
-		case OP_FIELD_REF:
+		VM_CASE(FIELD_REF):
 		{
 			Variable *obj = pop_ref(vm);
-			char prop[256] = { 0 };
-			pop_string(vm, prop, sizeof(prop));
+			int key = -1;
+			int64_t index = 0;
+			if(ins->a)
+				key = ins->c;
+			else if(!pop_index(vm, &index))
+				key = pop_field_key(vm);
+			FieldCache *fc = key != -1 ? field_cache(sf, ins) : NULL;
+			if(fc && obj->type == VAR_OBJECT)
+			{
+				ObjectField *field = field_cache_lookup(vm, fc, obj->u.oval, key);
+				if(field)
+				{
+					VM_PUSH(ref(vm, field->value));
+					VM_NEXT();
+				}
+			}
 			if(obj->type != VAR_OBJECT)
 			{
 				if(obj->type == VAR_UNDEFINED) // Coerce to object... Just make this a new object
 				{
 					gsc_add_tagged_object(vm->ctx, "UNDEFINED coerced to OBJECT");
-					*obj = pop(vm);
+					*obj = VM_POP();
 					// *obj = vm_create_object(vm);
 				}
 				else
@@ -1515,11 +2611,16 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			{
 				vm_error(vm, "object is null");
 			}
+			if(key == -1)
+			{
+				VM_PUSH(ref(vm, object_index(vm, o, index, true)));
+				VM_NEXT();
+			}
 
 			bool handled = false;
 			if(o->proxy)
 			{
-				gsc_Function func = object_find_callable(vm, o, "__set", prop);
+				gsc_Function func = object_find_callable(vm, o, vm->keys.set, key);
 				if(func)
 				{
 					push(vm, *obj);
@@ -1532,61 +2633,74 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			}
 			if(!handled)
 			{
-				int idx = vm_string_index(vm, prop);
-				ObjectField *entry = vm_object_upsert(vm, o, string(vm, idx)); // We're using the StringTable unique char* pointer to pass to upsert, prop wouldn't work
-				push(vm, ref(vm, entry->value));
+				ObjectField *entry = vm_object_upsert(vm, o, key);
+				VM_PUSH(ref(vm, entry->value));
+				if(fc)
+					field_cache_update(vm, fc, o, key, entry);
 			}
-			// ASSERT_STACK(-1);
+			// ASSERT_STACK(ins->a ? 0 : -1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_LOAD_FIELD:
+		VM_CASE(LOAD_FIELD):
 		{
-			Variable obj = pop(vm);
+			Variable obj = VM_POP();
+			int64_t index;
 			if(obj.type == VAR_VECTOR)
 			{
+				if(ins->a)
+					vm_error(vm, "'%s' is not a integer", string(vm, ins->c));
 				int idx = pop_int(vm);
 				if(idx < 0 || idx > 2)
 					vm_error(vm, "Index %d out of bounds for vector", idx);
 				vm_pushfloat(vm, obj.u.vval[idx]);
 			} else if(obj.type == VAR_STRING)
 			{
-				Variable key = pop(vm);
 				const char *str = variable_string(vm, &obj);
-				size_t n = strlen(str);
-				if( variable_is_string(&key))
-				{
-					const char *keystr = variable_string(vm, &key);
-					if(!strcmp(keystr, "length") || !strcmp(keystr, "size")) // TODO: optimize?
-					{
-						vm_pushinteger(vm, n);
-					} else
-					{
-						vm_error(vm, "'%s' is not an object", variable_type_names[obj.type]);
-					}
-				} else if(key.type == VAR_INTEGER)
+				size_t n = obj.u.sval.length;
+				Variable *top = vm_stack_top(vm, -1);
+				if(!ins->a && top->type == VAR_INTEGER)
 				{
-					size_t idx = key.u.ival;
-					// size_t idx = (size_t)pop_int(vm);
+					size_t idx = pop_int(vm);
 					if(idx > n)
 						vm_error(vm, "%d out bounds for string '%s' (length %d)", idx, str, n);
 					vm_pushstring_n(vm, str + idx, 1);
 				} else
 				{
-					vm_error(vm, "Unsupported key type '%s' for string", variable_type_names[key.type]);
+					if(!ins->a && !variable_is_string(top))
+						vm_error(vm, "Unsupported key type '%s' for string", variable_type_names[top->type]);
+					int key = ins->a ? ins->c : pop_field_key(vm);
+					if(key != vm->keys.length && key != vm->keys.size)
+						vm_error(vm, "'%s' is not an object", variable_type_names[obj.type]);
+					vm_pushinteger(vm, n);
 				}
 			}
+			else if(obj.type == VAR_OBJECT && !ins->a && pop_index(vm, &index))
+			{
+				Variable *v = object_index(vm, obj.u.oval, index, false);
+				VM_PUSH(v ? *v : undef);
+			}
 			else
 			{
-				char prop[256] = { 0 };
-				pop_string(vm, prop, sizeof(prop));
-				op_load_field_object_(vm, obj, prop);
+				int key = ins->a ? ins->c : pop_field_key(vm);
+				FieldCache *fc = obj.type == VAR_OBJECT ? field_cache(sf, ins) : NULL;
+				ObjectField *field = fc ? field_cache_lookup(vm, fc, obj.u.oval, key) : NULL;
+				if(field)
+				{
+					VM_PUSH(*field->value);
+				}
+				else
+				{
+					field = op_load_field_object_(vm, obj, key);
+					if(fc && field)
+						field_cache_update(vm, fc, obj.u.oval, key, field);
+				}
 			}
-			ASSERT_STACK(-1);
+			ASSERT_STACK(ins->a ? 0 : -1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_STORE:
+		VM_CASE(STORE):
 		{
 			if(gsc_type(vm->ctx, -1) == VAR_FUNCTION)
 			{
@@ -1606,8 +2720,9 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			} else
 			{
 				Variable *dst = pop_ref(vm);
-				Variable src = pop(vm);
+				Variable src = VM_POP();
 				incref(vm, &src);
+				gc_barrier(vm, &src);
 				// TODO: move
 				// if(dst->type == VAR_OBJECT)
 				// {
@@ -1620,136 +2735,155 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 				dst->type = src.type;
 				memcpy(&dst->u, &src.u, sizeof(dst->u));
 				// decref(vm, &dst);
-				push(vm, *dst);
+				VM_PUSH(*dst);
 				ASSERT_STACK(-1);
 			}
+		}
+		VM_NEXT();
 
-			if(vm->flags & VM_FLAG_VERBOSE)
-				print_locals(vm);
+		VM_CASE(LOAD):
+		{
+			Variable *lv = VM_LOCAL(ins->c);
+			VM_PUSH(*lv);
+			ASSERT_STACK(1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_LOAD:
+		VM_CASE(LOAD_BOXED):
 		{
-			// TODO: check out of bounds
-			// allocate dynamically
-			int slot = read_int(vm, ins, 0);
-			Variable *lv = local(vm, slot);
-			// lv->refcount = 0xdeadbeef;
-			push(vm, *lv);
+			Variable *lv = VM_LOCAL(ins->c);
+			VM_PUSH(*lv->u.refval);
 			ASSERT_STACK(1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_CONST_0:
-		case OP_CONST_1:
+		VM_CASE(CONST_0):
+		VM_CASE(CONST_1):
 		{
-			push(vm, integer(vm, ins->opcode == OP_CONST_1 ? 1 : 0));
+			VM_PUSH(integer(vm, ins->opcode == OP_CONST_1 ? 1 : 0));
 			ASSERT_STACK(1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_REF:
+		VM_CASE(REF):
 		{
-			// TODO: check out of bounds
-			// allocate dynamically
-			int slot = read_int(vm, ins, 0);
-			Variable *lv = local(vm, slot);
-			// lv->refcount = 0xdeadbeef;
-			push(vm, ref(vm, lv));
-			// push(vm, lv);
+			Variable *lv = VM_LOCAL(ins->c);
+			VM_PUSH(ref(vm, lv));
 			ASSERT_STACK(1);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_JNZ:
+		VM_CASE(REF_BOXED):
 		{
-            int rel = read_int(vm, ins, 0);
+			// The slot already holds the reference to the box
+			Variable *lv = VM_LOCAL(ins->c);
+			VM_PUSH(*lv);
+			ASSERT_STACK(1);
+		}
+		VM_NEXT();
+
+		VM_CASE(JNZ):
+		{
+            int rel = ins->c;
 			if(thr->result != 0)
 			{
 				sf->ip += rel;
 			}
 			ASSERT_STACK(0);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_TEST:
+		VM_CASE(TEST):
 		{
 			thr->result = pop_int(vm);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_PUSH:
+		VM_CASE(PUSH):
 		{
-            int var_type = read_int(vm, ins, 0);
             Variable v = var(vm);
-			switch(var_type)
+			switch(ins->a)
 			{
-				case AST_LITERAL_TYPE_FUNCTION:
+				case AST_LITERAL_TYPE_FLOAT:
 				{
-					v.type = VAR_FUNCTION;
-					v.u.funval.function = read_string_index(vm, ins, 1);
-					if(check_operand(ins, 2, OPERAND_TYPE_INDEXED_STRING))
-						v.u.funval.file = read_string_index(vm, ins, 2);
-					else
-						v.u.funval.file = -1;
+					v.type = VAR_FLOAT;
+					memcpy(&v.u.fval, &ins->c, sizeof(v.u.fval));
 				}
 				break;
-				case AST_LITERAL_TYPE_FLOAT:
+				case AST_LITERAL_TYPE_BOOLEAN:
 				{
-					v.type = VAR_FLOAT;
-					v.u.fval = read_float(vm, ins, 1);
+					v.type = VAR_BOOLEAN;
+					v.u.ival = ins->c;
 				}
 				break;
-				// case AST_LITERAL_TYPE_ANIMATION:
-				// {
-				// 	v.type = VAR_ANIMATION;
-				// 	v.u.sval = string(vm, read_string_index(vm, ins, 1));
-				// }
-				// break;
-                case AST_LITERAL_TYPE_STRING:
+				case AST_LITERAL_TYPE_INTEGER:
 				{
-					v.type = VAR_INTERNED_STRING;
-					v.u.ival = read_string_index(vm, ins, 1);
+					v.type = VAR_INTEGER;
+					v.u.ival = ins->c;
 				}
 				break;
-                case AST_LITERAL_TYPE_LOCALIZED_STRING:
+				case AST_LITERAL_TYPE_UNDEFINED:
 				{
-					v.type = VAR_INTERNED_STRING;
-					v.u.ival = read_string_index(vm, ins, 1);
+					v.type = VAR_UNDEFINED;
 				}
 				break;
-				case AST_LITERAL_TYPE_BOOLEAN:
+				default:
 				{
-					v.type = VAR_BOOLEAN;
-					v.u.ival = read_int(vm, ins, 1);
+                    vm_error(vm, "Unhandled var type %d", ins->a);
+				}
+				break;
+			}
+            VM_PUSH(v);
+			ASSERT_STACK(1);
+		}
+		VM_NEXT();
+
+		VM_CASE(PUSH_CONST):
+		{
+			Constant *k = &sf->constants[ins->c];
+            Variable v = var(vm);
+			switch(k->type)
+			{
+				case AST_LITERAL_TYPE_FUNCTION:
+				{
+					v.type = VAR_FUNCTION;
+					v.u.funval.function = k->value.function.function;
+					v.u.funval.file = k->value.function.file;
+				}
+				break;
+                case AST_LITERAL_TYPE_STRING:
+                case AST_LITERAL_TYPE_LOCALIZED_STRING:
+				{
+					v.type = VAR_INTERNED_STRING;
+					v.u.ival = k->value.string_index;
 				}
 				break;
 				case AST_LITERAL_TYPE_INTEGER:
 				{
 					v.type = VAR_INTEGER;
-					v.u.ival = read_int(vm, ins, 1);
+					v.u.ival = k->value.integer;
 				}
 				break;
-				case AST_LITERAL_TYPE_UNDEFINED:
+				case AST_LITERAL_TYPE_VECTOR:
 				{
-					v.type = VAR_UNDEFINED;
+					v.type = VAR_VECTOR;
+					memcpy(v.u.vval, k->value.vector, sizeof(v.u.vval));
 				}
 				break;
 				default:
 				{
-                    vm_error(vm, "Unhandled var type %d", var_type);
+                    vm_error(vm, "Unhandled constant type %d", k->type);
 				}
 				break;
 			}
-            push(vm, v);
+            VM_PUSH(v);
 			ASSERT_STACK(1);
 		}
-		break;
+		VM_NEXT();
 		
-		case OP_WAIT:
+		VM_CASE(WAIT):
 		{
-			Variable v = pop(vm);
+			Variable v = VM_POP();
 			if(v.type != VAR_UNDEFINED)
 			{
 				Variable duration = coerce_float(vm, &v);
@@ -1761,143 +2895,173 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 				thr->state = VM_THREAD_WAITING_FRAME;
 			}
 		}
-		break;
+		return true;
 
-		case OP_WAITTILL:
+		VM_CASE(WAITTILL):
 		{
-			int nargs = read_int(vm, ins, 0);
+			int nargs = ins->b;
 			int nrefs = nargs - 1;
-			Variable objVar = pop(vm);
-			Variable nameVar = pop(vm);
+			Variable objVar = VM_POP();
+			Variable nameVar = VM_POP();
 			if(objVar.type != VAR_OBJECT)
 				vm_error(vm, "waittill: '%s' is not an object", variable_type_names[objVar.type]);
 			const char *key = variable_string(vm, &nameVar);
 			int nameIdx = vm_string_index(vm, key);
 			if(nameIdx == -1)
 				vm_error(vm, "waittill: key '%s' not found", key);
-			int captureCount = nrefs < VM_MAX_EVENT_ARGS ? nrefs : VM_MAX_EVENT_ARGS;
-			for(int i = 0; i < captureCount; i++)
+			// The references stay on the stack until the event arrives
+			for(int i = 0; i < nrefs; i++)
 			{
-				Variable ref = pop(vm);
-				if(ref.type != VAR_REFERENCE)
-					vm_error(vm, "waittill: expected reference, got %s", variable_type_names[ref.type]);
-				thr->waittill.arguments[i] = ref;
+				Variable *ref = vm_stack_top(vm, -1 - i);
+				if(ref->type != VAR_REFERENCE)
+					vm_error(vm, "waittill: expected reference, got %s", variable_type_names[ref->type]);
 			}
-			for(int i = captureCount; i < nrefs; i++)
-				pop(vm);
-			thr->waittill.numargs = captureCount;
+			thr->waittill.numargs = nrefs;
 			thr->waittill.name = nameIdx;
 			thr->waittill.object = objVar.u.oval;
+			thr->waittill.wait = register_event_wait(vm, thr, objVar.u.oval, nameIdx, VM_EVENT_WAITTILL);
 			thr->state = VM_THREAD_WAITING_EVENT;
-			push(vm, undef);
 		}
-		break;
+		return true;
 
-		case OP_NOTIFY:
+		VM_CASE(NOTIFY):
 		{
-			int nargs = read_int(vm, ins, 0);
+			int nargs = ins->b;
 			int ndata = nargs - 1;
-			Variable objVar = pop(vm);
-			Variable nameVar = pop(vm);
+			Variable objVar = VM_POP();
+			Variable nameVar = VM_POP();
 			if(objVar.type != VAR_OBJECT)
 				vm_error(vm, "notify: '%s' is not an object", variable_type_names[objVar.type]);
-			Variable args[VM_MAX_EVENT_ARGS];
-			int argCount = ndata < VM_MAX_EVENT_ARGS ? ndata : VM_MAX_EVENT_ARGS;
-			for(int i = 0; i < argCount; i++)
-				args[i] = pop(vm);
-			for(int i = argCount; i < ndata; i++)
-				pop(vm);
 			const char *key = variable_string(vm, &nameVar);
-			vm_notify_args(vm, objVar.u.oval, key, args, argCount);
-			push(vm, undef);
+			VMEvent *ev = new_event(vm, objVar.u.oval, event_name(vm, key), ndata);
+			for(int i = 0; i < ndata; i++)
+				ev->arguments[i] = VM_POP();
+			post_event(vm, ev);
+			VM_PUSH(undef);
+			if(thr->state == VM_THREAD_INACTIVE)
+				return false; // Ended on its own notify
 		}
-		break;
+		VM_NEXT();
 
-		case OP_ENDON:
+		VM_CASE(ENDON):
 		{
-			int nargs = read_int(vm, ins, 0);
+			int nargs = ins->b;
 			(void)nargs;
-			Variable objVar = pop(vm);
-			Variable nameVar = pop(vm);
+			Variable objVar = VM_POP();
+			Variable nameVar = VM_POP();
+			if(objVar.type != VAR_OBJECT)
+				vm_error(vm, "endon: '%s' is not an object", variable_type_names[objVar.type]);
 			const char *key = variable_string(vm, &nameVar);
 			int idx = vm_string_index(vm, key);
 			if(idx == -1)
 				vm_error(vm, "endon: key '%s' not found", key);
-			if(thr->endon_string_count >= VM_MAX_ENDON_STRINGS)
-				vm_error(vm, "endon: too many endon strings (%d)", VM_MAX_ENDON_STRINGS);
-			thr->endon[thr->endon_string_count++] = idx;
-			push(vm, undef);
+			VMEventWait *w = register_event_wait(vm, thr, objVar.u.oval, idx, VM_EVENT_ENDON);
+			w->thread_next = thr->endon;
+			thr->endon = w;
+			VM_PUSH(undef);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_UNARY:
+		VM_CASE(NOT_INT):
 		{
-			int op = read_int(vm, ins, 0);
-			Variable arg = pop(vm);
+			Variable *arg = &thr->stack[thr->sp - 1];
+			if(arg->type != VAR_INTEGER && arg->type != VAR_BOOLEAN)
+				goto unary_generic;
+			arg->u.ival = !arg->u.ival;
+		}
+		VM_NEXT();
+
+		VM_CASE(NEG_INT):
+		{
+			Variable *arg = &thr->stack[thr->sp - 1];
+			if(arg->type != VAR_INTEGER)
+				goto unary_generic;
+			arg->u.ival = -arg->u.ival;
+		}
+		VM_NEXT();
+
+		VM_CASE(NEG_FLOAT):
+		{
+			Variable *arg = &thr->stack[thr->sp - 1];
+			if(arg->type != VAR_FLOAT)
+				goto unary_generic;
+			arg->u.fval = -arg->u.fval;
+		}
+		VM_NEXT();
+
+		VM_CASE(UNARY):
+		{
+			if(!ins->a)
+			{
+				ins->opcode = quicken_unary(vm_stack_top(vm, -1), ins->c);
+				if(ins->opcode != OP_UNARY)
+					VM_DISPATCH();
+				ins->a = 1;
+			}
+			if(0)
+			{
+			unary_generic:
+				ins->opcode = OP_UNARY;
+				ins->a = 1;
+			}
+			int op = ins->c;
+			Variable arg = VM_POP();
 			Variable result = unary(vm, &arg, op);
-			push(vm, result);
+			VM_PUSH(result);
 			ASSERT_STACK(0);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_TABLE:
+		VM_CASE(TABLE):
 		{
 			gsc_add_tagged_object(vm->ctx, "OP_TABLE");
 			// push(vm, vm_create_object(vm));
 		}
-		break;
+		VM_NEXT();
 
-		case OP_RET:
+		VM_CASE(RET):
 		{
 			if(thr->bp < 0)
 				vm_error(vm, "bp < 0");
 
-			// buf_free(sf->locals);
-			for(int i = 0; i < sf->local_count; i++)
-			{
-				object_pool_deallocate(&vm->pool.uo, sf->locals[i]);
-			}
+			leave_function(vm, sf);
 			if(--thr->bp < 0)
 			{
 				thr->state = VM_THREAD_INACTIVE;
-				if(thr->return_value) // TODO: FIXME
-				{
-					*thr->return_value = pop(vm);
-				}
-				else
-				{
-					pop(vm); // retval
-				}
+				VM_POP(); // retval
 				return false;
 			}
+			sf = stack_frame(vm, thr);
+			VM_ENTER_NATIVE();
 		}
-		break;
+		VM_NEXT();
 
-		case OP_VECTOR:
+		VM_CASE(VECTOR):
 		{
-			int nelements = read_int(vm, ins, 0);
+			int nelements = ins->b;
 			if(nelements != 3)
 				vm_error(vm, "Vector must have 3 components");
 			Variable v = var(vm);
 			v.type = VAR_VECTOR;
 			for(int k = 0; k < nelements; ++k)
 			{
-				Variable el = pop(vm);
+				Variable el = VM_POP();
 				float f = coerce_float(vm, &el).u.fval;
 				v.u.vval[k] = f;
 			}
-			push(vm, v);
+			VM_PUSH(v);
 		}
-		break;
+		VM_NEXT();
 
-		case OP_CALL_PTR:
-		case OP_CALL:
+		VM_CASE(CALL_PTR):
+		VM_CASE(CALL):
 		{
 			int function = -1;
 			const char *file = NULL;
+			CallTarget *target = NULL;
 			if(ins->opcode == OP_CALL_PTR)
 			{
-				Variable func = pop(vm);
+				Variable func = VM_POP();
 				if(func.type != VAR_FUNCTION)
 				{
 					vm_error(vm, "'%s' is not a function pointer", variable_type_names[func.type]);
@@ -1907,11 +3071,14 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 					file = string(vm, func.u.funval.file);
 			} else
 			{
-				function = read_string_index(vm, ins, 0);
-				if(check_operand(ins, 1, OPERAND_TYPE_INDEXED_STRING))
-					file = read_string(vm, ins, 1);
+				Constant *k = &sf->constants[ins->c];
+				function = k->value.function.function;
+				if(k->value.function.file != -1)
+					file = string(vm, k->value.function.file);
+				if(sf->compiled)
+					target = &sf->compiled->call_targets[ins->c];
 			}
-			int call_flags = read_int(vm, ins, 3);
+			int call_flags = ins->a;
 			// Object *object = NULL;
 			if(call_flags & VM_CALL_FLAG_METHOD)
 			{
@@ -1926,16 +3093,10 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 				file = sf->file;
 			// info(vm, "CALLING -> %s::%s %d\n", file, function, nargs);
 			const char *function_name = string(vm, function);
-			vm->debug_info.function = function_name;
 
 			if(call_flags & VM_CALL_FLAG_THREADED)
 			{
-				Thread *nt = object_pool_allocate(&vm->pool.threads, Thread);
-				if(!nt)
-					vm_error(vm, "No threads left");
-				memset(nt, 0, sizeof(Thread));
-				nt->bp = 0;
-				nt->state = VM_THREAD_ACTIVE;
+				Thread *nt = allocate_thread(vm);
 				pop_thread(vm, thr); //nargs
 				
 				for(size_t k = 0; k < nargs + 1; ++k)
@@ -1943,10 +3104,12 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 					Variable arg = pop_thread(vm, thr);
 					push_thread(vm, nt, arg);
 				}
-				push_thread(vm, thr, undef); // return value for caller thread
-				nt->return_value = &thr->stack[thr->sp - 1]; // TODO: FIXME
+				push_thread(vm, thr, undef); // return value for caller thread, the one of the new thread is discarded
 				push_thread(vm, nt, integer(vm, nargs));
-				call_function(vm, nt, file, function_name, function, nargs, true, call_flags);
+				if(target)
+					call_target(vm, nt, target, file, function_name, nargs, true, call_flags);
+				else
+					call_function(vm, nt, file, function_name, nargs, true, call_flags);
 				nt->caller.file = sf->file;
 				nt->caller.function = sf->function;
 				add_thread(vm, nt);
@@ -1955,124 +3118,433 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			}
 			else
 			{
-				if(++thr->bp >= VM_FRAME_SIZE)
-					vm_error(vm, "thr->bp >= VM_FRAME_SIZE");
-				if(!call_function(vm, thr, file, function_name, function, nargs, false, call_flags))
+				if(++thr->bp >= thr->frame_capacity)
+					grow_frames(vm, thr);
+				bool entered = target ? call_target(vm, thr, target, file, function_name, nargs, false, call_flags)
+									  : call_function(vm, thr, file, function_name, nargs, false, call_flags);
+				if(!entered)
+				{
 					thr->bp--;
+					if(thr->state == VM_THREAD_INACTIVE)
+						return false; // A native function notified an event the thread ends on
+				}
+				sf = stack_frame(vm, thr);
+				VM_ENTER_NATIVE();
 			}
 			// ASSERT_STACK(-nargs);
 		}
+		VM_NEXT();
+
+		VM_BINOP_CASE(ADD_INT_INT, VAR_INTEGER, VAR_INTEGER, ival, ival, +)
+		VM_BINOP_CASE(SUB_INT_INT, VAR_INTEGER, VAR_INTEGER, ival, ival, -)
+		VM_BINOP_CASE(MUL_INT_INT, VAR_INTEGER, VAR_INTEGER, ival, ival, *)
+		VM_BINOP_CASE(LT_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, <)
+		VM_BINOP_CASE(LE_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, <=)
+		VM_BINOP_CASE(GT_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, >)
+		VM_BINOP_CASE(GE_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, >=)
+		VM_BINOP_CASE(EQ_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, ==)
+		VM_BINOP_CASE(NE_INT_INT, VAR_INTEGER, VAR_BOOLEAN, ival, ival, !=)
+		VM_BINOP_CASE(ADD_FLOAT_FLOAT, VAR_FLOAT, VAR_FLOAT, fval, fval, +)
+		VM_BINOP_CASE(SUB_FLOAT_FLOAT, VAR_FLOAT, VAR_FLOAT, fval, fval, -)
+		VM_BINOP_CASE(MUL_FLOAT_FLOAT, VAR_FLOAT, VAR_FLOAT, fval, fval, *)
+		VM_BINOP_CASE(LT_FLOAT_FLOAT, VAR_FLOAT, VAR_BOOLEAN, ival, fval, <)
+		VM_BINOP_CASE(LE_FLOAT_FLOAT, VAR_FLOAT, VAR_BOOLEAN, ival, fval, <=)
+		VM_BINOP_CASE(GT_FLOAT_FLOAT, VAR_FLOAT, VAR_BOOLEAN, ival, fval, >)
+		VM_BINOP_CASE(GE_FLOAT_FLOAT, VAR_FLOAT, VAR_BOOLEAN, ival, fval, >=)
+		VM_VECTOR_CASE(ADD_VEC_VEC, +)
+		VM_VECTOR_CASE(SUB_VEC_VEC, -)
+
+		VM_CASE(BINOP):
+		{
+			if(!ins->a)
+			{
+				ins->opcode = quicken_binop(vm_stack_top(vm, -2), vm_stack_top(vm, -1), ins->c);
+				if(ins->opcode != OP_BINOP)
+					VM_DISPATCH();
+				ins->a = 1;
+			}
+			if(0)
+			{
+			binop_generic:
+				ins->opcode = OP_BINOP;
+				ins->a = 1;
+			}
+			int op = ins->c;
+			Variable b = VM_POP();
+			Variable a = VM_POP();
+			Variable result = binop(vm, &a, &b, op);
+			VM_PUSH(result);
+			ASSERT_STACK(-1);
+		}
+		VM_NEXT();
+
+		VM_CASE(INVALID):
+		default:
+		{
+            vm_error(vm, "Opcode %s unhandled", opcode_names[ins->opcode]);
+		}
 		break;
+	}
+	return true;
+
+native:
+	switch(sf->compiled->native(vm))
+	{
+		case VM_NATIVE_END: return false;
+		case VM_NATIVE_FRAME:
+			sf = stack_frame(vm, thr);
+			VM_ENTER_NATIVE();
+			break;
+	}
+	sf = stack_frame(vm, thr);
+	VM_NEXT();
+}
+
+int vm_native_step(VM *vm, Instruction *ins)
+{
+	Thread *thr = vm->thread;
+	int bp = thr->bp;
+	if(!vm_execute(vm, ins, true))
+		return VM_NATIVE_END;
+	return thr->bp != bp ? VM_NATIVE_FRAME : 0;
+}
+
+bool vm_execute_instruction(VM *vm, Instruction *ins, Constant *constants)
+{
+	StackFrame *sf = stack_frame(vm, vm->thread);
+	Constant *prev = sf->constants;
+	CompiledFunction *prev_compiled = sf->compiled;
+	sf->constants = constants;
+	sf->compiled = NULL;
+	bool result = vm_execute(vm, ins, true);
+	sf->constants = prev;
+	sf->compiled = prev_compiled;
+	return result;
+}
+
+void vm_cleanup(VM* vm)
+{
+	// Everything else lives in pools, large strings are allocated on their own
+	VariableStringHeader *lists[] = { vm->gc.strings, vm->gc.sweep_strings };
+	for(int i = 0; i < COUNT_OF(lists); ++i)
+	{
+		for(VariableStringHeader *it = lists[i]; it;)
+		{
+			VariableStringHeader *next = it->gc_next;
+			if(string_class(it->size) == -1)
+				free(it);
+			it = next;
+		}
+	}
+	vm->gc.strings = NULL;
+	vm->gc.sweep_strings = NULL;
+
+	// So are stacks that outgrew the block size classes
+	int n = thread_count(vm);
+	for(int i = 0; i < n; ++i)
+		free_thread_storage(vm, vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads]);
+	for(int i = 0; i < vm->timers.count; ++i)
+		free_thread_storage(vm, vm->timers.heap[i]);
+	for(int i = 0; i < vm->waits.bucket_count; ++i)
+	{
+		for(VMEventWait *it = vm->waits.buckets[i]; it; it = it->next)
+		{
+			if(it->kind == VM_EVENT_WAITTILL)
+				free_thread_storage(vm, it->thread);
+		}
+	}
+	free_thread_storage(vm, &vm->temp_thread);
+	if(vm->events.base)
+		free_block(vm, vm->events.base, vm->events.capacity);
+	if(vm->keys.folded)
+		free_block(vm, vm->keys.folded, vm->keys.capacity * sizeof(int));
+	jit_free(vm);
+}
+
+// static uint64_t permute64(uint64_t x)
+// {
+//     x += 1111111111111111111u; x ^= x >> 32;
+//     x *= 1111111111111111111u; x ^= x >> 32;
+//     return x;
+// }
+// Maybe use integer keys instead?
+
+static uint64_t hash_key(int key)
+{
+	uint64_t x = (uint64_t)key + 1111111111111111111u;
+	x ^= x >> 32;
+	x *= 1111111111111111111u;
+	x ^= x >> 32;
+	return x * 1111111111111111111u;
+}
+
+static Shape *shape_root(VM *vm, Object *proxy)
+{
+	for(Shape *it = vm->shapes.roots; it; it = it->sibling)
+	{
+		if(it->proxy == proxy)
+			return it;
+	}
+	Shape *root = object_pool_allocate(&vm->pool.shapes, Shape);
+	if(!root)
+		return NULL;
+	*root = (Shape) { .proxy = proxy, .sibling = vm->shapes.roots };
+	vm->shapes.roots = root;
+	return root;
+}
+
+// NULL once there are too many fields or shapes, the object is then moved to the trie
+static Shape *shape_transition(VM *vm, Shape *shape, int key)
+{
+	if(!shape || shape->slot_count >= VM_SHAPE_MAX_SLOTS)
+		return NULL;
+	for(Shape *it = shape->transitions; it; it = it->sibling)
+	{
+		if(it->key == key)
+			return it;
+	}
+	Shape *next = object_pool_allocate(&vm->pool.shapes, Shape);
+	if(!next)
+		return NULL;
+	*next = (Shape) { .parent = shape,
+					  .proxy = shape->proxy,
+					  .key = key,
+					  .slot_count = shape->slot_count + 1,
+					  .sibling = shape->transitions };
+	shape->transitions = next;
+	return next;
+}
+
+static int shape_find(Shape *shape, int key)
+{
+	for(Shape *it = shape; it->parent; it = it->parent)
+	{
+		if(it->key == key)
+			return it->slot_count - 1;
+	}
+	return -1;
+}
+
+static int slot_capacity(int n)
+{
+	int cap = 4;
+	while(cap < n)
+		cap *= 2;
+	return cap;
+}
+
+static void free_slots(VM *vm, Object *o)
+{
+	if(o->slots)
+		free_block(vm, o->slots, slot_capacity(o->field_count) * sizeof(ObjectField *));
+	o->slots = NULL;
+}
+
+static void trie_insert(Object *o, ObjectField *field)
+{
+	ObjectField **m = &o->fields;
+	for(uint64_t h = hash_key(field->key); *m; h <<= 2)
+		m = &(*m)->child[h >> 62];
+	*m = field;
+}
 
-		case OP_BINOP:
-		{
-			int op = read_int(vm, ins, 0);
-			Variable b = pop(vm);
-			Variable a = pop(vm);
-			Variable result = binop(vm, &a, &b, op);
-			info(vm, "binop result: %d\n", result.u.ival);
-			push(vm, result);
-			ASSERT_STACK(-1);
-		}
-		break;
+// The field list stays in insertion order, the trie is built over it
+static void object_to_dictionary(VM *vm, Object *o)
+{
+	ObjectField *fields = o->fields;
+	o->fields = NULL;
+	for(ObjectField *it = fields; it; it = it->next)
+		trie_insert(o, it);
+	if(!o->fields)
+		o->fields = fields;
+	free_slots(vm, o);
+	o->shape = NULL;
+}
 
-		default:
+static void object_set_shape_slot(VM *vm, Object *o, Shape *shape, ObjectField *field)
+{
+	int n = o->field_count;
+	if(n == 0 || (n >= 4 && (n & (n - 1)) == 0))
+	{
+		ObjectField **slots = allocate_block(vm, slot_capacity(n + 1) * sizeof(ObjectField *));
+		if(o->slots)
 		{
-            vm_error(vm, "Opcode %s unhandled", opcode_names[ins->opcode]);
+			memcpy(slots, o->slots, n * sizeof(ObjectField *));
+			free_block(vm, o->slots, slot_capacity(n) * sizeof(ObjectField *));
 		}
-		break;
+		o->slots = slots;
 	}
-	if(vm->flags & VM_FLAG_VERBOSE)
+	o->slots[n] = field;
+	o->shape = shape;
+}
+
+static ObjectField *object_find(Object *o, int key)
+{
+	if(o->shape)
 	{
-		// print_locals(vm);
-		// print_globals(vm);
-		vm_stacktrace(vm);
-		// vm_print_thread_info(vm);
-		// getchar();
+		int slot = shape_find(o->shape, key);
+		return slot == -1 ? NULL : o->slots[slot];
 	}
-	return true;
+	ObjectField *m = o->field_count ? o->fields : NULL;
+	for(uint64_t h = hash_key(key); m; h <<= 2)
+	{
+		if(m->key == key)
+			return m;
+		m = m->child[h >> 62];
+	}
+	return NULL;
 }
 
-void vm_cleanup(VM* vm)
+// The list of the first field is also the root of the trie, that's why it's only linked in the trie once it has a shape no more
+static ObjectField *object_add(VM *vm, Object *o, int key)
 {
+	Shape *shape = NULL;
+	if(o->shape || o->field_count == 0)
+		shape = shape_transition(vm, o->shape ? o->shape : shape_root(vm, o->proxy), key);
+	if(!shape && (o->shape || o->field_count == 0))
+		object_to_dictionary(vm, o);
+
+	ObjectField *new_node = object_pool_allocate(&vm->pool.object_fields, ObjectField);
+	if(!new_node)
+		vm_error(vm, "No object fields left");
+	vm->gc.allocated++;
+	memset(new_node, 0, sizeof(ObjectField));
+	new_node->key = key;
+	Variable *v = object_pool_allocate(&vm->pool.variables, Variable);
+	if(!v)
+		vm_error(vm, "No variables left");
+	v->type = VAR_UNDEFINED;
+	new_node->value = v;
+	new_node->next = NULL;
+
+	if(shape)
+		object_set_shape_slot(vm, o, shape, new_node);
+	else if(o->field_count > 0)
+		trie_insert(o, new_node);
+	*o->tail = new_node;
+	o->tail = &new_node->next;
+	o->field_count++;
+	return new_node;
 }
 
-// static uint64_t permute64(uint64_t x)
-// {
-//     x += 1111111111111111111u; x ^= x >> 32;
-//     x *= 1111111111111111111u; x ^= x >> 32;
-//     return x;
-// }
-// Maybe use integer keys instead?
+// Lookups only when vm is NULL
+ObjectField *vm_object_upsert(VM *vm, Object *o, int key)
+{
+	ObjectField *field = object_find(o, key);
+	if(!vm)
+		return field;
+	if(o->flags & VM_OBJECT_FLAG_PROXY)
+		vm->shapes.epoch++; // Likely about to be written to
+	if(field)
+		return field;
+	return object_add(vm, o, key);
+}
 
-#include <ctype.h>
+static Variable *array_append(VM *vm, Object *o)
+{
+	if(o->array_count == o->array_capacity)
+		o->array = grow_block(vm, o->array, sizeof(Variable), o->array_count, &o->array_capacity, o->array_count + 1, INT_MAX);
+	Variable *v = &o->array[o->array_count++];
+	v->type = VAR_UNDEFINED;
+	return v;
+}
 
-static uint64_t vm_hash_string(const char *s)
+// Keys right after the array part extend it, other integer keys are fields, these don't go through __get/__set
+// Returns NULL if the key isn't there unless it's created
+static Variable *object_index(VM *vm, Object *o, int64_t n, bool create)
 {
-	uint64_t h = 0x100;
-	for(ptrdiff_t i = 0; s[i]; i++)
+	if(n >= 0 && n < o->array_count)
+		return &o->array[n];
+	bool append = create && n == o->array_count && n < INT_MAX;
+	if(!(o->flags & VM_OBJECT_FLAG_INDEX_FIELDS))
 	{
-		h ^= tolower(s[i]);
-		h *= 1111111111111111111u;
+		if(append)
+			return array_append(vm, o);
+		if(!create)
+			return NULL;
 	}
-	return h;
+	char str[32];
+	snprintf(str, sizeof(str), "%" PRId64, n);
+	int key = vm_string_index(vm, str);
+	ObjectField *field = vm_object_upsert(NULL, o, key);
+	if(!field && append)
+		return array_append(vm, o);
+	if(!create)
+		return field ? field->value : NULL;
+	o->flags |= VM_OBJECT_FLAG_INDEX_FIELDS;
+	return vm_object_upsert(vm, o, key)->value;
 }
 
-#ifndef _WIN32
-	#include <strings.h>
-	#ifndef stricmp
-		#define stricmp strcasecmp
-	#endif
-#endif
-
-ObjectField *vm_object_upsert(VM *vm, Object *o, const char *key)
+// The shape is rebuilt from the root of the new proxy, with the fields in the same slots
+void vm_object_set_proxy(VM *vm, Object *o, Object *proxy)
 {
-	ObjectField **m = &o->fields;
-	for(uint64_t h = vm_hash_string(key);; h <<= 2)
-	{
-		if(!*m)
-		{
-			if(!vm)
-			{
-				return NULL;
-			}
+	if(o->proxy == proxy)
+		return;
+	o->proxy = proxy;
+	if(proxy)
+		proxy->flags |= VM_OBJECT_FLAG_PROXY;
+	if(o->flags & VM_OBJECT_FLAG_PROXY)
+		vm->shapes.epoch++;
+	if(!o->shape)
+		return;
+	Shape *shape = shape_root(vm, proxy);
+	for(ObjectField *it = o->fields; it && shape; it = it->next)
+		shape = shape_transition(vm, shape, it->key);
+	if(shape)
+		o->shape = shape;
+	else
+		object_to_dictionary(vm, o);
+}
 
-			if(!o->tail)
-			{
-				o->fields = NULL;
-				o->tail = &o->fields;
-			}
+static FieldCache *field_cache(StackFrame *sf, Instruction *ins)
+{
+	if(!sf->compiled)
+		return NULL;
+	return &sf->compiled->field_caches[ins->b];
+}
 
-			ObjectField *new_node = object_pool_allocate(&vm->pool.uo, ObjectField);
-			if(!new_node)
-				vm_error(vm, "No object fields left");
-			o->field_count++;
-			memset(new_node, 0, sizeof(ObjectField));
-			new_node->key = key;
-			Variable *v = object_pool_allocate(&vm->pool.uo, Variable);
-			if(!v)
-				vm_error(vm, "No variables left");
-			v->type = VAR_UNDEFINED;
-			new_node->value = v;
-			new_node->next = NULL;
-			
-			*m = new_node;
-			*o->tail = new_node;
-			o->tail = &new_node->next;
-			return new_node;
-		}
-		if(!stricmp((*m)->key, key))
-		{
-			return *m;
-		}
-		m = &(*m)->child[h >> 62];
+static ObjectField *field_cache_lookup(VM *vm, FieldCache *fc, Object *o, int key)
+{
+	if(fc->key != key || fc->epoch != vm->shapes.epoch || !o->shape)
+		return NULL;
+	for(int i = 0; i < fc->count; ++i)
+	{
+		if(fc->entries[i].shape == o->shape)
+			return o->slots[fc->entries[i].slot];
 	}
 	return NULL;
 }
 
+// Only for plain fields of objects with a shape, proxies are left out because writing them changes the epoch
+static void field_cache_update(VM *vm, FieldCache *fc, Object *o, int key, ObjectField *field)
+{
+	if(!o->shape || (o->flags & VM_OBJECT_FLAG_PROXY))
+		return;
+	if(fc->key != key || fc->epoch != vm->shapes.epoch)
+	{
+		fc->key = key;
+		fc->epoch = vm->shapes.epoch;
+		fc->count = 0;
+	}
+	int slot = 0;
+	while(o->slots[slot] != field)
+		slot++;
+	// Megamorphic sites keep replacing the last entry
+	int i = fc->count < FIELD_CACHE_ENTRIES ? fc->count++ : FIELD_CACHE_ENTRIES - 1;
+	fc->entries[i].shape = o->shape;
+	fc->entries[i].slot = slot;
+}
+
 void get_object_field(VM *vm, Variable *ov, const char *key)
 {
-	op_load_field_object_(vm, *ov, key);
+	int64_t n = string_index_value(key);
+	if(n >= 0 && ov->type == VAR_OBJECT)
+	{
+		Variable *v = object_index(vm, ov->u.oval, n, false);
+		push(vm, v ? *v : undef);
+		return;
+	}
+	op_load_field_object_(vm, *ov, vm_field_key(vm, key));
 	// int idx = vm_string_index(vm, key);
 	// Object *o = object_for_var(ov);
 	// ObjectField *entry = vm_object_upsert(NULL, o, string(vm, idx));
@@ -2087,7 +3559,6 @@ void get_object_field(VM *vm, Variable *ov, const char *key)
 
 void vm_get_object_field(VM *vm, int obj_index, const char *key)
 {
-	int idx = vm_string_index(vm, key);
 	Variable *ov = vm_stack(vm, obj_index);
 	if(ov->type != VAR_OBJECT)
 		vm_error(vm, "'%s' is not an object", variable_type_names[ov->type]);
@@ -2103,23 +3574,30 @@ void vm_get_object_field(VM *vm, int obj_index, const char *key)
 	// }
 }
 
+// Names that spell an index, e.g. "0", are integer keys
+static Variable *object_upsert_name(VM *vm, Object *o, const char *name)
+{
+	int64_t n = string_index_value(name);
+	if(n >= 0)
+		return object_index(vm, o, n, true);
+	return vm_object_upsert(vm, o, vm_field_key(vm, name))->value;
+}
+
 void set_object_field(VM *vm, Variable *ov, const char *key)
 {
-	int idx = vm_string_index(vm, key);
-	Object *o = object_for_var(ov);
-	ObjectField *entry = vm_object_upsert(vm, o, string(vm, idx));
-	*entry->value = pop(vm);
+	Variable *v = object_upsert_name(vm, object_for_var(ov), key);
+	*v = pop(vm);
+	gc_barrier(vm, v);
 }
 
 void vm_set_object_field(VM *vm, int obj_index, const char *key)
 {
-	int idx = vm_string_index(vm, key);
 	Variable *ov = vm_stack(vm, obj_index);
 	if(ov->type != VAR_OBJECT)
 		vm_error(vm, "'%s' is not an object", variable_type_names[ov->type]);
-	Object *o = object_for_var(ov);
-	ObjectField *entry = vm_object_upsert(vm, o, string(vm, idx));
-	*entry->value = pop(vm);
+	Variable *v = object_upsert_name(vm, object_for_var(ov), key);
+	*v = pop(vm);
+	gc_barrier(vm, v);
 }
 
 void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *default_self, int max_threads)
@@ -2132,18 +3610,42 @@ void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *defa
 	vm->random_state = time(0);
 	vm->frame = 0;
 	vm->thread_buffer = allocator->malloc(allocator->ctx, sizeof(Thread*) * max_threads);
+	vm->timers.heap = allocator->malloc(allocator->ctx, sizeof(Thread*) * max_threads);
 	snprintf(vm->default_self, sizeof(vm->default_self), "%s", default_self);
-	memset(vm->events, 0, sizeof(vm->events));
-	vm->event_count = 0;
-	if(!uo_init(&vm->pool.uo, (1 << 16), -1, allocator))
-		vm_error(vm, "Failed to initialize union objects");
-	// variable_init(&vm->pool.variables, (1 << 19), -1, allocator);
-	// object_init(&vm->pool.objects, (1 << 19), -1, allocator);
-	// object_field_init(&vm->pool.object_fields, (1 << 19), -1, allocator);
+	vm->events.max_events = VM_DEFAULT_MAX_EVENTS;
+	// These grow in chunks of their initial size as needed
+	if(!variable_init(&vm->pool.variables, (1 << 14), 0, allocator))
+		vm_error(vm, "Failed to initialize variables");
+	if(!object_field_init(&vm->pool.object_fields, (1 << 13), 0, allocator))
+		vm_error(vm, "Failed to initialize object fields");
+	if(!object_init(&vm->pool.objects, (1 << 12), 0, allocator))
+		vm_error(vm, "Failed to initialize objects");
+	if(!shape_init(&vm->pool.shapes, 256, VM_MAX_SHAPES, allocator))
+		vm_error(vm, "Failed to initialize shapes");
+	for(int i = 0; i < VM_STRING_CLASS_COUNT; ++i)
+	{
+		if(!object_pool_init(&vm->pool.strings[i], vm_string_class_sizes[i], alignof(VariableStringHeader), (1 << 10), 0, allocator))
+			vm_error(vm, "Failed to initialize strings");
+	}
 	if(!thread_init(&vm->pool.threads, max_threads, -1, allocator))
 		vm_error(vm, "Failed to initialize threads");
-	if(!stack_frame_init(&vm->pool.stack_frames, max_threads * VM_FRAME_SIZE, -1, allocator))
-		vm_error(vm, "Failed to initialize stack frames");
+	if(!event_wait_init(&vm->pool.event_waits, 256, 0, allocator))
+		vm_error(vm, "Failed to initialize event waits");
+	for(int i = 0; i < VM_BLOCK_CLASS_COUNT; ++i)
+	{
+		// Variables in the blocks stay on 16 byte boundaries
+		if(!object_pool_init(&vm->pool.blocks[i], vm_block_class_sizes[i], sizeof(Variable), 0, 0, allocator))
+			vm_error(vm, "Failed to initialize thread stacks");
+	}
+	vm->thread_stack_size = VM_STACK_SIZE;
+	vm->thread_frame_size = VM_FRAME_SIZE;
+	init_thread(vm, &vm->temp_thread);
+
+	vm->keys.size = vm_field_key(vm, "size");
+	vm->keys.length = vm_field_key(vm, "length");
+	vm->keys.get = vm_field_key(vm, "__get");
+	vm->keys.set = vm_field_key(vm, "__set");
+	vm->keys.call = vm_field_key(vm, "__call");
 
 	size_t N = 16384;
 	char *arena_mem = allocator->malloc(allocator->ctx, N);
@@ -2156,8 +3658,13 @@ void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *defa
 	// hash_table_init(&vm->c_functions, 10, &allocator);
     // hash_table_init(&vm->c_methods, 10, &allocator);
 
-	vm->global_object = vm_create_object(vm);
-	vm->global_object.u.oval->refcount = VM_REFCOUNT_NO_FREE;
+	vm->gc.gray = allocator->malloc(allocator->ctx, sizeof(Object *) * VM_GC_GRAY_STACK_SIZE);
+	if(!vm->gc.gray)
+		vm_error(vm, "Failed to allocate gray stack");
+	vm->gc.threshold = VM_GC_MIN_THRESHOLD;
+
+	vm->global_object.type = VAR_OBJECT;
+	vm->global_object.u.oval = vm_allocate_pinned_object(vm);
 
 	// for(size_t i = 0; i < VAR_GLOB_MAX; ++i)
 	// {
@@ -2186,12 +3693,6 @@ void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *defa
 	// arena_init(&vm->arena, buf, n);
 }
 
-typedef struct
-{
-	void *callback;
-	void *ctx;
-} CallbackFunction;
-
 void vm_register_callback_function(VM *vm, const char *name, void *callback, void *ctx)
 {
 	CallbackFunction *f = vm->allocator->malloc(vm->allocator->ctx, sizeof(CallbackFunction));
@@ -2284,6 +3785,52 @@ Variable *vm_stack_top(VM *vm, int idx)
 	return &thr->stack[thr->sp + idx];
 }
 
+#ifdef VM_PROFILE
+typedef struct
+{
+	uint64_t count;
+	int first, second;
+} ProfileEntry;
+
+static int compare_profile_entries(const void *a, const void *b)
+{
+	uint64_t x = ((const ProfileEntry *)a)->count, y = ((const ProfileEntry *)b)->count;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void vm_profile_dump(VM *vm, FILE *fp, int max_entries)
+{
+	ProfileEntry *entries = malloc(sizeof(ProfileEntry) * OP_MAX * OP_MAX);
+	if(!entries)
+		return;
+	double total = vm->profile.instructions ? (double)vm->profile.instructions : 1.0;
+	int n = 0;
+	for(int i = 0; i < OP_MAX; ++i)
+	{
+		if(vm->profile.opcodes[i])
+			entries[n++] = (ProfileEntry){ vm->profile.opcodes[i], i, -1 };
+	}
+	qsort(entries, n, sizeof(ProfileEntry), compare_profile_entries);
+	fprintf(fp, "opcodes:\n");
+	for(int i = 0; i < n && i < max_entries; ++i)
+		fprintf(fp, "  %-16s %12" PRIu64 " %6.2f%%\n", opcode_names[entries[i].first], entries[i].count, entries[i].count * 100.0 / total);
+	n = 0;
+	for(int i = 0; i < OP_MAX; ++i)
+	{
+		for(int j = 0; j < OP_MAX; ++j)
+		{
+			if(vm->profile.pairs[i][j])
+				entries[n++] = (ProfileEntry){ vm->profile.pairs[i][j], i, j };
+		}
+	}
+	qsort(entries, n, sizeof(ProfileEntry), compare_profile_entries);
+	fprintf(fp, "pairs:\n");
+	for(int i = 0; i < n && i < max_entries; ++i)
+		fprintf(fp, "  %-16s %-16s %12" PRIu64 " %6.2f%%\n", opcode_names[entries[i].first], opcode_names[entries[i].second], entries[i].count, entries[i].count * 100.0 / total);
+	free(entries);
+}
+#endif
+
 const char *vm_cast_string(VM *vm, Variable *arg)
 {
 	switch(arg->type)
@@ -2397,23 +3944,15 @@ void vm_pushstring_n(VM *vm, const char *str, size_t n) // n is without \0
 {
 	Variable v = var(vm);
 	v.type = VAR_STRING;
-	v.u.sval = allocate_variable_string(vm, n + 1);
+	v.u.sval = allocate_variable_string(vm, n, n);
 	// v.u.sval = malloc(n + 1);
 	memcpy(v.u.sval.data, str, n);
-	v.u.sval.data[n] = 0;
 	push(vm, v);
 }
 
 void vm_pushstring(VM *vm, const char *str)
 {
-	Variable v = var(vm);
-	v.type = VAR_STRING;
-	int n = strlen(str);
-	v.u.sval = allocate_variable_string(vm, n + 1);
-	memcpy(v.u.sval.data, str, n);
-	v.u.sval.data[n] = 0;
-	// v.u.sval = strdup(str);
-	push(vm, v);
+	vm_pushstring_n(vm, str, strlen(str));
 }
 
 void vm_pushvector(VM *vm, float *vec)
@@ -2465,7 +4004,7 @@ void vm_pushundefined(VM *vm)
 }
 
 // TODO: make use of namespace
-static void call_c_function(VM *vm, const char *namespace, const char *function, int function_string_index, size_t nargs, int call_flags)
+static void call_c_function(VM *vm, const char *namespace, const char *function, CallbackFunction *cfunc, size_t nargs, int call_flags)
 {
 	vm->nargs = nargs;
 	vm->fsp = vm->thread->sp;
@@ -2477,7 +4016,6 @@ static void call_c_function(VM *vm, const char *namespace, const char *function,
 	int nret;
 	if(!(call_flags & VM_CALL_FLAG_METHOD))
 	{
-		CallbackFunction *cfunc = get_callback_function(vm, function);
 		if(!cfunc)
 		{
 			vm_error(vm, "No builtin function '%s::%s'", namespace, function);
@@ -2503,7 +4041,7 @@ static void call_c_function(VM *vm, const char *namespace, const char *function,
 					 o->debug_info.function,
 					 function);
 		}
-		gsc_Function func = object_find_callable(vm, o, "__call", function);
+		gsc_Function func = object_find_callable(vm, o, vm->keys.call, vm_field_key(vm, function));
 		if(!func)
 		{
 			vm_error(vm, "No builtin method '%s::%s' for %s", namespace, function, o->proxy->tag);
@@ -2543,11 +4081,18 @@ void vm_serialize_variable(VM *vm, Stream *s, Variable *v)
     {
         Object *o = v->u.oval;
         stream_printf(s, "{");
-        size_t n = o->field_count;
+        size_t n = o->field_count + o->array_count;
         size_t i = 0;
+        for(int k = 0; k < o->array_count; ++k)
+        {
+            stream_printf(s, "%d: ", k);
+            vm_serialize_variable(vm, s, &o->array[k]);
+            if(i++ < n - 1)
+            stream_printf(s, ",");
+        }
         for(ObjectField *it = o->fields; it; it = it->next)
         {
-            stream_printf(s, "%s: ", it->key);
+            stream_printf(s, "%s: ", string(vm, it->key));
             vm_serialize_variable(vm, s, it->value);
             if(i++ < n - 1)
             stream_printf(s, ",");
@@ -2577,15 +4122,15 @@ const char *vm_stack_frame_variable_name(VM *vm, StackFrame *sf, int index)
 	return vmf->variable_names[index];
 }
 
-static bool call_function(VM *vm, Thread *thr, const char *file, const char *function, int function_string_index, size_t nargs, bool reversed, int call_flags)
+static void leave_function(VM *vm, StackFrame *sf)
+{
+	CompiledFunction *vmf = sf->compiled;
+	for(int i = 0; vmf && i < vmf->boxed_local_count; ++i)
+		object_pool_deallocate(&vm->pool.variables, sf->locals[vmf->boxed_locals[i]].u.refval);
+}
+
+static void enter_function(VM *vm, Thread *thr, const char *file, const char *function, CompiledFunction *vmf, size_t nargs, bool reversed)
 {
-	// printf("call_function(%s::%s)\n", file, function);
-	CompiledFunction *vmf = vm->func_lookup(vm->ctx, file, function);
-    if(!vmf)
-    {
-		call_c_function(vm, file, function, function_string_index, nargs, call_flags);
-        return false;
-	}
 	// Object *prev_self = object_for_var(&vm->globals[VAR_GLOB_LEVEL]);
 	// if(thr->bp != 0)
 	// {
@@ -2597,23 +4142,26 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 	// thr->bp++;
 	StackFrame *sf = stack_frame(vm, thr);
 	// memset(sf, 0, sizeof(StackFrame));
-	// sf->locals = NULL;
 	// sf->self.u.oval = self ? self : prev_self;
-	// sf->local_count = vmf->local_count;
-	// sf->locals = new(&vm->arena, Variable, vmf->local_count);
-	sf->local_count = vmf->local_count;
-	for(size_t i = 0; i < vmf->local_count; ++i)
+
+	// The locals of this frame start where the ones of the caller end
+	int base = 0;
+	if(thr->bp > 0)
 	{
-		Variable *v = object_pool_allocate(&vm->pool.uo, Variable);
-		if(!v)
-			vm_error(vm, "No variables left");
-		v->type = VAR_UNDEFINED;
-		v->u.ival = 0;
-		sf->locals[i] = v;
-		// buf_push(sf->locals, (Variable) { 0 });
-		// sf->locals[i].type = VAR_UNDEFINED;
-		// sf->locals[i].u.ival = 0;
+		StackFrame *caller = &thr->frames[thr->bp - 1];
+		base = (caller->locals - thr->locals) + caller->local_count;
 	}
+	if(base + vmf->local_count > thr->local_capacity)
+		grow_locals(vm, thr, base + vmf->local_count);
+	if(!vmf->verified)
+		vm_error(vm, "'%s' hasn't been verified", function);
+	if(thr->sp + vmf->max_stack > thr->stack_capacity)
+		grow_stack(vm, thr, thr->sp + vmf->max_stack);
+	if(vm->jit.threshold > 0 && !vmf->native && ++vmf->calls == vm->jit.threshold)
+		jit_compile(vm, vmf);
+	sf->locals = thr->locals + base;
+	sf->local_count = vmf->local_count;
+	memset(sf->locals, 0, sizeof(Variable) * vmf->local_count);
 	pop_thread(vm, thr); //nargs
 	// + 1 for implicit self parameter
 	for(size_t i = 0; i < nargs + 1; ++i)
@@ -2623,13 +4171,24 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 		if(i < vmf->parameter_count + 1)
 		{
 			size_t local_idx = reversed ? (nargs + 1) - i - 1 : i;
-			*sf->locals[local_idx] = arg;
+			sf->locals[local_idx] = arg;
 		}
 	}
+	for(int i = 0; i < vmf->boxed_local_count; ++i)
+	{
+		Variable *lv = &sf->locals[vmf->boxed_locals[i]];
+		Variable *box = object_pool_allocate(&vm->pool.variables, Variable);
+		if(!box)
+			vm_error(vm, "No variables left");
+		*box = *lv;
+		*lv = ref(vm, box);
+	}
 	sf->file = file;
     sf->function = function;
     sf->instructions = vmf->instructions;
 	sf->instruction_count = vmf->instruction_count;
+	sf->constants = vmf->constants;
+	sf->compiled = vmf;
 	sf->variable_names = vmf->variable_names;
 	sf->source = vmf->file ? vmf->file->source : NULL;
 	sf->ip = 0;
@@ -2640,9 +4199,64 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 	// 	print_instruction(vm, &vmf->instructions[i], fp);
 	// fclose(fp);
 	// getchar();
+}
+
+static bool call_function(VM *vm, Thread *thr, const char *file, const char *function, size_t nargs, bool reversed, int call_flags)
+{
+	CompiledFunction *vmf = vm->func_lookup(vm->ctx, file, function);
+	if(!vmf)
+	{
+		CallbackFunction *cfunc = (call_flags & VM_CALL_FLAG_METHOD) ? NULL : get_callback_function(vm, function);
+		call_c_function(vm, file, function, cfunc, nargs, call_flags);
+		return false;
+	}
+	enter_function(vm, thr, file, function, vmf, nargs, reversed);
 	return true;
 }
 
+static void resolve_call_target(VM *vm, CallTarget *t, const char *file, const char *function)
+{
+	t->file = file;
+	t->target = vm->func_lookup(vm->ctx, file, function);
+	if(t->target)
+	{
+		t->kind = CALL_TARGET_SCRIPT;
+		return;
+	}
+	t->kind = CALL_TARGET_NATIVE;
+	t->target = get_callback_function(vm, function);
+}
+
+// Same as call_function, but the lookup is cached in the call target as long as the file matches
+static bool call_target(VM *vm, Thread *thr, CallTarget *t, const char *file, const char *function, size_t nargs, bool reversed, int call_flags)
+{
+	if(t->kind == CALL_TARGET_UNRESOLVED || t->file != file)
+		resolve_call_target(vm, t, file, function);
+	if(t->kind == CALL_TARGET_SCRIPT)
+	{
+		enter_function(vm, thr, file, function, t->target, nargs, reversed);
+		return true;
+	}
+	call_c_function(vm, file, function, t->target, nargs, call_flags);
+	return false;
+}
+
+void vm_link_function(VM *vm, CompiledFunction *cf)
+{
+	const char *self_file = string(vm, vm_string_index(vm, cf->file->name));
+	for(int i = 0; i < cf->constant_count; ++i)
+	{
+		Constant *k = &cf->constants[i];
+		CallTarget *t = &cf->call_targets[i];
+		t->kind = CALL_TARGET_UNRESOLVED;
+		if(k->type != AST_LITERAL_TYPE_FUNCTION)
+			continue;
+		const char *file = k->value.function.file == -1 ? self_file : string(vm, k->value.function.file);
+		resolve_call_target(vm, t, file, string(vm, k->value.function.function));
+	}
+}
+
+
 bool vm_call_function_thread(VM *vm, const char *file, const char *function, size_t nargs, Variable *self)
 {
 	Thread *old_thread = vm->thread; // temp_thread — args were pushed here by C API
@@ -2655,13 +4269,7 @@ bool vm_call_function_thread(VM *vm, const char *file, const char *function, siz
 	for(k = 0; k < nargs; ++k)
 		arg_buf[k] = pop_thread(vm, old_thread);
 
-	vm->thread = object_pool_allocate(&vm->pool.threads, Thread);
-	if(!vm->thread)
-		vm_error(vm, "No threads left");
-	memset(vm->thread, 0, sizeof(Thread));
-	vm->thread->bp = 0;
-	vm->thread->return_value = NULL;
-	vm->thread->state = VM_THREAD_ACTIVE;
+	vm->thread = allocate_thread(vm);
 	// push self onto new thread
 	if(self)
 	{
@@ -2677,8 +4285,11 @@ bool vm_call_function_thread(VM *vm, const char *file, const char *function, siz
 	for(k = nargs; k > 0; --k)
 		push_thread(vm, vm->thread, arg_buf[k - 1]);
 	push_thread(vm, vm->thread, integer(vm, nargs));
-	bool result = call_function(vm, vm->thread, file, function, vm_string_index(vm, function), nargs, true, 0);
-	add_thread(vm, vm->thread);
+	// Intern the file name so call targets resolved in it can be compared by pointer
+	file = string(vm, vm_string_index(vm, file));
+	bool result = call_function(vm, vm->thread, file, function, nargs, true, 0);
+	if(vm->thread->state != VM_THREAD_WAITING_EVENT)
+		add_thread(vm, vm->thread);
 	vm->thread = &vm->temp_thread;
 	return result;
 }
@@ -2692,40 +4303,259 @@ static bool variable_eq(Variable *a, Variable *b)
 	{
 		case VAR_FLOAT: return fabs(a->u.fval - b->u.fval) < eps;
 	}
-	return !memcmp(&a->u, &b->u, sizeof(a->u));
+	return same_value(a, b);
 }
 
-void vm_notify_args(VM *vm, Object *object, const char *key, const Variable *args, size_t nargs)
+// Killed by endon, the frames that didn't return still own their locals
+static void destroy_thread(VM *vm, Thread *t);
+
+#define VM_EVENT_WAIT_INITIAL_BUCKETS (64)
+
+static VMEventWait **event_wait_bucket(VM *vm, Object *object, int name)
+{
+	uint64_t h = ((uint64_t)(uintptr_t)object ^ ((uint64_t)name << 32)) * 0x9E3779B97F4A7C15ull;
+	return &vm->waits.buckets[(h >> 32) & (vm->waits.bucket_count - 1)];
+}
+
+static void link_event_wait(VM *vm, VMEventWait *w)
+{
+	VMEventWait **bucket = event_wait_bucket(vm, w->object, w->name);
+	w->next = *bucket;
+	w->prev = bucket;
+	if(*bucket)
+		(*bucket)->prev = &w->next;
+	*bucket = w;
+}
+
+static void unlink_event_wait(VM *vm, VMEventWait *w)
+{
+	*w->prev = w->next;
+	if(w->next)
+		w->next->prev = w->prev;
+	if(w->kind == VM_EVENT_WAITTILL)
+		vm->waits.waiting--;
+	vm->waits.count--;
+	object_pool_deallocate(&vm->pool.event_waits, w);
+}
+
+static void grow_event_waits(VM *vm)
+{
+	VMEventWait **prev = vm->waits.buckets;
+	int prev_count = vm->waits.bucket_count;
+	int count = prev_count ? prev_count * 2 : VM_EVENT_WAIT_INITIAL_BUCKETS;
+	vm->waits.buckets = allocate_block(vm, count * sizeof(VMEventWait *));
+	memset(vm->waits.buckets, 0, count * sizeof(VMEventWait *));
+	vm->waits.bucket_count = count;
+	for(int i = 0; i < prev_count; ++i)
+	{
+		for(VMEventWait *it = prev[i]; it;)
+		{
+			VMEventWait *next = it->next;
+			link_event_wait(vm, it);
+			it = next;
+		}
+	}
+	if(prev)
+		free_block(vm, prev, prev_count * sizeof(VMEventWait *));
+}
+
+static VMEventWait *register_event_wait(VM *vm, Thread *t, Object *object, int name, int kind)
+{
+	if(vm->waits.count >= vm->waits.bucket_count)
+		grow_event_waits(vm);
+	VMEventWait *w = object_pool_allocate(&vm->pool.event_waits, VMEventWait);
+	if(!w)
+		vm_error(vm, "Failed to allocate event wait");
+	*w = (VMEventWait) { .object = object, .name = name, .kind = kind, .thread = t };
+	link_event_wait(vm, w);
+	vm->waits.count++;
+	if(kind == VM_EVENT_WAITTILL)
+		vm->waits.waiting++;
+	return w;
+}
+
+static void unregister_endons(VM *vm, Thread *t)
+{
+	for(VMEventWait *it = t->endon; it;)
+	{
+		VMEventWait *next = it->thread_next;
+		unlink_event_wait(vm, it);
+		it = next;
+	}
+	t->endon = NULL;
+}
+
+static void wake_thread(VM *vm, Thread *t, const Variable *args, size_t nargs)
+{
+	int min = t->waittill.numargs;
+	if(nargs < min)
+		min = nargs;
+	for(int k = 0; k < min; k++)
+	{
+		Variable *dst = t->stack[t->sp - 1 - k].u.refval;
+		dst->type = args[k].type;
+		memcpy(&dst->u, &args[k].u, sizeof(dst->u));
+		gc_barrier(vm, dst);
+	}
+	t->sp -= t->waittill.numargs;
+	push_thread(vm, t, undef); // Result of the waittill call
+	unlink_event_wait(vm, t->waittill.wait);
+	t->waittill.wait = NULL;
+	t->state = VM_THREAD_ACTIVE;
+	add_thread(vm, t);
+}
+
+// Threads in the ring or the one running are destroyed once vm_run_threads gets to them
+static void kill_thread(VM *vm, Thread *t)
+{
+	t->ending = false;
+	unregister_endons(vm, t);
+	if(t->state == VM_THREAD_WAITING_EVENT)
+	{
+		unlink_event_wait(vm, t->waittill.wait);
+		t->waittill.wait = NULL;
+		destroy_thread(vm, t);
+	}
+	else if(t->timer_index != -1)
+	{
+		timer_remove(vm, t);
+		destroy_thread(vm, t);
+	}
+	else
+	{
+		t->state = VM_THREAD_INACTIVE;
+	}
+}
+
+// Waiters are woken and threads ending on the event are killed right away
+static void dispatch_event(VM *vm, VMEvent *ev)
+{
+	vm->events.dispatched++;
+	if(vm->waits.count == 0)
+		return;
+	Object *object = ev->object;
+	int name = ev->name;
+	VMEventWait **bucket = event_wait_bucket(vm, object, name);
+
+	// Ending takes precedence over waking up, a thread can wait on the event it ends on
+	Thread *ending = NULL;
+	for(VMEventWait *it = *bucket; it; it = it->next)
+	{
+		if(it->kind != VM_EVENT_ENDON || it->object != object || it->name != name || it->thread->ending)
+			continue;
+		it->thread->ending = true;
+		it->thread->kill_next = ending;
+		ending = it->thread;
+	}
+	for(VMEventWait *it = *bucket; it;)
+	{
+		VMEventWait *next = it->next;
+		if(it->kind == VM_EVENT_WAITTILL && it->object == object && it->name == name && !it->thread->ending)
+			wake_thread(vm, it->thread, ev->arguments, ev->numargs);
+		it = next;
+	}
+	while(ending)
+	{
+		Thread *t = ending;
+		ending = t->kill_next;
+		kill_thread(vm, t);
+	}
+}
+
+#define VM_EVENT_QUEUE_INITIAL_SIZE (4096)
+
+static int event_name(VM *vm, const char *key)
 {
 	int name = vm_string_index(vm, key);
 	if(name == -1)
 		vm_error(vm, "Can't find string '%s'", key);
-	if(vm->event_count >= VM_MAX_EVENTS)
-		vm_error(vm, "event overflow (%d)", VM_MAX_EVENTS);
-	VMEvent *ev = &vm->events[vm->event_count++];
+	return name;
+}
+
+// Every notify gets a record at the end of the queue, it's taken off again if it's dispatched right away
+// Nothing points into the queue, it's moved when it grows
+static VMEvent *new_event(VM *vm, Object *object, int name, int numargs)
+{
+	size_t size = vm_event_size(numargs);
+	VMEvent *ev = arena_allocate_memory_(&vm->events.queue, size, alignof(VMEvent), 1);
+	if(!ev)
+	{
+		size_t used = vm->events.queue.beg - vm->events.base;
+		size_t capacity = vm->events.capacity ? vm->events.capacity * 2 : VM_EVENT_QUEUE_INITIAL_SIZE;
+		while(capacity < used + size)
+			capacity *= 2;
+		char *base = allocate_block(vm, capacity);
+		if(vm->events.base)
+		{
+			memcpy(base, vm->events.base, used);
+			free_block(vm, vm->events.base, vm->events.capacity);
+		}
+		vm->events.base = base;
+		vm->events.capacity = capacity;
+		arena_init(&vm->events.queue, base + used, capacity - used);
+		ev = arena_allocate_memory_(&vm->events.queue, size, alignof(VMEvent), 1);
+	}
 	ev->object = object;
 	ev->name = name;
-	ev->active = 1;
-	for(size_t i = 0; i < nargs && i < VM_MAX_EVENT_ARGS; ++i)
-		ev->arguments[i] = args[i];
-	ev->numargs = (int)nargs;
+	ev->numargs = numargs;
+	return ev;
 }
 
-void vm_notify(VM *vm, Object *object, const char *key, size_t nargs)
+// Past max_events the event stays queued behind the others, the notifying thread carries on either way
+static void post_event(VM *vm, VMEvent *ev)
 {
-	Variable args[VM_MAX_EVENT_ARGS];
-	size_t count = 0;
+	if(vm->events.count == 0 && vm->events.dispatched < vm->events.max_events)
+	{
+		dispatch_event(vm, ev);
+		vm->events.queue.beg = (char *)ev;
+		return;
+	}
+	if(vm->events.count++ == 0)
+		info(vm, "More than %d events in a frame, deferring '%s'", vm->events.max_events, string(vm, ev->name));
+	vm->events.deferred++;
+	if(vm->events.count > vm->events.peak)
+		vm->events.peak = vm->events.count;
+}
 
-	for(size_t i = 1; i < nargs && count < VM_MAX_EVENT_ARGS; ++i)
+// Dispatches queued events in order as far as the budget goes and moves the rest to the front
+static void flush_events(VM *vm)
+{
+	char *it = vm->events.base;
+	while(vm->events.count > 0 && vm->events.dispatched < vm->events.max_events)
 	{
-		args[count++] = *vm_argv(vm, (int)i);
+		VMEvent *ev = (VMEvent *)it;
+		dispatch_event(vm, ev);
+		it += vm_event_size(ev->numargs);
+		vm->events.count--;
 	}
+	size_t remaining = vm->events.queue.beg - it;
+	memmove(vm->events.base, it, remaining);
+	vm->events.queue.beg = vm->events.base + remaining;
+}
+
+void vm_notify_args(VM *vm, Object *object, const char *key, const Variable *args, size_t nargs)
+{
+	VMEvent *ev = new_event(vm, object, event_name(vm, key), nargs);
+	memcpy(ev->arguments, args, nargs * sizeof(Variable));
+	post_event(vm, ev);
+}
 
-	vm_notify_args(vm, object, key, args, count);
+void vm_notify(VM *vm, Object *object, const char *key, size_t nargs)
+{
+	VMEvent *ev = new_event(vm, object, event_name(vm, key), nargs > 1 ? nargs - 1 : 0);
+	for(size_t i = 1; i < nargs; ++i)
+		ev->arguments[i - 1] = *vm_argv(vm, (int)i);
+	post_event(vm, ev);
 }
 
 static void run_thread(VM *vm)
 {
+	if(!(vm->flags & VM_FLAG_VERBOSE))
+	{
+		StackFrame *sf = stack_frame(vm, vm->thread);
+		vm_execute(vm, &sf->instructions[sf->ip++], false);
+		return;
+	}
 	while(vm->thread->state == VM_THREAD_ACTIVE)
     {
 		StackFrame *sf = stack_frame(vm, vm->thread);
@@ -2734,15 +4564,31 @@ static void run_thread(VM *vm)
 			vm_error(vm, "ip oob %d/%d", sf->ip, sf->instruction_count);
 		}
 	    Instruction *current = &sf->instructions[sf->ip++];
-		if(!vm_execute_instruction(vm, current))
+		print_instruction(vm, current, stdout);
+		if(!vm_execute(vm, current, true))
 		{
 			break;
 		}
+		if(current->opcode == OP_STORE)
+			print_locals(vm);
+		vm_stacktrace(vm);
     }
 }
 
+static void destroy_thread(VM *vm, Thread *t)
+{
+	unregister_endons(vm, t);
+	for(int k = 0; k <= t->bp; ++k)
+		leave_function(vm, &t->frames[k]);
+	free_thread(vm, t);
+}
+
 bool vm_run_threads(VM *vm, float dt)
 {
+	vm->events.dispatched = 0;
+	if(vm->events.count > 0)
+		flush_events(vm);
+
 	int N = thread_count(vm);
 	for(int i = 0; i < N; ++i)
 	{
@@ -2754,19 +4600,6 @@ bool vm_run_threads(VM *vm, float dt)
 			sf = &t->frames[t->bp];
 		// printf("Processing thread %s::%s (%s)\n", sf ? sf->file : "?", sf ? sf->function : "?", vm_thread_state_names[t->state]);
 		// getchar();
-		for(int j = 0; j < vm->event_count && t->state != VM_THREAD_INACTIVE; j++)
-		{
-			VMEvent *ev = &vm->events[j];
-			if(!ev->active) continue;
-			for(size_t k = 0; k < t->endon_string_count; ++k)
-			{
-				if(ev->name == t->endon[k])
-				{
-					t->state = VM_THREAD_INACTIVE;
-					break;
-				}
-			}
-		}
 		// if(t->state != VM_THREAD_INACTIVE)
 		// {
 		// 	add_thread(vm, t);
@@ -2775,12 +4608,10 @@ bool vm_run_threads(VM *vm, float dt)
 		{
 			case VM_THREAD_WAITING_TIME:
 			{
-				if(t->wait <= 0.f)
-				{
-					t->state = VM_THREAD_ACTIVE;
-					// printf("Thread %d resumed after wait\n", i);
-				}
-				t->wait -= dt;
+				// Sleeps in the timer heap until it's due
+				t->wake_time = vm->time + t->wait;
+				timer_insert(vm, t);
+				t = NULL;
 			}
 			break;
 
@@ -2792,13 +4623,7 @@ bool vm_run_threads(VM *vm, float dt)
 
 			case VM_THREAD_INACTIVE:
 			{
-				// TODO: cleanup
-				// for(size_t k = 0; k < t->bp; ++k)
-				// {
-				// 	StackFrame *sf = &t->frames[--t->bp];
-				// 	buf_free(sf->locals);
-				// }
-				object_pool_deallocate(&vm->pool.threads, t);
+				destroy_thread(vm, t);
 				t = NULL;
 			}
 			break;
@@ -2808,32 +4633,9 @@ bool vm_run_threads(VM *vm, float dt)
 				vm->thread = t;
 				run_thread(vm);
 				vm->thread = &vm->temp_thread;
-			}
-			break;
-
-			case VM_THREAD_WAITING_EVENT:
-			{
-				for(int j = 0; j < vm->event_count; j++)
-				{
-					VMEvent *ev = &vm->events[j];
-					if(!ev->active) continue;
-					if(ev->name == t->waittill.name && ev->object == t->waittill.object)
-					{
-						int min = t->waittill.numargs;
-						if(ev->numargs < min)
-							min = ev->numargs;
-						for(int k = 0; k < min; k++)
-						{
-							Variable *dst = t->waittill.arguments[k].u.refval;
-							Variable *src = &ev->arguments[k];
-							dst->type = src->type;
-							memcpy(&dst->u, &src->u, sizeof(dst->u));
-						}
-						t->state = VM_THREAD_ACTIVE;
-						ev->active = 0;
-						break;
-					}
-				}
+				// Waits off the ring until notified
+				if(t->state == VM_THREAD_WAITING_EVENT)
+					t = NULL;
 			}
 			break;
 		}
@@ -2842,14 +4644,15 @@ bool vm_run_threads(VM *vm, float dt)
 			add_thread(vm, t);
 	}
 
-	int write = 0;
-	for(int j = 0; j < vm->event_count; j++)
+	// Due threads run next frame, like the ones that stopped waiting in the ring
+	while(vm->timers.count > 0 && vm->timers.heap[0]->wake_time <= vm->time)
 	{
-		if(vm->events[j].active)
-			vm->events[write++] = vm->events[j];
+		Thread *t = timer_pop(vm);
+		t->state = VM_THREAD_ACTIVE;
+		add_thread(vm, t);
 	}
-	vm->event_count = write;
+	vm->time += dt;
 
 	vm->frame++;
-	return vm->thread_read_idx != vm->thread_write_idx;
+	return vm->thread_read_idx != vm->thread_write_idx || vm->timers.count > 0 || vm->waits.waiting > 0;
 }
@@ -17,6 +17,12 @@
 typedef struct VM VM;
 typedef int (*vm_CFunction)(VM *);
 
+typedef struct
+{
+	void *callback;
+	void *ctx;
+} CallbackFunction;
+
 int vm_checkobject(VM *vm, int idx);
 int64_t vm_checkinteger(VM *vm, int idx);
 bool vm_checkbool(VM *vm, int idx);
@@ -31,6 +37,7 @@ void vm_pushstring(VM *vm, const char *str);
 void vm_pushstring_n(VM *vm, const char *str, size_t n);
 void vm_pushvector(VM *vm, float*);
 int vm_string_index(VM *vm, const char *s);
+int vm_field_key(VM *vm, const char *s);
 
 typedef struct Variable Variable;
 typedef struct ObjectField ObjectField;
@@ -40,7 +47,7 @@ typedef struct ObjectField ObjectField;
 struct ObjectField
 {
 	ObjectField *child[4];
-	const char *key;
+	int key; // Lower-case interned string
 	Variable *value;
     // void *getter, *setter;
 	ObjectField *next;
@@ -54,6 +61,7 @@ enum { sizeof_ObjectField = sizeof(ObjectField) };
 // I guess I could change it in the future if need be, considering object prototypes are more powerful
 
 typedef struct Object Object;
+typedef struct Shape Shape;
 
 typedef struct
 {
@@ -75,18 +83,70 @@ struct Object
     // Object *base;
     Object *proxy;
     gsc_DebugInfo debug_info;
+    Object *gc_next; // Collector object list
+    int gc_mark;
+    int flags;
+    // Objects with a few fields find them through their shape, fields[i] in slots[i]
+    // Without a shape the fields are in the trie, unless there are none yet
+    Shape *shape;
+    ObjectField **slots;
+    // Integer keys 0..array_count-1, other integer keys are fields named by their decimal string
+    Variable *array;
+    int array_count;
+    int array_capacity;
 };
 enum { sizeof_Object = sizeof(Object) };
 
-ObjectField *vm_object_upsert(VM *vm, Object *obj, const char *key);
+#define VM_OBJECT_FLAG_PROXY (1) // Field lookups of other objects depend on it, see VM.shapes.epoch
+#define VM_OBJECT_FLAG_INDEX_FIELDS (2) // Some integer keys didn't fit the array and are fields
+
+// Objects with the same proxy that had the same fields added in the same order share a shape
+// Shapes form a transition tree for each proxy and are never freed
+struct Shape
+{
+    Shape *parent;
+    Object *proxy;
+    int key; // Added by the transition from the parent
+    int slot_count;
+    Shape *transitions;
+    Shape *sibling;
+};
+
+#define VM_SHAPE_MAX_SLOTS (32) // Objects with more fields are moved to the trie
+#define VM_MAX_SHAPES (1 << 14)
 
+ObjectField *vm_object_upsert(VM *vm, Object *obj, int key);
+void vm_object_set_proxy(VM *vm, Object *o, Object *proxy);
+
+// Values are at most 12 bytes so a Variable is a 16 byte cell with the type after them
+// Vectors are stored inline, strings and objects point to memory owned by the collector
+#pragma pack(push, 4)
 typedef struct
 {
-    size_t length;
     char *data;
+    int length; // Without the \0
 } VariableString;
+#pragma pack(pop)
+
+// Size classes for the blocks thread stacks and object slots are allocated in, larger ones are allocated on their own
+static const int vm_block_class_sizes[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+#define VM_BLOCK_CLASS_COUNT (8)
+
+// Size classes for string pools, including the header. Larger strings are allocated on their own
+static const int vm_string_class_sizes[] = { 32, 64, 128, 256 };
+#define VM_STRING_CLASS_COUNT (4)
 
-#pragma pack(push, 1)
+// Precedes the characters of every VariableString so the collector can find and free it
+typedef struct VariableStringHeader VariableStringHeader;
+struct VariableStringHeader
+{
+    VariableStringHeader *gc_next;
+    int size; // Including the header
+    int gc_mark;
+    int used; // Length of the longest string sharing these characters, the others are prefixes of it
+};
+
+#pragma pack(push, 4)
 typedef union
 {
     int64_t ival;
@@ -116,16 +176,14 @@ enum { sizeof_VariableValue = sizeof(VariableValue) };
 // #define VAR_FLAG_NONE (0)
 // #define VAR_FLAG_NO_FREE (1)
 
-#pragma pack(push, 8)
 struct Variable
 {
+	VariableValue u;
 	int type;
     // int flags;
     // int refcount;
-	VariableValue u;
     // Variable *next;
 };
-#pragma pack(pop)
 
 enum { sizeof_Variable = sizeof(Variable) };
 
@@ -134,10 +192,12 @@ enum { sizeof_Variable = sizeof(Variable) };
 #pragma pack(push, 8)
 typedef struct
 {
-    Variable *locals[VM_MAX_LOCALS];
+    Variable *locals; // Window into the thread's local stack
     int local_count;
     Instruction *instructions;
     int instruction_count;
+    Constant *constants;
+    CompiledFunction *compiled;
     const char *file, *function;
     const char *source;
     char **variable_names;
@@ -146,18 +206,24 @@ typedef struct
 #pragma pack(pop)
 enum { sizeof_StackFrame = sizeof(StackFrame) };
 
-#define VM_MAX_EVENT_ARGS (16)
+// Notifies past this many in a frame wait for the next frames, 0 in gsc_CreateOptions.max_events
+#define VM_DEFAULT_MAX_EVENTS (256)
 
+// Queued notify, the arguments follow it in the event queue
 typedef struct
 {
-    int name;
     Object *object;
-    Variable arguments[VM_MAX_EVENT_ARGS];
+    int name;
     int numargs;
-    int active;
+    Variable arguments[];
 } VMEvent;
 
-#define VM_MAX_EVENTS (256)
+static size_t vm_event_size(int numargs)
+{
+    return sizeof(VMEvent) + numargs * sizeof(Variable);
+}
+
+typedef struct VMEventWait VMEventWait;
 
 typedef enum
 {
@@ -171,33 +237,65 @@ typedef enum
 static const char *vm_thread_state_names[] = { "INACTIVE",		"ACTIVE",		 "WAITING_TIME",
 											   "WAITING_FRAME", "WAITING_EVENT", NULL };
 
+// Thread stacks start small and double until they reach these
 #define VM_STACK_SIZE (256)
 #define VM_FRAME_SIZE (32)
+#define VM_LOCAL_STACK_SIZE (512) // Locals of all frames on a thread
 // #define VM_THREAD_POOL_SIZE (2048)
 // #define VM_THREAD_POOL_SIZE (8192)
 
-#define VM_MAX_ENDON_STRINGS (8)
+typedef struct Thread Thread;
 
-typedef struct
+struct Thread
 {
     VMThreadState state;
-    Variable stack[VM_STACK_SIZE]; // Make pointers?
-    StackFrame frames[VM_FRAME_SIZE];
+    Variable *stack;
+    int stack_capacity;
+    StackFrame *frames;
+    int frame_capacity;
+    Variable *locals;
+    int local_capacity;
     // StackFrame *frame;
     int sp, bp;
     int result;
     float wait;
-    VMEvent waittill;
-    int endon[VM_MAX_ENDON_STRINGS];
-    int endon_string_count;
+    double wake_time; // For WAITING_TIME, once the thread is in the timer heap
+    uint32_t wake_sequence;
+    int timer_index; // -1 when not in the timer heap
+    struct
+    {
+        int name;
+        Object *object;
+        int numargs; // References on top of the stack that receive the event arguments
+        VMEventWait *wait;
+    } waittill;
+    VMEventWait *endon; // Events that end the thread
+    Thread *kill_next; // While ending threads in vm_notify_args
+    bool ending;
     struct{
 		const char *file, *function;
 	} caller;
-    Variable *return_value;
-} Thread;
+};
 
 enum { sizeof_Thread = sizeof(Thread) };
 
+enum
+{
+	VM_EVENT_WAITTILL,
+	VM_EVENT_ENDON
+};
+
+// A thread registered on an event of an object, either waiting for it or ending on it
+struct VMEventWait
+{
+	Object *object;
+	int name;
+	int kind;
+	Thread *thread;
+	VMEventWait *next, **prev; // Hash bucket
+	VMEventWait *thread_next; // Other endon registrations of the thread
+};
+
 // typedef struct VMFunction VMFunction;
 // struct VMFunction
 // {
@@ -208,6 +306,24 @@ enum { sizeof_Thread = sizeof(Thread) };
 
 #define VM_REFCOUNT_NO_FREE (0xdeadbeef)
 
+enum
+{
+	VM_GC_WHITE,
+	VM_GC_GRAY,
+	VM_GC_BLACK
+};
+
+typedef enum
+{
+	VM_GC_IDLE,
+	VM_GC_MARK,
+	VM_GC_SWEEP
+} VMGCState;
+
+#define VM_GC_DEFAULT_BUDGET_US (1000)
+#define VM_GC_MIN_THRESHOLD (4096)
+#define VM_GC_GRAY_STACK_SIZE (1 << 14)
+
 #define VM_FLAG_NONE (0)
 #define VM_FLAG_VERBOSE (1)
 
@@ -215,6 +331,8 @@ struct VM
 {
     jmp_buf *jmp;
     int max_threads;
+    int thread_stack_size; // Limits for each thread, see VM_STACK_SIZE
+    int thread_frame_size;
     Thread **thread_buffer;//[VM_THREAD_POOL_SIZE];
     int thread_read_idx;
     int thread_write_idx;
@@ -222,8 +340,51 @@ struct VM
     // size_t thread_count;
     Thread *thread;
     Thread temp_thread;
-    VMEvent events[VM_MAX_EVENTS];
-    int event_count;
+    // Events are dispatched as they're notified until max_events is reached, the rest are queued for the next frames
+    struct
+    {
+        Arena queue; // VMEvent records, oldest first
+        char *base;
+        int capacity;
+        int count; // Queued
+        int max_events;
+        int dispatched; // Since the last vm_run_threads
+        int deferred; // Total queued so far
+        int peak; // Largest backlog
+    } events;
+
+    // Threads in waittill are kept out of the thread ring, they're found by the (object, event) they wait on
+    // endon registrations are hashed the same way
+    struct
+    {
+        VMEventWait **buckets;
+        int bucket_count; // Power of two
+        int count;
+        int waiting; // Threads in waittill
+    } waits;
+
+    struct
+    {
+        Shape *roots; // One for each proxy
+        uint32_t epoch; // Changes when a proxy does, field caches from before are stale
+    } shapes;
+
+    // Field keys are interned lower-case, any other string index maps to its folded index here
+    struct
+    {
+        int *folded; // Folded index + 1, -(n + 1) for strings that spell an index n, 0 if not folded yet
+        int capacity;
+        int size, length, get, set, call;
+    } keys;
+
+    // Threads in WAITING_TIME are kept out of the thread ring, ordered by the time they wake up at
+    struct
+    {
+        Thread **heap;
+        int count;
+        uint32_t sequence; // Threads that wake up at the same time run in the order they went to sleep
+    } timers;
+    double time; // Sum of dt passed to vm_run_threads
 
 	int flags;
     // Variable globals[VAR_GLOB_MAX];
@@ -239,27 +400,64 @@ struct VM
     struct
     {
         ObjectPool threads;
-        ObjectPool stack_frames;
-        // ObjectPool object_fields;
-        // ObjectPool variables;
-        // ObjectPool objects;
-        ObjectPool uo;
+        ObjectPool event_waits;
+        ObjectPool blocks[VM_BLOCK_CLASS_COUNT];
+        ObjectPool object_fields;
+        ObjectPool variables;
+        ObjectPool objects;
+        ObjectPool shapes;
+        ObjectPool strings[VM_STRING_CLASS_COUNT];
 	} pool;
 	void *ctx;
     StringTable *strings;
     HashTrie callback_functions;
     // HashTrie callback_methods;
 	CompiledFunction *(*func_lookup)(void *ctx, const char *file, const char *function);
+	void (*mark_roots)(void *ctx); // Marks roots held outside the VM with vm_gc_mark
 
-    gsc_DebugInfo debug_info;
+    // Incremental mark and sweep collector, driven from vm_gc_step
+    struct
+    {
+        VMGCState state;
+        Object *objects; // Everything that can be collected
+        Object *pinned; // Owned by the host, never collected
+        VariableStringHeader *strings;
+        Object *sweep_objects; // Detached lists that are being swept
+        VariableStringHeader *sweep_strings;
+        Object **gray;
+        int gray_count;
+        bool gray_overflow;
+        size_t allocated; // Allocations since the last cycle
+        size_t threshold; // Start a new cycle once allocated reaches this
+        size_t survivors;
+        uint64_t cycles;
+        uint64_t freed;
+    } gc;
 
     int nargs, fsp;
 
+#ifdef VM_PROFILE
+    struct
+    {
+        uint64_t instructions;
+        uint64_t opcodes[OP_MAX];
+        uint64_t pairs[OP_MAX][OP_MAX]; // Adjacent instructions, indexed by the first and the second opcode
+        const Instruction *last;
+    } profile;
+#endif
+
     // struct
     // {
     //     int __call;
     // } string_index;
 
+    // Functions are compiled to machine code once they've been called jit.threshold times, 0 = never
+    struct
+    {
+        int threshold;
+        struct JitFunction *functions;
+    } jit;
+
     int frame;
     char default_self[64];
 };
@@ -279,6 +477,7 @@ void vm_cleanup(VM*);
 
 void vm_register_callback_function(VM *vm, const char *name, void *callback, void *ctx);
 void vm_register_c_function(VM *vm, const char *name, vm_CFunction callback);
+void vm_link_function(VM *vm, CompiledFunction *cf);
 
 const char *vm_stringify(VM *vm, Variable *v, char *buf, size_t n);
 size_t vm_argc(VM *vm);
@@ -301,6 +500,18 @@ Variable vm_pop(VM *vm);
 Variable *vm_stack(VM *vm, int idx);
 Variable *vm_stack_top(VM *vm, int idx);
 
+// Why native code, from the JIT or gsc_aot, handed the thread back to the interpreter
+enum
+{
+	VM_NATIVE_INTERPRET = 1, // Interpret the instruction at sf->ip, a wait or waittill
+	VM_NATIVE_FRAME,         // A call or return changed the frame
+	VM_NATIVE_END            // The thread ended
+};
+int vm_native_step(VM *vm, Instruction *ins); // Interprets a single instruction for native code, 0 or VM_NATIVE_*
+#ifdef VM_PROFILE
+void vm_profile_dump(VM *vm, FILE *fp, int max_entries); // Most executed opcodes and opcode pairs
+#endif
+
 bool vm_cast_bool(VM *vm, Variable *arg);
 int64_t vm_cast_int(VM *vm, Variable *arg);
 float vm_cast_float(VM *vm, Variable *arg);
@@ -308,4 +519,9 @@ void vm_cast_vector(VM *vm, Variable *arg, float *outvec);
 const char *vm_cast_string(VM *vm, Variable *arg);
 Object *vm_cast_object(VM *vm, Variable *arg);
 Object *vm_allocate_object(VM *vm);
-bool vm_execute_instruction(VM *vm, Instruction *ins);
+Object *vm_allocate_pinned_object(VM *vm);
+void vm_gc_mark(VM *vm, Variable *v);
+bool vm_gc_step(VM *vm, int budget_us);
+int vm_pool_stats(VM *vm, gsc_PoolStats *stats, int max_stats);
+void vm_gc_collect(VM *vm);
+bool vm_execute_instruction(VM *vm, Instruction *ins, Constant *constants);